@@ -9,15 +9,42 @@
 
 *******************************************************************************/
 
+#define _GNU_SOURCE
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sched.h>
+#include <poll.h>
+#include <elf.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <regex.h>
+#include <fnmatch.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*
 Function Declarations for builtin shell commands:
@@ -29,6 +56,30 @@ int lsh_mkdir(char **args);
 int lsh_cd(char **args);
 int lsh_help(char **args);
 int lsh_exit(char **args);
+int lsh_seq(char **args);
+int lsh_yes(char **args);
+int lsh_hashsum(char **args);
+int lsh_xargs(char **args);
+int lsh_set(char **args);
+int lsh_timeout(char **args);
+int lsh_retry(char **args);
+int lsh_on_change(char **args);
+int lsh_supervise(char **args);
+int lsh_limit(char **args);
+int lsh_cache(char **args);
+int lsh_export(char **args);
+int lsh_hash(char **args);
+int lsh_cat(char **args);
+int lsh_grep(char **args);
+int lsh_wc(char **args);
+int lsh_read(char **args);
+int lsh_record_builtin(char **args);
+int lsh_json(char **args);
+int lsh_csv(char **args);
+int lsh_tee(char **args);
+int lsh_lz4(char **args);
+int lsh_topk(char **args);
+int lsh_take(char **args);
 
 /*
 List of builtin commands, followed by their corresponding functions.
@@ -40,7 +91,36 @@ char *builtin_str[] = {
 	"mkdir",
 	"cd",
 	"help",
-	"exit"
+	"exit",
+	"seq",
+	"yes",
+	"hashsum",
+	"xargs",
+	"set",
+	"timeout",
+	"retry",
+	"on-change",
+	"supervise",
+	"limit",
+	"cache",
+	"export",
+	"hash",
+	"cat",
+	"grep",
+	"wc",
+	"read",
+	"where",
+	"sort-by",
+	"select",
+	"group-by",
+	"sum",
+	"json",
+	"csv",
+	"tee",
+	"lz4",
+	"grep-count",
+	"topk",
+	"take"
 };
 
 int(*builtin_func[]) (char **) = {
@@ -50,294 +130,12075 @@ int(*builtin_func[]) (char **) = {
 	&lsh_mkdir,
 	&lsh_cd,
 	&lsh_help,
-	&lsh_exit
+	&lsh_exit,
+	&lsh_seq,
+	&lsh_yes,
+	&lsh_hashsum,
+	&lsh_xargs,
+	&lsh_set,
+	&lsh_timeout,
+	&lsh_retry,
+	&lsh_on_change,
+	&lsh_supervise,
+	&lsh_limit,
+	&lsh_cache,
+	&lsh_export,
+	&lsh_hash,
+	&lsh_cat,
+	&lsh_grep,
+	&lsh_wc,
+	&lsh_read,
+	&lsh_record_builtin,
+	&lsh_record_builtin,
+	&lsh_record_builtin,
+	&lsh_record_builtin,
+	&lsh_record_builtin,
+	&lsh_json,
+	&lsh_csv,
+	&lsh_tee,
+	&lsh_lz4,
+	&lsh_grep,
+	&lsh_topk,
+	&lsh_take
 };
 
 int lsh_num_builtins() {
 	return sizeof(builtin_str) / sizeof(char *);
 }
 
+#define LSH_TOK_BUFSIZE 64
+#define LSH_TOK_DELIM " \t\r\n\a"
+
+#define LSH_EVENT_BATCH 64
+/*
+Event loop: the shell waits for everything (terminal input, signals,
+children and timers) in a single epoll set.  Each registered fd has a
+callback, looked up by fd when it becomes readable.
+*/
+typedef void (*lsh_event_fn)(int fd, void *data);
+
+struct lsh_event {
+	lsh_event_fn fn;
+	void *data;
+};
+
+int lsh_epfd = -1;
+struct lsh_event *lsh_events = NULL;
+int lsh_events_cap = 0;
+
+/*
+Signals are blocked and read from a signalfd.  Children get the original
+mask back before exec.  Builtins blocked on input watch a second signalfd
+that only sees SIGINT, plus an eventfd the shell posts to once some thread
+has taken the SIGINT, so Ctrl-C reaches them wherever they run.
+*/
+sigset_t lsh_orig_mask;
+int lsh_sigfd = -1;
+int lsh_intfd = -1;
+int lsh_intr_fd = -1;
+atomic_int lsh_interrupted = 0;
+int lsh_at_prompt = 0;
+int lsh_term_cols = 80;
+
+/**
+@brief Register an fd with the event loop.
+@param fd The fd, polled for readability.
+@param fn Callback to run when it is readable.
+@param data Passed to the callback.
+@return 0 on success, -1 on error (errno is set, e.g. EPERM for regular files).
+*/
+int lsh_event_add(int fd, lsh_event_fn fn, void *data)
+{
+	struct epoll_event ev;
+	int cap;
+
+	if (fd >= lsh_events_cap) {
+		cap = lsh_events_cap ? lsh_events_cap : 64;
+		while (cap <= fd) {
+			cap *= 2;
+		}
+		lsh_events = realloc(lsh_events, cap * sizeof(struct lsh_event));
+		if (!lsh_events) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(lsh_events + lsh_events_cap, 0, (cap - lsh_events_cap) * sizeof(struct lsh_event));
+		lsh_events_cap = cap;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(lsh_epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		return -1;
+	}
+	lsh_events[fd].fn = fn;
+	lsh_events[fd].data = data;
+	return 0;
+}
+
+/**
+@brief Remove an fd from the event loop.
+@param fd The fd.
+*/
+void lsh_event_del(int fd)
+{
+	epoll_ctl(lsh_epfd, EPOLL_CTL_DEL, fd, NULL);
+	if (fd < lsh_events_cap) {
+		lsh_events[fd].fn = NULL;
+	}
+}
+
+/**
+@brief Wait for events and run their callbacks.
+@param timeout Milliseconds to wait, or -1 to wait indefinitely.
+@return Number of events handled.
+*/
+int lsh_event_wait(int timeout)
+{
+	struct epoll_event evs[LSH_EVENT_BATCH];
+	int n, i, fd;
+
+	n = epoll_wait(lsh_epfd, evs, LSH_EVENT_BATCH, timeout);
+	for (i = 0; i < n; i++) {
+		fd = evs[i].data.fd;
+		// An earlier callback in this batch may have removed it.
+		if (fd < lsh_events_cap && lsh_events[fd].fn != NULL) {
+			lsh_events[fd].fn(fd, lsh_events[fd].data);
+		}
+	}
+	return n > 0 ? n : 0;
+}
+
+/**
+@brief Print the prompt.
+*/
+void lsh_prompt(void)
+{
+	printf("> ");
+	fflush(stdout);
+}
+
+void lsh_ring_interrupt(void);
+
+/**
+@brief Mark the current command as interrupted and wake every builtin
+waiting for input, whichever thread it runs on.
+*/
+void lsh_interrupt(void)
+{
+	uint64_t one = 1;
+
+	lsh_interrupted = 1;
+	if (write(lsh_intr_fd, &one, sizeof(one)) < 0) {
+		// The counter is already nonzero; the waiters are awake.
+	}
+	lsh_ring_interrupt();
+}
+
+/**
+@brief Forget an earlier Ctrl-C before running the next command.
+*/
+void lsh_interrupt_clear(void)
+{
+	uint64_t count;
+
+	lsh_interrupted = 0;
+	if (read(lsh_intr_fd, &count, sizeof(count)) < 0) {
+		// Nothing was posted.
+	}
+}
+
+/**
+@brief Check for Ctrl-C from code that runs without going through the
+event loop, such as long builtin output loops.
+@return Nonzero if the current command has been interrupted.
+*/
+int lsh_check_interrupt(void)
+{
+	struct timespec zero = { 0, 0 };
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	if (sigtimedwait(&set, NULL, &zero) == SIGINT) {
+		lsh_interrupt();
+	}
+	return lsh_interrupted;
+}
+
+void lsh_job_poll(void);
+void lsh_wheel_init(void);
+
+/**
+@brief Event callback: drain the signalfd.
+@param fd The signalfd.
+@param data Unused.
+*/
+void lsh_signal_ready(int fd, void *data)
+{
+	struct signalfd_siginfo si;
+	struct winsize ws;
+
+	while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+		case SIGCHLD:
+			lsh_job_poll();
+			break;
+		case SIGINT:
+			lsh_interrupt();
+			if (lsh_at_prompt) {
+				printf("\n");
+				lsh_prompt();
+			}
+			break;
+		case SIGWINCH:
+			if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+				lsh_term_cols = ws.ws_col;
+			}
+			break;
+		}
+	}
+}
+
+/**
+@brief Set up the event loop and route signals through it.
+*/
+void lsh_event_init(void)
+{
+	sigset_t set;
+
+	lsh_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (lsh_epfd < 0) {
+		perror("lsh: epoll");
+		exit(EXIT_FAILURE);
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &set, &lsh_orig_mask);
+	lsh_sigfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (lsh_sigfd < 0 || lsh_event_add(lsh_sigfd, lsh_signal_ready, NULL) != 0) {
+		perror("lsh: signalfd");
+		exit(EXIT_FAILURE);
+	}
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	lsh_intfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	lsh_intr_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (lsh_intfd < 0 || lsh_intr_fd < 0) {
+		perror("lsh: signalfd");
+		exit(EXIT_FAILURE);
+	}
+	// Builtins in pipelines write to pipes from the shell itself; a reader
+	// going away must show up as EPIPE, not kill the shell.
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	lsh_wheel_init();
+}
+
+#define LSH_WHEEL_BITS 6
+#define LSH_WHEEL_SLOTS (1 << LSH_WHEEL_BITS)
+#define LSH_WHEEL_MASK (LSH_WHEEL_SLOTS - 1)
+#define LSH_WHEEL_LEVELS 5
+/*
+One-shot timers on a hierarchical timing wheel with 1 ms ticks.  Level n
+holds timers due within 64^(n+1) ticks; a level's slot is cascaded down
+into the level below when that level wraps.  Adding and cancelling a
+timer is O(1) however many are pending.  A single timerfd on the event
+loop is armed for the next slot that needs attention.
+*/
+struct lsh_timer {
+	uint64_t expires;
+	int level;
+	lsh_event_fn fn;
+	void *data;
+	struct lsh_timer *prev;
+	struct lsh_timer *next;
+};
+
+struct lsh_timer lsh_wheel[LSH_WHEEL_LEVELS][LSH_WHEEL_SLOTS];
+int lsh_wheel_count[LSH_WHEEL_LEVELS];
+uint64_t lsh_wheel_now = 0;	// Next tick to process.
+uint64_t lsh_wheel_armed = 0;	// Tick the timerfd is set for.
+int lsh_wheel_fd = -1;
+
+/**
+@brief Current time in wheel ticks (monotonic milliseconds).
+@return The time.
+*/
+uint64_t lsh_wheel_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+@brief Put a timer in the wheel slot for its expiry time.
+@param t The timer.
+*/
+void lsh_wheel_insert(struct lsh_timer *t)
+{
+	struct lsh_timer *head;
+	uint64_t when = t->expires > lsh_wheel_now ? t->expires : lsh_wheel_now;
+	uint64_t delta = when - lsh_wheel_now;
+	int level = 0;
+
+	while (level < LSH_WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (LSH_WHEEL_BITS * (level + 1))) {
+		level++;
+	}
+	if (delta >= (uint64_t)1 << (LSH_WHEEL_BITS * LSH_WHEEL_LEVELS)) {
+		// Beyond the wheel: park in the furthest slot, cascade again later.
+		when = lsh_wheel_now + ((uint64_t)LSH_WHEEL_MASK << (LSH_WHEEL_BITS * level));
+	}
+
+	head = &lsh_wheel[level][(when >> (LSH_WHEEL_BITS * level)) & LSH_WHEEL_MASK];
+	t->next = head;
+	t->prev = head->prev;
+	head->prev->next = t;
+	head->prev = t;
+	t->level = level;
+	lsh_wheel_count[level]++;
+}
+
+/**
+@brief Unlink a timer from its slot.
+@param t The timer.
+*/
+void lsh_wheel_remove(struct lsh_timer *t)
+{
+	lsh_wheel_count[t->level]--;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+}
+
+/**
+@brief Move every timer in a slot of an upper level down the wheel.
+@param level The level.
+@param slot The slot.
+*/
+void lsh_wheel_cascade(int level, int slot)
+{
+	struct lsh_timer *head = &lsh_wheel[level][slot], *t;
+
+	while ((t = head->next) != head) {
+		lsh_wheel_remove(t);
+		lsh_wheel_insert(t);
+	}
+}
+
+/**
+@brief Arm the timerfd for the next slot that holds timers.
+*/
+void lsh_wheel_arm(void)
+{
+	struct itimerspec its;
+	uint64_t next = UINT64_MAX, start;
+	int level, i, slot, shift;
+
+	for (level = 0; level < LSH_WHEEL_LEVELS; level++) {
+		if (lsh_wheel_count[level] == 0) {
+			continue;
+		}
+		// Level 0 slots fire at their tick; upper slots at the tick where
+		// they cascade, which for an already cascaded slot is a rotation away.
+		shift = LSH_WHEEL_BITS * level;
+		for (i = 0; i <= LSH_WHEEL_SLOTS; i++) {
+			start = level == 0 ? lsh_wheel_now + i : ((lsh_wheel_now >> shift) + i) << shift;
+			if (start < lsh_wheel_now) {
+				continue;
+			}
+			slot = (start >> shift) & LSH_WHEEL_MASK;
+			if (lsh_wheel[level][slot].next != &lsh_wheel[level][slot]) {
+				if (start < next) {
+					next = start;
+				}
+				break;
+			}
+		}
+	}
+
+	if (next == lsh_wheel_armed) {
+		return;
+	}
+	lsh_wheel_armed = next;
+
+	// Ticks are CLOCK_MONOTONIC milliseconds, so arm for the absolute time.
+	memset(&its, 0, sizeof(its));
+	if (next != UINT64_MAX) {
+		its.it_value.tv_sec = next / 1000;
+		its.it_value.tv_nsec = (next % 1000) * 1000000;
+	}
+	timerfd_settime(lsh_wheel_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/**
+@brief Advance the wheel to the current time, running expired timers.
+*/
+void lsh_wheel_advance(void)
+{
+	struct lsh_timer *head, *t;
+	uint64_t target = lsh_wheel_clock();
+	lsh_event_fn fn;
+	void *data;
+	int level;
+
+	while (lsh_wheel_now <= target) {
+		// Cascade upper levels whose slot boundary this tick crosses.
+		for (level = 1; level < LSH_WHEEL_LEVELS; level++) {
+			if ((lsh_wheel_now & (((uint64_t)1 << (LSH_WHEEL_BITS * level)) - 1)) != 0) {
+				break;
+			}
+			lsh_wheel_cascade(level, (lsh_wheel_now >> (LSH_WHEEL_BITS * level)) & LSH_WHEEL_MASK);
+		}
+
+		head = &lsh_wheel[0][lsh_wheel_now & LSH_WHEEL_MASK];
+		while ((t = head->next) != head) {
+			lsh_wheel_remove(t);
+			fn = t->fn;
+			data = t->data;
+			free(t);
+			fn(-1, data);
+		}
+
+		if (lsh_wheel_count[0] == 0) {
+			// Nothing due before the next level 0 wrap; skip ahead.
+			lsh_wheel_now = ((lsh_wheel_now >> LSH_WHEEL_BITS) + 1) << LSH_WHEEL_BITS;
+			if (lsh_wheel_now > target + 1) {
+				lsh_wheel_now = target + 1;
+			}
+		}
+		else {
+			lsh_wheel_now++;
+		}
+	}
+}
+
+/**
+@brief Event callback: the wheel's timerfd expired.
+@param fd The timerfd.
+@param data Unused.
+*/
+void lsh_wheel_ready(int fd, void *data)
+{
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+		return;
+	}
+	lsh_wheel_armed = 0;
+	lsh_wheel_advance();
+	lsh_wheel_arm();
+}
+
+/**
+@brief Set up the timing wheel on the event loop.
+*/
+void lsh_wheel_init(void)
+{
+	int level, i;
+
+	for (level = 0; level < LSH_WHEEL_LEVELS; level++) {
+		for (i = 0; i < LSH_WHEEL_SLOTS; i++) {
+			lsh_wheel[level][i].next = lsh_wheel[level][i].prev = &lsh_wheel[level][i];
+		}
+	}
+	lsh_wheel_now = lsh_wheel_clock();
+	lsh_wheel_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (lsh_wheel_fd < 0 || lsh_event_add(lsh_wheel_fd, lsh_wheel_ready, NULL) != 0) {
+		perror("lsh: timerfd");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+@brief Give a forked child its own event loop.  After fork the epoll set and
+the wheel's timerfd are shared with the parent, so changes made by one
+would be seen by the other.  Fds still registered are watched again in the
+new set.
+*/
+void lsh_event_after_fork(void)
+{
+	struct epoll_event ev;
+	int fd;
+
+	close(lsh_epfd);
+	lsh_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (lsh_epfd < 0) {
+		perror("lsh: epoll");
+		exit(EXIT_FAILURE);
+	}
+	if (lsh_wheel_fd >= 0) {
+		lsh_events[lsh_wheel_fd].fn = NULL;
+		close(lsh_wheel_fd);
+		lsh_wheel_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (lsh_wheel_fd < 0 || lsh_event_add(lsh_wheel_fd, lsh_wheel_ready, NULL) != 0) {
+			perror("lsh: timerfd");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (fd = 0; fd < lsh_events_cap; fd++) {
+		if (lsh_events[fd].fn != NULL && fd != lsh_wheel_fd) {
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.fd = fd;
+			epoll_ctl(lsh_epfd, EPOLL_CTL_ADD, fd, &ev);
+		}
+	}
+	lsh_wheel_armed = 0;
+	lsh_wheel_arm();
+}
+
+/**
+@brief Start a one-shot timer.
+@param ms Milliseconds until it fires.
+@param fn Callback, run once from the event loop (its fd argument is -1).
+The timer is released before the callback runs.
+@param data Passed to the callback.
+@return The timer, for lsh_timer_stop().
+*/
+struct lsh_timer *lsh_timer_start(long ms, lsh_event_fn fn, void *data)
+{
+	struct lsh_timer *t;
+
+	t = malloc(sizeof(*t));
+	if (!t) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	t->fn = fn;
+	t->data = data;
+	// Count from now, not from the last tick the wheel processed.
+	t->expires = lsh_wheel_clock() + (ms > 0 ? ms : 0);
+	lsh_wheel_insert(t);
+	lsh_wheel_arm();
+	return t;
+}
+
+/**
+@brief Cancel a timer that has not fired yet.
+@param t The timer.
+*/
+void lsh_timer_stop(struct lsh_timer *t)
+{
+	lsh_wheel_remove(t);
+	free(t);
+}
+
+#define LSH_RING_SIZE (256 << 10)
+#define LSH_RING_WCLOSED 1
+#define LSH_RING_RCLOSED 2
+/*
+Single-producer single-consumer ring, used instead of a pipe between two
+builtins of a pipeline that run on threads.  Each side only advances its
+own index.  A side with nothing to do sleeps on the condition variable
+after announcing itself in waiters; the other side checks waiters after
+moving its index, so one of them always sees the other.  Live rings are kept on a list so
+Ctrl-C can wake both sides of each.
+*/
+struct lsh_ring {
+	char *buf;
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) atomic_size_t tail;
+	_Alignas(64) atomic_int closed;
+	atomic_int waiters;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct lsh_ring *next;
+	struct lsh_ring *prev;
+};
+
+struct lsh_ring *lsh_rings = NULL;
+pthread_mutex_t lsh_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+@brief Create a ring.
+@return The ring.
+*/
+struct lsh_ring *lsh_ring_new(void)
+{
+	struct lsh_ring *r;
+
+	if (posix_memalign((void **)&r, 64, sizeof(struct lsh_ring)) != 0 ||
+		!(r->buf = malloc(LSH_RING_SIZE))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->closed, 0);
+	atomic_init(&r->waiters, 0);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	pthread_mutex_lock(&lsh_rings_lock);
+	r->prev = NULL;
+	r->next = lsh_rings;
+	if (lsh_rings != NULL) {
+		lsh_rings->prev = r;
+	}
+	lsh_rings = r;
+	pthread_mutex_unlock(&lsh_rings_lock);
+	return r;
+}
+
+/**
+@brief Free a ring once both sides are done with it.
+@param r The ring.
+*/
+void lsh_ring_free(struct lsh_ring *r)
+{
+	pthread_mutex_lock(&lsh_rings_lock);
+	if (r->prev != NULL) {
+		r->prev->next = r->next;
+	}
+	else {
+		lsh_rings = r->next;
+	}
+	if (r->next != NULL) {
+		r->next->prev = r->prev;
+	}
+	pthread_mutex_unlock(&lsh_rings_lock);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	free(r->buf);
+	free(r);
+}
+
+/**
+@brief Wake everything sleeping on a ring after Ctrl-C.  The flag is set
+before the locks are taken, so a side about to sleep sees it instead.
+*/
+void lsh_ring_interrupt(void)
+{
+	struct lsh_ring *r;
+
+	pthread_mutex_lock(&lsh_rings_lock);
+	for (r = lsh_rings; r != NULL; r = r->next) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+	pthread_mutex_unlock(&lsh_rings_lock);
+}
+
+/**
+@brief Sleep until an index moves away from a value, a side closes or the
+command is interrupted.
+@param r The ring.
+@param pos The other side's index.
+@param seen Its value when we last looked.
+*/
+void lsh_ring_wait(struct lsh_ring *r, atomic_size_t *pos, size_t seen)
+{
+	pthread_mutex_lock(&r->lock);
+	atomic_fetch_add(&r->waiters, 1);
+	while (atomic_load(pos) == seen && atomic_load(&r->closed) == 0 && !lsh_interrupted) {
+		pthread_cond_wait(&r->cond, &r->lock);
+	}
+	atomic_fetch_sub(&r->waiters, 1);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/**
+@brief Wake the other side if it is asleep.
+@param r The ring.
+*/
+void lsh_ring_wake(struct lsh_ring *r)
+{
+	if (atomic_load(&r->waiters) > 0) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+/**
+@brief Close one side of a ring.
+@param r The ring.
+@param side LSH_RING_WCLOSED or LSH_RING_RCLOSED.
+*/
+void lsh_ring_close(struct lsh_ring *r, int side)
+{
+	atomic_fetch_or(&r->closed, side);
+	pthread_mutex_lock(&r->lock);
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/**
+@brief Write a whole buffer into a ring, waiting for room as needed.
+@param r The ring.
+@param data Bytes to write.
+@param len Number of bytes.
+@return 0 on success, -1 with errno set to EPIPE if the reader is gone or
+to EINTR on Ctrl-C.
+*/
+int lsh_ring_write(struct lsh_ring *r, const char *data, size_t len)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail, n, off, first;
+
+	while (len > 0) {
+		if (atomic_load(&r->closed) & LSH_RING_RCLOSED) {
+			errno = EPIPE;
+			return -1;
+		}
+		if (lsh_interrupted) {
+			errno = EINTR;
+			return -1;
+		}
+		tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+		if (head - tail == LSH_RING_SIZE) {
+			lsh_ring_wait(r, &r->tail, tail);
+			continue;
+		}
+		n = LSH_RING_SIZE - (head - tail);
+		n = n < len ? n : len;
+		off = head & (LSH_RING_SIZE - 1);
+		first = n < LSH_RING_SIZE - off ? n : LSH_RING_SIZE - off;
+		memcpy(r->buf + off, data, first);
+		memcpy(r->buf, data + first, n - first);
+		head += n;
+		data += n;
+		len -= n;
+		atomic_store(&r->head, head);
+		lsh_ring_wake(r);
+	}
+	return 0;
+}
+
+/**
+@brief Read from a ring, waiting until something is there.
+@param r The ring.
+@param buf Destination.
+@param cap Room in the destination.
+@return Bytes read, 0 once the writer has closed and the ring is empty, or
+-1 with errno set to EINTR on Ctrl-C.
+*/
+ssize_t lsh_ring_read(struct lsh_ring *r, char *buf, size_t cap)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head, n, off, first;
+
+	while ((head = atomic_load_explicit(&r->head, memory_order_acquire)) == tail) {
+		if (atomic_load(&r->closed) & LSH_RING_WCLOSED) {
+			// The last write may have landed just before the close.
+			if (atomic_load(&r->head) == tail) {
+				return 0;
+			}
+			continue;
+		}
+		if (lsh_interrupted) {
+			errno = EINTR;
+			return -1;
+		}
+		lsh_ring_wait(r, &r->head, tail);
+	}
+	n = head - tail < cap ? head - tail : cap;
+	off = tail & (LSH_RING_SIZE - 1);
+	first = n < LSH_RING_SIZE - off ? n : LSH_RING_SIZE - off;
+	memcpy(buf, r->buf + off, first);
+	memcpy(buf + first, r->buf, n - first);
+	atomic_store(&r->tail, tail + n);
+	lsh_ring_wake(r);
+	return n;
+}
+
+#define LSH_OUT_BUFSIZE 65536
+/*
+Buffered output layer for builtins.  Builtins that can produce a lot of
+output write through here instead of stdio, so the data leaves the shell in
+large write() calls.  The buffer and destination are per thread: a builtin
+running as a pipeline stage writes to its pipe, or to a ring when the next
+stage is a builtin too.
+*/
+__thread char lsh_out_buf[LSH_OUT_BUFSIZE];
+__thread size_t lsh_out_len = 0;
+__thread int lsh_out_fd = STDOUT_FILENO;
+__thread struct lsh_ring *lsh_out_ring = NULL;
+
+/**
+@brief Write a whole buffer to the output, retrying on short writes.
+@param data Bytes to write.
+@param len Number of bytes.
+@return 0 on success, -1 on error (errno is set).
+*/
+int lsh_write_all(const char *data, size_t len)
+{
+	ssize_t n;
+
+	if (lsh_out_ring != NULL) {
+		return lsh_ring_write(lsh_out_ring, data, len);
+	}
+	while (len > 0) {
+		n = write(lsh_out_fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+@brief Flush the builtin output buffer.
+@return 0 on success, -1 on error (errno is set).
+*/
+int lsh_out_flush(void)
+{
+	size_t len = lsh_out_len;
+
+	lsh_out_len = 0;
+	if (lsh_check_interrupt()) {
+		errno = EINTR;
+		return -1;
+	}
+	return lsh_write_all(lsh_out_buf, len);
+}
+
+/**
+@brief Append bytes to the builtin output buffer.
+@param data Bytes to write.
+@param len Number of bytes.
+@return 0 on success, -1 on error (errno is set).
+*/
+int lsh_out_write(const char *data, size_t len)
+{
+	if (lsh_out_len == 0) {
+		// Keep ordering with anything printed through stdio.
+		fflush(stdout);
+	}
+	if (len > LSH_OUT_BUFSIZE - lsh_out_len) {
+		if (lsh_out_flush() != 0) {
+			return -1;
+		}
+		if (len >= LSH_OUT_BUFSIZE) {
+			return lsh_write_all(data, len);
+		}
+	}
+	memcpy(lsh_out_buf + lsh_out_len, data, len);
+	lsh_out_len += len;
+	return 0;
+}
+
+/**
+@brief Format a signed integer in decimal, without going through printf.
+@param value The number.
+@param buf Destination, at least 21 bytes.  Not NUL terminated.
+@return Number of bytes written.
+*/
+int lsh_fmt_ll(long long value, char *buf)
+{
+	static const char pairs[] =
+		"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+		"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+		"8081828384858687888990919293949596979899";
+	char tmp[20];
+	unsigned long long v;
+	int i = sizeof(tmp), len = 0;
+
+	if (value < 0) {
+		buf[len++] = '-';
+		v = 0ULL - (unsigned long long)value;
+	}
+	else {
+		v = value;
+	}
+	while (v >= 100) {
+		i -= 2;
+		memcpy(tmp + i, pairs + (v % 100) * 2, 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		i -= 2;
+		memcpy(tmp + i, pairs + v * 2, 2);
+	}
+	else {
+		tmp[--i] = '0' + v;
+	}
+	memcpy(buf + len, tmp + i, sizeof(tmp) - i);
+	return len + sizeof(tmp) - i;
+}
+
+/**
+@brief Parse a whole argument as a long long.
+@param str The argument.
+@param out Where to store the value.
+@return 0 on success, -1 if the argument is not an integer.
+*/
+int lsh_parse_ll(const char *str, long long *out)
+{
+	char *end;
+
+	errno = 0;
+	*out = strtoll(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0') {
+		return -1;
+	}
+	return 0;
+}
+
+#define LSH_READER_BUFSIZE 65536
+/*
+Block reader: reads an fd in large blocks and hands out delimited records
+that point into its buffer.  The shell's own input and builtins reading
+stdin share lsh_stdin, so nothing read ahead is lost between them.  A
+builtin on a pipeline thread has its own lsh_stdin, reading its pipe or
+ring.
+*/
+struct lsh_reader {
+	int fd;
+	char *buf;
+	size_t cap;
+	size_t pos;
+	size_t len;
+	struct lsh_ring *ring;
+};
+
+__thread struct lsh_reader lsh_stdin = { STDIN_FILENO, NULL, 0, 0, 0, NULL };
+
+/**
+@brief Read from an fd for a builtin, giving up on Ctrl-C.  SIGINT stays
+blocked in the shell, so a builtin waiting on the terminal would otherwise
+never notice it.
+@param fd The fd.
+@param buf Destination.
+@param len Room in the destination.
+@return Bytes read, 0 at end of input, or -1 on error (errno is EINTR if
+the command was interrupted).
+*/
+ssize_t lsh_read_input(int fd, void *buf, size_t len)
+{
+	struct pollfd p[3] = {
+		{ fd, POLLIN, 0 }, { lsh_intfd, POLLIN, 0 }, { lsh_intr_fd, POLLIN, 0 }
+	};
+	uint64_t count;
+	ssize_t n;
+
+	// At the prompt the event loop owns SIGINT, and stdin is known readable.
+	while (!lsh_at_prompt) {
+		if (lsh_check_interrupt()) {
+			errno = EINTR;
+			return -1;
+		}
+		if (poll(p, 3, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (p[0].revents != 0) {
+			break;
+		}
+		if (p[2].revents != 0 && !lsh_interrupted && read(lsh_intr_fd, &count, sizeof(count)) < 0) {
+			// Left over from an earlier Ctrl-C; drained.
+		}
+	}
+	do {
+		n = read(fd, buf, len);
+	} while (n < 0 && errno == EINTR);
+	return n;
+}
+
+/**
+@brief Read one more block into a reader, making room as needed.
+@param r The reader.
+@return Bytes read, 0 at end of input, or -1 on error.
+*/
+ssize_t lsh_reader_fill(struct lsh_reader *r)
+{
+	ssize_t n;
+
+	// Move the partial record to the front, grow if still full.
+	if (r->pos > 0) {
+		memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+		r->len -= r->pos;
+		r->pos = 0;
+	}
+	if (r->len + 1 >= r->cap) {
+		r->cap = r->cap ? r->cap * 2 : LSH_READER_BUFSIZE;
+		r->buf = realloc(r->buf, r->cap);
+		if (!r->buf) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (r->ring != NULL) {
+		n = lsh_ring_read(r->ring, r->buf + r->len, r->cap - r->len - 1);
+	}
+	else {
+		n = lsh_read_input(r->fd, r->buf + r->len, r->cap - r->len - 1);
+	}
+	if (n > 0) {
+		r->len += n;
+	}
+	return n;
+}
+
+/**
+@brief Take a complete record out of a reader's buffer, without reading.
+@param r The reader.
+@param delim Record delimiter.
+@param len Where to store the record length (without the delimiter).
+@param eof Nonzero if no more input will come, so a trailing unterminated
+record should be returned too.
+@return The record, NUL terminated in place and valid until the next call,
+or NULL if no complete record is buffered.
+*/
+char *lsh_reader_take(struct lsh_reader *r, int delim, size_t *len, int eof)
+{
+	char *rec, *end;
+
+	if (r->pos == r->len) {
+		return NULL;
+	}
+	rec = r->buf + r->pos;
+	end = memchr(rec, delim, r->len - r->pos);
+	if (end == NULL) {
+		if (!eof) {
+			return NULL;
+		}
+		end = r->buf + r->len;
+		r->pos = r->len;
+	}
+	else {
+		r->pos = end - r->buf + 1;
+	}
+	*len = end - rec;
+	*end = '\0';
+	return rec;
+}
+
+/**
+@brief Return the next record from a reader, blocking until one is read.
+@param r The reader.
+@param delim Record delimiter.
+@param len Where to store the record length (without the delimiter).
+@return The record, NUL terminated in place and valid until the next call,
+or NULL at end of input.  An unterminated last record is still returned.
+*/
+char *lsh_reader_next(struct lsh_reader *r, int delim, size_t *len)
+{
+	char *rec;
+	int eof = 0;
+
+	while ((rec = lsh_reader_take(r, delim, len, eof)) == NULL) {
+		if (eof) {
+			return NULL;
+		}
+		eof = lsh_reader_fill(r) <= 0;
+	}
+	return rec;
+}
+
+#define LSH_PATH_CACHE_SIZE 256
+/*
+PATH lookup cache: command name -> resolved executable path.  Lookups done
+by the spawn engine are remembered for the life of the shell.
+*/
+struct lsh_path_entry {
+	char *name;
+	char *path;
+	struct lsh_path_entry *next;
+};
+
+struct lsh_path_entry *lsh_path_cache[LSH_PATH_CACHE_SIZE];
+
+/**
+@brief Hash a command name to its PATH cache bucket.
+*/
+unsigned int lsh_path_hash(const char *name)
+{
+	unsigned int h = 0;
+
+	for (; *name; name++) {
+		h = h * 31 + (unsigned char)*name;
+	}
+	return h % LSH_PATH_CACHE_SIZE;
+}
+
+/**
+@brief Add an entry to the PATH lookup cache.
+@param name Command name.
+@param path Its executable, owned by the cache from now on.
+@return The cached path.
+*/
+const char *lsh_path_insert(const char *name, char *path)
+{
+	struct lsh_path_entry *e;
+	unsigned int h = lsh_path_hash(name);
+
+	e = malloc(sizeof(*e));
+	if (!e || !(e->name = strdup(name))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	e->path = path;
+	e->next = lsh_path_cache[h];
+	lsh_path_cache[h] = e;
+	return path;
+}
+
+/**
+@brief Resolve a command name through PATH, using the lookup cache.
+@param name Command name.
+@return The executable path (owned by the cache, or name itself if it
+contains a slash), or NULL if not found.
+*/
+const char *lsh_path_lookup(const char *name)
+{
+	struct lsh_path_entry *e;
+	const char *path = getenv("PATH"), *dir, *sep;
+	char *full;
+	size_t dirlen;
+
+	if (strchr(name, '/') != NULL) {
+		return name;
+	}
+	for (e = lsh_path_cache[lsh_path_hash(name)]; e != NULL; e = e->next) {
+		if (strcmp(e->name, name) == 0) {
+			return e->path;
+		}
+	}
+
+	if (path == NULL) {
+		path = "/usr/local/bin:/usr/bin:/bin";
+	}
+	for (dir = path; ; dir = sep + 1) {
+		sep = strchr(dir, ':');
+		dirlen = sep ? (size_t)(sep - dir) : strlen(dir);
+		full = malloc(dirlen + strlen(name) + 3);
+		if (!full) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		if (dirlen == 0) {
+			sprintf(full, "./%s", name);
+		}
+		else {
+			sprintf(full, "%.*s/%s", (int)dirlen, dir, name);
+		}
+		if (access(full, X_OK) == 0) {
+			return lsh_path_insert(name, full);
+		}
+		free(full);
+		if (sep == NULL) {
+			return NULL;
+		}
+	}
+}
+
+/**
+@brief Empty the PATH lookup cache, e.g. after PATH changes.
+*/
+void lsh_path_forget(void)
+{
+	struct lsh_path_entry *e, *next;
+	int i;
+
+	for (i = 0; i < LSH_PATH_CACHE_SIZE; i++) {
+		for (e = lsh_path_cache[i]; e != NULL; e = next) {
+			next = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
+		}
+		lsh_path_cache[i] = NULL;
+	}
+}
+
+/*
+Exit status of the last command run, shell style: the exit code, or 128 plus
+the signal number.
+*/
+__thread int lsh_last_status = 0;
+
+/*
+Set while a builtin runs from a command line ending in "&".  Builtins that
+can work asynchronously on the event loop check it; the rest run in the
+foreground.
+*/
+__thread int lsh_background = 0;
+
+/*
+Shell options, set with "set -o name[=value]" and cleared with "set +o name".
+*/
+struct lsh_option {
+	char *name;
+	int value;
+	void (*changed)(int value);
+	char **names;
+};
+
+void lsh_js_setup(int value);
+
+#define LSH_OPT_SPLITARGS 0
+#define LSH_OPT_CMDTIMEOUT 1
+#define LSH_OPT_JOBSERVER 2
+#define LSH_OPT_PLACEMENT 3
+#define LSH_OPT_PREFETCH 4
+#define LSH_OPT_STRUCTURED 5
+#define LSH_OPT_OPTIMIZE 6
+
+#define LSH_PLACE_NONE 0
+#define LSH_PLACE_SPREAD 1
+#define LSH_PLACE_COMPACT 2
+
+char *lsh_placement_names[] = { "none", "spread", "compact", NULL };
+
+struct lsh_option lsh_options[] = {
+	{ "splitargs", 0, NULL, NULL },
+	{ "cmdtimeout", 0, NULL, NULL },
+	{ "jobserver", 0, lsh_js_setup, NULL },
+	{ "placement", LSH_PLACE_NONE, NULL, lsh_placement_names },
+	{ "prefetch", 0, NULL, NULL },
+	{ "structured", 0, NULL, NULL },
+	{ "optimize", 0, NULL, NULL }
+};
+
+int lsh_num_options() {
+	return sizeof(lsh_options) / sizeof(struct lsh_option);
+}
+
+/*
+Jobserver: a token pool shared with GNU make and other shells, using make's
+protocol.  Every process owns one implicit slot; each further child needs a
+token byte read from the pool, and the byte goes back when the child exits.
+The pool is inherited through MAKEFLAGS (--jobserver-auth=fifo:PATH or
+R,W pipe fds), or created by "set -o jobserver=N".
+*/
+int lsh_js_rfd = -1;
+int lsh_js_wfd = -1;
+int lsh_js_running = 0;
+int lsh_js_unclaimed = 0;
+char *lsh_js_tokens = NULL;
+int lsh_js_ntokens = 0;
+int lsh_js_tokcap = 0;
+char lsh_js_dir[64] = "";
+pid_t lsh_js_owner = -1;
+int lsh_js_slots = 0;
+char *lsh_js_oldflags = NULL;	// MAKEFLAGS before our pool was added.
+
+/**
+@brief Remove the fifo of a pool this process created.  Forked subshells
+inherit the name but leave their parent's pool alone.
+*/
+void lsh_js_cleanup(void)
+{
+	char path[128];
+
+	if (lsh_js_dir[0] != '\0' && lsh_js_owner == getpid()) {
+		snprintf(path, sizeof(path), "%s/fifo", lsh_js_dir);
+		unlink(path);
+		rmdir(lsh_js_dir);
+	}
+}
+
+/**
+@brief Join the jobserver named in MAKEFLAGS, if there is one.
+@return 0 if joined, -1 if there is none (or it is unusable).
+*/
+int lsh_js_inherit(void)
+{
+	const char *flags = getenv("MAKEFLAGS"), *auth = NULL, *p;
+	char path[4096];
+	struct stat st;
+	int r, w;
+	size_t len;
+
+	// The last occurrence wins, as in make.
+	for (p = flags; p != NULL && (p = strstr(p, "--jobserver-")) != NULL; p++) {
+		if (strncmp(p, "--jobserver-auth=", 17) == 0) {
+			auth = p + 17;
+		}
+		else if (strncmp(p, "--jobserver-fds=", 16) == 0) {
+			auth = p + 16;
+		}
+	}
+	if (auth == NULL) {
+		return -1;
+	}
+
+	if (strncmp(auth, "fifo:", 5) == 0) {
+		len = strcspn(auth + 5, " ");
+		if (len >= sizeof(path)) {
+			return -1;
+		}
+		memcpy(path, auth + 5, len);
+		path[len] = '\0';
+		lsh_js_rfd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		lsh_js_wfd = lsh_js_rfd;
+		return lsh_js_rfd >= 0 ? 0 : -1;
+	}
+	// make closes the fds for commands it does not consider recursive.
+	if (sscanf(auth, "%d,%d", &r, &w) != 2 || fstat(r, &st) != 0 || !S_ISFIFO(st.st_mode) ||
+		fstat(w, &st) != 0 || !S_ISFIFO(st.st_mode)) {
+		return -1;
+	}
+	// Reopen the read end so non-blocking mode does not leak to make.
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", r);
+	lsh_js_rfd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	lsh_js_wfd = w;
+	return lsh_js_rfd >= 0 ? 0 : -1;
+}
+
+/**
+@brief Leave the pool.  Tokens still held go back to it, a pool this shell
+created is removed, and MAKEFLAGS is put back the way it was before the
+pool was added to it.
+*/
+void lsh_js_close(void)
+{
+	if (lsh_js_rfd < 0) {
+		return;
+	}
+	if (lsh_js_ntokens > 0 && write(lsh_js_wfd, lsh_js_tokens, lsh_js_ntokens) != lsh_js_ntokens) {
+		perror("lsh: jobserver");
+	}
+	lsh_js_ntokens = 0;
+	// A separate write fd is make's, inherited; children still get it.
+	close(lsh_js_rfd);
+	lsh_js_rfd = lsh_js_wfd = -1;
+	if (lsh_js_dir[0] == '\0') {
+		return;
+	}
+	lsh_js_cleanup();
+	lsh_js_dir[0] = '\0';
+	if (lsh_js_oldflags != NULL) {
+		setenv("MAKEFLAGS", lsh_js_oldflags, 1);
+	}
+	else {
+		unsetenv("MAKEFLAGS");
+	}
+	free(lsh_js_oldflags);
+	lsh_js_oldflags = NULL;
+}
+
+/**
+@brief Option hook for "jobserver": join an inherited pool, or create one
+with the given number of slots (the number of CPUs if it is negative).
+The pool is added to MAKEFLAGS, after what the user already had there.  A
+new size replaces a pool this shell created; 0 leaves the pool.
+@param value The option value.
+*/
+void lsh_js_setup(int value)
+{
+	const char *old;
+	char path[128], *flags;
+	int slots = value >= 1 ? value : sysconf(_SC_NPROCESSORS_ONLN), i;
+	size_t len;
+
+	if (value == 0) {
+		lsh_js_close();
+		return;
+	}
+	if (lsh_js_rfd >= 0 && lsh_js_dir[0] == '\0') {
+		fprintf(stderr, "lsh: jobserver: the pool from MAKEFLAGS cannot be resized\n");
+		return;
+	}
+	if (lsh_js_rfd >= 0 && slots == lsh_js_slots) {
+		return;
+	}
+	// Children started on the old pool still count as running, so new
+	// ones wait for tokens of the new pool until they exit.
+	lsh_js_close();
+	if (lsh_js_inherit() == 0) {
+		return;
+	}
+
+	strcpy(lsh_js_dir, "/tmp/aash-js.XXXXXX");
+	if (mkdtemp(lsh_js_dir) == NULL) {
+		perror("lsh: jobserver");
+		lsh_js_dir[0] = '\0';
+		return;
+	}
+	if (lsh_js_owner != getpid()) {
+		lsh_js_owner = getpid();
+		atexit(lsh_js_cleanup);
+	}
+	snprintf(path, sizeof(path), "%s/fifo", lsh_js_dir);
+	if (mkfifo(path, 0600) != 0 || (lsh_js_rfd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0) {
+		perror("lsh: jobserver");
+		return;
+	}
+	lsh_js_wfd = lsh_js_rfd;
+	lsh_js_slots = slots;
+	for (i = 1; i < slots; i++) {
+		if (write(lsh_js_wfd, "+", 1) != 1) {
+			break;
+		}
+	}
+	// Later flags win in make, so the new pool overrides any stale one.
+	old = getenv("MAKEFLAGS");
+	len = (old ? strlen(old) : 0) + sizeof(path) + 64;
+	flags = malloc(len);
+	lsh_js_oldflags = old ? strdup(old) : NULL;
+	if (!flags || (old && !lsh_js_oldflags)) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	snprintf(flags, len, "%s%s-j%d --jobserver-auth=fifo:%s", old ? old : "", old && *old ? " " : "", slots, path);
+	setenv("MAKEFLAGS", flags, 1);
+	free(flags);
+}
+
+/**
+@brief Event callback: the token pool became readable.
+@param fd The pool's read fd.
+@param data Pointer to the flag to set.
+*/
+void lsh_js_ready(int fd, void *data)
+{
+	*(int *)data = 1;
+}
+
+/**
+@brief Take a job slot before starting a child: the implicit slot if no
+child holds it, else a token from the pool.  Runs the event loop while
+waiting, so children that exit meanwhile give their tokens back.
+@return 1 if a slot was taken (to be claimed by lsh_job_add()), 0 if the
+jobserver is not in use.
+*/
+int lsh_js_acquire(void)
+{
+	char c;
+	int readable;
+
+	if (lsh_js_rfd < 0 || !lsh_options[LSH_OPT_JOBSERVER].value) {
+		return 0;
+	}
+	while (lsh_js_running > 0) {
+		if (read(lsh_js_rfd, &c, 1) == 1) {
+			if (lsh_js_ntokens == lsh_js_tokcap) {
+				lsh_js_tokcap = lsh_js_tokcap ? lsh_js_tokcap * 2 : 16;
+				lsh_js_tokens = realloc(lsh_js_tokens, lsh_js_tokcap);
+				if (!lsh_js_tokens) {
+					fprintf(stderr, "lsh: allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			lsh_js_tokens[lsh_js_ntokens++] = c;
+			break;
+		}
+		if (errno != EAGAIN && errno != EINTR) {
+			perror("lsh: jobserver");
+			return 0;
+		}
+		readable = 0;
+		if (lsh_event_add(lsh_js_rfd, lsh_js_ready, &readable) != 0) {
+			return 0;
+		}
+		while (!readable && lsh_js_running > 0) {
+			lsh_event_wait(-1);
+		}
+		lsh_event_del(lsh_js_rfd);
+	}
+	lsh_js_running++;
+	lsh_js_unclaimed++;
+	return 1;
+}
+
+/**
+@brief Give back the slot of a child that exited.
+*/
+void lsh_js_release(void)
+{
+	int want;
+
+	if (lsh_js_running == 0) {
+		return;
+	}
+	lsh_js_running--;
+	// One child may run on the implicit slot; the rest need tokens.
+	want = lsh_js_running > 0 ? lsh_js_running - 1 : 0;
+	if (lsh_js_ntokens > want) {
+		if (write(lsh_js_wfd, &lsh_js_tokens[--lsh_js_ntokens], 1) != 1) {
+			perror("lsh: jobserver");
+		}
+	}
+}
+
+/*
+CPU placement for children.  The topology (allowed CPUs, their NUMA node
+and L3 domain) is read from sysfs on first use.  "spread" pins successive
+jobs to single CPUs alternating between NUMA nodes; "compact" fills one L3
+domain before moving to the next.  A group (the stages of one pipeline)
+is pinned to a whole L3 domain so the stages share a cache.
+*/
+struct lsh_cpu {
+	int cpu;
+	int node;
+	int l3;
+};
+
+struct lsh_cpu *lsh_cpus = NULL;
+int lsh_ncpus = -1;
+int *lsh_spread_order = NULL;
+unsigned int lsh_place_next = 0;
+int lsh_place_group = -1;
+
+/**
+@brief Read a small integer from a sysfs file.
+@param path The file.
+@param fallback Value to use if it cannot be read.
+@return The value.
+*/
+int lsh_read_int_file(const char *path, int fallback)
+{
+	FILE *f = fopen(path, "r");
+	int value = fallback;
+
+	if (f != NULL) {
+		if (fscanf(f, "%d", &value) != 1) {
+			value = fallback;
+		}
+		fclose(f);
+	}
+	return value;
+}
+
+/**
+@brief Order CPUs by NUMA node, then L3 domain, then number.
+*/
+int lsh_cpu_cmp(const void *a, const void *b)
+{
+	const struct lsh_cpu *x = a, *y = b;
+
+	if (x->node != y->node) {
+		return x->node - y->node;
+	}
+	if (x->l3 != y->l3) {
+		return x->l3 - y->l3;
+	}
+	return x->cpu - y->cpu;
+}
+
+/**
+@brief Load the CPU topology, once.
+*/
+void lsh_place_init(void)
+{
+	char path[128];
+	cpu_set_t allowed;
+	DIR *dp;
+	struct dirent *ep;
+	int cpu, n = 0, i, j, nodes = 0, *taken;
+
+	if (lsh_ncpus >= 0) {
+		return;
+	}
+	lsh_ncpus = 0;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		return;
+	}
+	lsh_cpus = calloc(CPU_COUNT(&allowed), sizeof(struct lsh_cpu));
+	lsh_spread_order = calloc(CPU_COUNT(&allowed), sizeof(int));
+	taken = calloc(CPU_COUNT(&allowed), sizeof(int));
+	if (!lsh_cpus || !lsh_spread_order || !taken) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (cpu = 0; cpu < CPU_SETSIZE && n < CPU_COUNT(&allowed); cpu++) {
+		if (!CPU_ISSET(cpu, &allowed)) {
+			continue;
+		}
+		lsh_cpus[n].cpu = cpu;
+		lsh_cpus[n].node = 0;
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+		if ((dp = opendir(path)) != NULL) {
+			while ((ep = readdir(dp)) != NULL) {
+				if (strncmp(ep->d_name, "node", 4) == 0 && ep->d_name[4] >= '0' && ep->d_name[4] <= '9') {
+					lsh_cpus[n].node = atoi(ep->d_name + 4);
+				}
+			}
+			closedir(dp);
+		}
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index3/id", cpu);
+		lsh_cpus[n].l3 = lsh_read_int_file(path, lsh_cpus[n].node);
+		if (lsh_cpus[n].node + 1 > nodes) {
+			nodes = lsh_cpus[n].node + 1;
+		}
+		n++;
+	}
+	qsort(lsh_cpus, n, sizeof(struct lsh_cpu), lsh_cpu_cmp);
+	lsh_ncpus = n;
+
+	// Spread order: take the next unused CPU of each node in turn.
+	for (i = 0; i < n; ) {
+		for (cpu = 0; cpu < nodes && i < n; cpu++) {
+			for (j = 0; j < n; j++) {
+				if (!taken[j] && lsh_cpus[j].node == cpu) {
+					taken[j] = 1;
+					lsh_spread_order[i++] = j;
+					break;
+				}
+			}
+		}
+	}
+	free(taken);
+}
+
+/**
+@brief Add every CPU of an L3 domain to a set.
+@param l3 The domain.
+@param set The set.
+*/
+void lsh_place_domain(int l3, cpu_set_t *set)
+{
+	int i;
+
+	for (i = 0; i < lsh_ncpus; i++) {
+		if (lsh_cpus[i].l3 == l3) {
+			CPU_SET(lsh_cpus[i].cpu, set);
+		}
+	}
+}
+
+/**
+@brief Start placing children as one group on a single L3 domain.
+*/
+void lsh_place_group_begin(void)
+{
+	int policy = lsh_options[LSH_OPT_PLACEMENT].value;
+
+	if (policy == LSH_PLACE_NONE) {
+		return;
+	}
+	lsh_place_init();
+	if (lsh_ncpus <= 0) {
+		return;
+	}
+	if (policy == LSH_PLACE_SPREAD) {
+		lsh_place_group = lsh_cpus[lsh_spread_order[lsh_place_next++ % lsh_ncpus]].l3;
+	}
+	else {
+		lsh_place_group = lsh_cpus[lsh_place_next++ % lsh_ncpus].l3;
+	}
+}
+
+/**
+@brief Stop placing children as a group.
+*/
+void lsh_place_group_end(void)
+{
+	lsh_place_group = -1;
+}
+
+/**
+@brief Choose the CPUs the next child should run on.
+@param set Filled with the CPUs.
+@return Nonzero if the child should be pinned.
+*/
+int lsh_place_pick(cpu_set_t *set)
+{
+	int policy = lsh_options[LSH_OPT_PLACEMENT].value;
+
+	if (policy == LSH_PLACE_NONE) {
+		return 0;
+	}
+	lsh_place_init();
+	if (lsh_ncpus <= 0) {
+		return 0;
+	}
+	CPU_ZERO(set);
+	if (lsh_place_group >= 0) {
+		lsh_place_domain(lsh_place_group, set);
+	}
+	else if (policy == LSH_PLACE_SPREAD) {
+		CPU_SET(lsh_cpus[lsh_spread_order[lsh_place_next++ % lsh_ncpus]].cpu, set);
+	}
+	else {
+		CPU_SET(lsh_cpus[lsh_place_next++ % lsh_ncpus].cpu, set);
+	}
+	return 1;
+}
+
+/*
+Cgroup for the next spawn, as an open directory fd, or -1.  Children are
+created directly inside it with clone3(CLONE_INTO_CGROUP) so they never run
+outside their limits; kernels without it fall back to fork and the child
+moves itself in through cgroup.procs before exec.
+*/
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+struct lsh_clone_args {
+	uint64_t flags;
+	uint64_t pidfd;
+	uint64_t child_tid;
+	uint64_t parent_tid;
+	uint64_t exit_signal;
+	uint64_t stack;
+	uint64_t stack_size;
+	uint64_t tls;
+	uint64_t set_tid;
+	uint64_t set_tid_size;
+	uint64_t cgroup;
+};
+
+int lsh_spawn_cgroup = -1;
+int lsh_clone3_broken = 0;
+
+/**
+@brief Write a value to a control file in a cgroup directory.
+@param dir The cgroup directory fd.
+@param file The control file.
+@param value The value.
+@return 0 on success, -1 with errno set on failure.
+*/
+int lsh_cg_write(int dir, const char *file, const char *value)
+{
+	int fd, error;
+	ssize_t n;
+
+	if ((fd = openat(dir, file, O_WRONLY | O_CLOEXEC)) < 0) {
+		return -1;
+	}
+	n = write(fd, value, strlen(value));
+	error = errno;
+	close(fd);
+	errno = error;
+	return n == (ssize_t) strlen(value) ? 0 : -1;
+}
+
+/**
+@brief Fork, placing the child in lsh_spawn_cgroup if one is set.
+@param moved Set to 1 if the child already is in the cgroup.
+@return As fork().
+*/
+pid_t lsh_fork(int *moved)
+{
+	struct lsh_clone_args ca;
+	long pid;
+
+	*moved = 0;
+	if (lsh_spawn_cgroup < 0) {
+		return fork();
+	}
+#ifdef SYS_clone3
+	if (!lsh_clone3_broken) {
+		memset(&ca, 0, sizeof(ca));
+		ca.flags = CLONE_INTO_CGROUP;
+		ca.exit_signal = SIGCHLD;
+		ca.cgroup = lsh_spawn_cgroup;
+		pid = syscall(SYS_clone3, &ca, sizeof(ca));
+		if (pid >= 0) {
+			*moved = 1;
+			return pid;
+		}
+		if (errno != ENOSYS && errno != E2BIG && errno != EINVAL) {
+			return -1;
+		}
+		lsh_clone3_broken = 1;
+	}
+#else
+	(void) ca;
+	(void) pid;
+#endif
+	return fork();
+}
+
+/**
+@brief Spawn engine: start a program without waiting for it.  Exec failures
+are reported back through a close-on-exec pipe, so they show up here rather
+than as a child exiting with a generic failure.
+@param args Null terminated list of arguments (including program).
+@param in Fd to use as the child's stdin, or -1 to inherit the shell's.
+@param out Fd to use as the child's stdout, or -1.
+@param err Fd to use as the child's stderr, or -1.
+@return The child's pid, or -1 with errno set if fork or exec failed.
+*/
+pid_t lsh_spawn_fds(char **args, int in, int out, int err)
+{
+	const char *path;
+	pid_t pid;
+	int fds[2], error, slot, pin, moved;
+	cpu_set_t cpus;
+	ssize_t n;
+
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		return -1;
+	}
+	// Look up before forking: the child may be forked while pipeline
+	// threads run, so it must not allocate.
+	path = lsh_path_lookup(args[0]);
+
+	slot = lsh_js_acquire();
+	pin = lsh_place_pick(&cpus);
+	pid = lsh_fork(&moved);
+	if (pid == 0) {
+		// Child process
+		close(fds[0]);
+		sigprocmask(SIG_SETMASK, &lsh_orig_mask, NULL);
+		if ((in >= 0 && in != STDIN_FILENO && dup2(in, STDIN_FILENO) < 0) ||
+			(out >= 0 && out != STDOUT_FILENO && dup2(out, STDOUT_FILENO) < 0) ||
+			(err >= 0 && err != STDERR_FILENO && dup2(err, STDERR_FILENO) < 0)) {
+			_exit(EXIT_FAILURE);
+		}
+		if (pin) {
+			sched_setaffinity(0, sizeof(cpus), &cpus);
+		}
+		if (path == NULL) {
+			errno = ENOENT;
+		}
+		else if (lsh_spawn_cgroup < 0 || moved || lsh_cg_write(lsh_spawn_cgroup, "cgroup.procs", "0") == 0) {
+			// Never run outside the requested limits.
+			execv(path, args);
+		}
+		error = errno;
+		n = write(fds[1], &error, sizeof(error));
+		_exit(n == sizeof(error) ? 127 : EXIT_FAILURE);
+	}
+
+	error = errno;
+	close(fds[1]);
+	if (pid < 0) {
+		// Error forking
+		close(fds[0]);
+		if (slot) {
+			lsh_js_unclaimed--;
+			lsh_js_release();
+		}
+		errno = error;
+		return -1;
+	}
+
+	do {
+		n = read(fds[0], &error, sizeof(error));
+	} while (n < 0 && errno == EINTR);
+	close(fds[0]);
+	if (n == sizeof(error)) {
+		waitpid(pid, NULL, 0);
+		if (slot) {
+			lsh_js_unclaimed--;
+			lsh_js_release();
+		}
+		lsh_last_status = error == ENOENT ? 127 : 126;
+		errno = error;
+		return -1;
+	}
+	return pid;
+}
+
+/**
+@brief Spawn engine: start a program with the shell's own stdio.
+@param args Null terminated list of arguments (including program).
+@return The child's pid, or -1 with errno set if fork or exec failed.
+*/
+pid_t lsh_spawn(char **args)
+{
+	return lsh_spawn_fds(args, -1, -1, -1);
+}
+
+/**
+@brief Convert a waitpid() status to a shell exit status.
+@param status Status from waitpid().
+@return Exit code, or 128 plus the terminating signal.
+*/
+int lsh_exit_status(int status)
+{
+	if (WIFSIGNALED(status)) {
+		return 128 + WTERMSIG(status);
+	}
+	return WEXITSTATUS(status);
+}
+
+/*
+Job table: children the shell has started and not yet reaped.  Each job is
+watched through a pidfd on the event loop; jobs without one (old kernels)
+are checked whenever SIGCHLD arrives.
+*/
+struct lsh_job {
+	pid_t pid;
+	int pidfd;
+	int status;
+	int done;
+	int background;
+	char *cmd;
+	void (*fn)(int id, void *data);
+	void *data;
+	struct lsh_timer *deadline;
+	long kill_after;
+	int timed_out;
+	int slot;
+};
+
+struct lsh_job *lsh_jobs = NULL;
+int lsh_jobs_cap = 0;
+
+/**
+@brief Check whether a job has exited, and if so record it and run its
+callback.
+@param id The job id.
+*/
+void lsh_job_check(int id)
+{
+	struct lsh_job *job = &lsh_jobs[id];
+	int status;
+
+	if (job->pid == 0 || job->done || waitpid(job->pid, &status, WNOHANG) <= 0) {
+		return;
+	}
+	job->status = lsh_exit_status(status);
+	job->done = 1;
+	if (job->slot) {
+		lsh_js_release();
+		job->slot = 0;
+	}
+	if (job->deadline != NULL) {
+		lsh_timer_stop(job->deadline);
+		job->deadline = NULL;
+	}
+	if (job->timed_out) {
+		// Same convention as timeout(1).
+		job->status = WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL ? 137 : 124;
+	}
+	if (job->pidfd >= 0) {
+		lsh_event_del(job->pidfd);
+		close(job->pidfd);
+		job->pidfd = -1;
+	}
+	if (job->fn != NULL) {
+		job->fn(id, job->data);
+	}
+}
+
+/**
+@brief Check all jobs that have no pidfd (after SIGCHLD).
+*/
+void lsh_job_poll(void)
+{
+	int i;
+
+	for (i = 0; i < lsh_jobs_cap; i++) {
+		if (lsh_jobs[i].pidfd < 0) {
+			lsh_job_check(i);
+		}
+	}
+}
+
+/**
+@brief Event callback: a job's pidfd became readable.
+@param fd The pidfd.
+@param data The job id.
+*/
+void lsh_job_ready(int fd, void *data)
+{
+	lsh_job_check((int)(intptr_t)data);
+}
+
+/**
+@brief Timer callback: a job ran past its deadline.  It gets SIGTERM, then
+SIGKILL once the kill-after grace period (if any) runs out too.
+@param fd Unused.
+@param data The job id.
+*/
+void lsh_job_expired(int fd, void *data)
+{
+	struct lsh_job *job = &lsh_jobs[(int)(intptr_t)data];
+
+	job->deadline = NULL;
+	if (job->timed_out) {
+		kill(job->pid, SIGKILL);
+		return;
+	}
+	job->timed_out = 1;
+	kill(job->pid, SIGTERM);
+	if (job->kill_after > 0) {
+		job->deadline = lsh_timer_start(job->kill_after, lsh_job_expired, data);
+	}
+}
+
+/**
+@brief Give a running job a deadline, replacing any it already has.
+@param id The job id.
+@param ms Milliseconds it may run before it gets SIGTERM.
+@param kill_after Milliseconds after that before SIGKILL, or 0 for never.
+*/
+void lsh_job_set_deadline(int id, long ms, long kill_after)
+{
+	struct lsh_job *job = &lsh_jobs[id];
+
+	if (job->done) {
+		return;
+	}
+	if (job->deadline != NULL) {
+		lsh_timer_stop(job->deadline);
+	}
+	job->kill_after = kill_after;
+	job->deadline = lsh_timer_start(ms, lsh_job_expired, (void *)(intptr_t)id);
+}
+
+/**
+@brief Add a started child to the job table.
+@param pid The child's pid.
+@return The job id.
+*/
+int lsh_job_add(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < lsh_jobs_cap; i++) {
+		if (lsh_jobs[i].pid == 0) {
+			break;
+		}
+	}
+	if (i == lsh_jobs_cap) {
+		lsh_jobs_cap = lsh_jobs_cap ? lsh_jobs_cap * 2 : 16;
+		lsh_jobs = realloc(lsh_jobs, lsh_jobs_cap * sizeof(struct lsh_job));
+		if (!lsh_jobs) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(lsh_jobs + i, 0, (lsh_jobs_cap - i) * sizeof(struct lsh_job));
+	}
+	memset(&lsh_jobs[i], 0, sizeof(struct lsh_job));
+	lsh_jobs[i].pid = pid;
+	lsh_jobs[i].pidfd = -1;
+	if (lsh_js_unclaimed > 0) {
+		// The child holds the jobserver slot taken when it was spawned.
+		lsh_js_unclaimed--;
+		lsh_jobs[i].slot = 1;
+	}
+#ifdef SYS_pidfd_open
+	lsh_jobs[i].pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (lsh_jobs[i].pidfd >= 0 &&
+		lsh_event_add(lsh_jobs[i].pidfd, lsh_job_ready, (void *)(intptr_t)i) != 0) {
+		close(lsh_jobs[i].pidfd);
+		lsh_jobs[i].pidfd = -1;
+	}
+#endif
+	// It may have exited before it was watched.
+	if (lsh_jobs[i].pidfd < 0) {
+		lsh_job_check(i);
+	}
+	return i;
+}
+
+/**
+@brief Apply the cmdtimeout option to a command the user is waiting for.
+Supervised services, watchers, retries and server sessions keep their own
+lifetimes.
+@param id The job id.
+*/
+void lsh_job_foreground(int id)
+{
+	if (lsh_options[LSH_OPT_CMDTIMEOUT].value > 0) {
+		lsh_job_set_deadline(id, lsh_options[LSH_OPT_CMDTIMEOUT].value * 1000L, 0);
+	}
+}
+
+/**
+@brief Run the event loop until a job finishes.
+@param id The job id.
+*/
+void lsh_job_wait(int id)
+{
+	while (!lsh_jobs[id].done) {
+		lsh_event_wait(-1);
+	}
+}
+
+/**
+@brief Remove a finished job from the table.
+@param id The job id.
+@return The job's exit status.
+*/
+int lsh_job_reap(int id)
+{
+	lsh_jobs[id].pid = 0;
+	free(lsh_jobs[id].cmd);
+	lsh_jobs[id].cmd = NULL;
+	return lsh_jobs[id].status;
+}
+
+/**
+@brief Drop every job without waiting for it, in a forked child where the
+jobs are its siblings rather than its children.
+*/
+void lsh_job_forget_all(void)
+{
+	int i;
+
+	for (i = 0; i < lsh_jobs_cap; i++) {
+		if (lsh_jobs[i].pid == 0) {
+			continue;
+		}
+		if (lsh_jobs[i].pidfd >= 0) {
+			lsh_event_del(lsh_jobs[i].pidfd);
+			close(lsh_jobs[i].pidfd);
+		}
+		if (lsh_jobs[i].deadline != NULL) {
+			lsh_timer_stop(lsh_jobs[i].deadline);
+		}
+		free(lsh_jobs[i].cmd);
+		memset(&lsh_jobs[i], 0, sizeof(struct lsh_job));
+	}
+}
+
+/**
+@brief Report and reap finished background jobs.
+*/
+void lsh_job_notify(void)
+{
+	int i;
+
+	for (i = 0; i < lsh_jobs_cap; i++) {
+		if (lsh_jobs[i].pid != 0 && lsh_jobs[i].background && lsh_jobs[i].done) {
+			printf("[%d] Done (%d)\t%s\n", i + 1, lsh_jobs[i].status, lsh_jobs[i].cmd);
+			lsh_job_reap(i);
+		}
+	}
+}
+
+void lsh_job_bg_done(int id, void *data);
+
+/**
+@brief Mark a job as a background job, reported when it finishes.
+@param id The job id.
+@param cmd Command name to report.
+*/
+void lsh_job_background(int id, const char *cmd)
+{
+	lsh_jobs[id].background = 1;
+	lsh_jobs[id].cmd = strdup(cmd);
+	lsh_jobs[id].fn = lsh_job_bg_done;
+	printf("[%d] %d\n", id + 1, (int)lsh_jobs[id].pid);
+	if (lsh_jobs[id].done) {
+		lsh_job_bg_done(id, NULL);
+	}
+}
+
+/**
+@brief Job callback: a background job finished.  If the shell is sitting at
+the prompt, report it right away and redraw the prompt.
+@param id The job id.
+@param data Unused.
+*/
+void lsh_job_bg_done(int id, void *data)
+{
+	if (lsh_at_prompt) {
+		printf("\n");
+		lsh_job_notify();
+		lsh_prompt();
+	}
+}
+
+/**
+@brief Parse a duration such as "10", "1.5s", "2m", "1h" or "1d".
+@param str The duration; plain numbers are seconds.
+@return Milliseconds, or -1 if the duration is invalid.
+*/
+long lsh_parse_duration(const char *str)
+{
+	char *end;
+	double value;
+
+	errno = 0;
+	value = strtod(str, &end);
+	if (errno != 0 || end == str || value < 0) {
+		return -1;
+	}
+	switch (*end) {
+	case 'd':
+		value *= 24;
+		// fall through
+	case 'h':
+		value *= 60;
+		// fall through
+	case 'm':
+		value *= 60;
+		// fall through
+	case 's':
+		end++;
+		// fall through
+	case '\0':
+		break;
+	default:
+		return -1;
+	}
+	if (*end != '\0') {
+		return -1;
+	}
+	return (long)(value * 1000);
+}
+
+/*
+Builtin function implementations.
+*/
+
+/**
+@brief Bultin command: echo argument.
+@param args List of args.  args[0] is "echo".  args[1] is the string for echoing.
+@return Always returns 1, to continue executing.
+*/
+int lsh_echo(char **args)
+{
+	int i = 1;
+	while (args[i] != NULL) {
+		lsh_out_write(args[i], strlen(args[i]));
+		lsh_out_write(" ", 1);
+		i++;
+	}
+	lsh_out_write("\n", 1);
+	lsh_out_flush();
+	return 1;
+}
+
+/**
+@brief Bultin command: print current directory.
+@param args List of args.  args[0] is "cd".  args[1] is the directory.
+@return Always returns 1, to continue executing.
+*/
+int lsh_pwd(char **args)
+{
+	char cwd[1024];
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		perror("lsh");
+		lsh_last_status = 1;
+		return 1;
+	}
+	lsh_out_write("Current working dir: ", 21);
+	lsh_out_write(cwd, strlen(cwd));
+	lsh_out_write("\n", 1);
+	lsh_out_flush();
+	return 1;
+}
+
+/**
+@brief Bultin command: change directory.
+@param args List of args.  args[0] is "cd".  args[1] is the directory.
+@return Always returns 1, to continue executing.
+*/
+int lsh_cd(char **args)
+{
+	if (args[1] == NULL) {
+		fprintf(stderr, "lsh: expected argument to \"cd\"\n");
+		lsh_last_status = 1;
+	}
+	else {
+		if (chdir(args[1]) != 0) {
+			perror("lsh");
+			lsh_last_status = 1;
+		}
+	}
+	return 1;
+}
+
+void lsh_records_run(char ***stages, int count);
+
+/**
+@brief Bultin command: list current directory.
+@param args List of args.  args[0] is "ls".
+@return Always returns 1, to continue executing.
+*/
+int lsh_ls(char **args)
+{
+	DIR *dp;
+	struct dirent *ep;
+
+	if (lsh_options[LSH_OPT_STRUCTURED].value) {
+		lsh_records_run(&args, 1);
+		return 1;
+	}
+
+	dp = opendir("./");
+	if (dp != NULL) {
+		while (ep = readdir(dp)) {
+			lsh_out_write(ep->d_name, strlen(ep->d_name));
+			lsh_out_write("\n", 1);
+		}
+		closedir(dp);
+		lsh_out_flush();
+	}
+	else {
+		perror("Couldn't open the directory");
+	}
+	return 1;
+}
+
+/**
+@brief Bultin command: make directory.
+@param args List of args.  args[0] is "mkdir".  args[1] is the directory.
+@return Always returns 1, to continue executing.
+*/
+int lsh_mkdir(char **args)
+{
+	if (args[1] == NULL) {
+		fprintf(stderr, "lsh: expected argument to \"mkdir\"\n");
+	}
+	else {
+		if (mkdir(args[1], 0755) != 0) {
+			perror("lsh");
+		}
+	}
+	return 1;
+}
+
+
+/**
+@brief Builtin command: print help.
+@param args List of args.  Not examined.
+@return Always returns 1, to continue executing.
+*/
+int lsh_help(char **args)
+{
+	static const char head[] = "Stephen Brennan's LSH\n"
+		"Type program names and arguments, and hit enter.\n"
+		"The following are built in:\n";
+	static const char tail[] = "Use the man command for information on other programs.\n";
+	int i;
+
+	lsh_out_write(head, sizeof(head) - 1);
+	for (i = 0; i < lsh_num_builtins(); i++) {
+		lsh_out_write("  ", 2);
+		lsh_out_write(builtin_str[i], strlen(builtin_str[i]));
+		lsh_out_write("\n", 1);
+	}
+	lsh_out_write(tail, sizeof(tail) - 1);
+	lsh_out_flush();
+	return 1;
+}
+
+/**
+@brief Builtin command: exit.
+@param args List of args.  args[1], if given, is the exit status.
+@return Always returns 0, to terminate execution.
+*/
+int lsh_exit(char **args)
+{
+	if (args[1] != NULL) {
+		lsh_last_status = atoi(args[1]);
+	}
+	return 0;
+}
+
+/**
+@brief Count up by one from a non-negative number, incrementing the decimal
+digits in place instead of formatting each number from scratch.
+@param first First number (>= 0).
+@param count How many numbers to print.
+@return 0 on success, -1 on write error.
+*/
+int lsh_seq_count_up(long long first, unsigned long long count)
+{
+	char digits[24];
+	int end = sizeof(digits) - 1, start, i;
+
+	digits[end] = '\n';
+	start = end - lsh_fmt_ll(first, digits);
+	memmove(digits + start, digits, end - start);
+
+	while (count-- > 0) {
+		if (lsh_out_write(digits + start, sizeof(digits) - start) != 0) {
+			return -1;
+		}
+		// Add one, carrying through trailing nines.
+		for (i = end - 1; i >= start && digits[i] == '9'; i--) {
+			digits[i] = '0';
+		}
+		if (i >= start) {
+			digits[i]++;
+		}
+		else if (start > 0) {
+			digits[--start] = '1';
+		}
+	}
+	return 0;
+}
+
+/**
+@brief Set an option that takes one of a list of names.
+@param opt The option.
+@param value The name given.
+@return 0 on success, -1 if the name is not one of the option's values.
+*/
+int lsh_set_named(struct lsh_option *opt, const char *value)
+{
+	int i;
+
+	for (i = 0; opt->names[i] != NULL; i++) {
+		if (strcmp(opt->names[i], value) == 0) {
+			opt->value = i;
+			return 0;
+		}
+	}
+	fprintf(stderr, "lsh: set: %s must be one of:", opt->name);
+	for (i = 0; opt->names[i] != NULL; i++) {
+		fprintf(stderr, " %s", opt->names[i]);
+	}
+	fprintf(stderr, "\n");
+	return -1;
+}
+
+/**
+@brief Bultin command: set or show shell options.
+@param args List of args.  args[0] is "set".  "-o name[=value]" sets an
+option, "+o name" clears it, and "-o" alone lists them.
+@return Always returns 1, to continue executing.
+*/
+int lsh_set(char **args)
+{
+	char *value;
+	size_t len;
+	int i;
+
+	if (args[1] == NULL || (strcmp(args[1], "-o") == 0 && args[2] == NULL)) {
+		for (i = 0; i < lsh_num_options(); i++) {
+			if (lsh_options[i].names != NULL) {
+				printf("%-15s %s\n", lsh_options[i].name, lsh_options[i].names[lsh_options[i].value]);
+			}
+			else {
+				printf("%-15s %d\n", lsh_options[i].name, lsh_options[i].value);
+			}
+		}
+		return 1;
+	}
+	if ((strcmp(args[1], "-o") != 0 && strcmp(args[1], "+o") != 0) || args[2] == NULL) {
+		fprintf(stderr, "lsh: usage: set [-o name[=value]] [+o name]\n");
+		return 1;
+	}
+
+	value = strchr(args[2], '=');
+	len = value ? (size_t)(value - args[2]) : strlen(args[2]);
+	for (i = 0; i < lsh_num_options(); i++) {
+		if (strncmp(lsh_options[i].name, args[2], len) == 0 && lsh_options[i].name[len] == '\0') {
+			if (args[1][0] == '+') {
+				lsh_options[i].value = 0;
+			}
+			else if (lsh_options[i].names != NULL) {
+				if (lsh_set_named(&lsh_options[i], value ? value + 1 : "") != 0) {
+					return 1;
+				}
+			}
+			else if (value != NULL) {
+				lsh_options[i].value = atoi(value + 1);
+			}
+			else {
+				// A plain jobserver gets a slot per CPU.
+				lsh_options[i].value = i == LSH_OPT_JOBSERVER ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+			}
+			if (lsh_options[i].changed != NULL) {
+				lsh_options[i].changed(lsh_options[i].value);
+			}
+			return 1;
+		}
+	}
+	fprintf(stderr, "lsh: set: unknown option \"%.*s\"\n", (int)len, args[2]);
+	return 1;
+}
+
+void lsh_scope_save_var(const char *name);
+
+/**
+@brief Bultin command: set environment variables.
+@param args List of args.  args[0] is "export".  Then name=value...  With
+no arguments, prints the environment.
+@return Always returns 1, to continue executing.
+*/
+int lsh_export(char **args)
+{
+	extern char **environ;
+	char *value;
+	int i;
+
+	if (args[1] == NULL) {
+		for (i = 0; environ[i] != NULL; i++) {
+			printf("%s\n", environ[i]);
+		}
+		return 1;
+	}
+	for (i = 1; args[i] != NULL; i++) {
+		value = strchr(args[i], '=');
+		if (value == NULL || value == args[i]) {
+			fprintf(stderr, "lsh: export: expected name=value, got \"%s\"\n", args[i]);
+			continue;
+		}
+		*value = '\0';
+		lsh_scope_save_var(args[i]);
+		if (setenv(args[i], value + 1, 1) != 0) {
+			perror("lsh: export");
+		}
+		else if (strcmp(args[i], "PATH") == 0) {
+			lsh_path_forget();
+		}
+		*value = '=';
+	}
+	return 1;
+}
+
+/**
+@brief Bultin command: show or fill the PATH lookup cache.
+@param args List of args.  args[0] is "hash".  Then -r to empty the cache,
+or names to look up now.  With no arguments, prints the cache.
+@return Always returns 1, to continue executing.
+*/
+int lsh_hash(char **args)
+{
+	struct lsh_path_entry *e;
+	int i;
+
+	if (args[1] == NULL) {
+		for (i = 0; i < LSH_PATH_CACHE_SIZE; i++) {
+			for (e = lsh_path_cache[i]; e != NULL; e = e->next) {
+				printf("%-15s %s\n", e->name, e->path);
+			}
+		}
+		return 1;
+	}
+	if (strcmp(args[1], "-r") == 0) {
+		lsh_path_forget();
+		return 1;
+	}
+	for (i = 1; args[i] != NULL; i++) {
+		if (lsh_path_lookup(args[i]) == NULL) {
+			fprintf(stderr, "lsh: hash: %s: not found\n", args[i]);
+		}
+	}
+	return 1;
+}
+
+/**
+@brief Bultin command: run a command with a time limit.
+@param args List of args.  args[0] is "timeout".  Then [-k kill_after]
+duration cmd...  The command gets SIGTERM at the deadline and SIGKILL
+kill_after later.  Its status is 124 if it timed out.
+@return Always returns 1, to continue executing.
+*/
+int lsh_timeout(char **args)
+{
+	long ms, kill_after = 0;
+	pid_t pid;
+	int i = 1, id;
+
+	if (args[i] != NULL && strcmp(args[i], "-k") == 0) {
+		if (args[i + 1] == NULL || (kill_after = lsh_parse_duration(args[i + 1])) < 0) {
+			fprintf(stderr, "lsh: timeout: invalid kill-after duration\n");
+			return 1;
+		}
+		i += 2;
+	}
+	if (args[i] == NULL || args[i + 1] == NULL) {
+		fprintf(stderr, "lsh: usage: timeout [-k kill_after] duration cmd...\n");
+		return 1;
+	}
+	if ((ms = lsh_parse_duration(args[i])) < 0) {
+		fprintf(stderr, "lsh: timeout: invalid duration \"%s\"\n", args[i]);
+		return 1;
+	}
+
+	pid = lsh_spawn(args + i + 1);
+	if (pid < 0) {
+		perror("lsh");
+		return 1;
+	}
+	id = lsh_job_add(pid);
+	lsh_job_set_deadline(id, ms, kill_after);
+	if (lsh_background) {
+		lsh_job_background(id, args[i + 1]);
+		lsh_last_status = 0;
+		return 1;
+	}
+	lsh_job_wait(id);
+	lsh_last_status = lsh_job_reap(id);
+	return 1;
+}
+
+/*
+Resource envelopes.  limit creates a transient cgroup below the shell's own
+(cgroup v2, delegated subtree) for each command and removes it afterwards.
+If the shell had to move into a leaf of its own to enable controllers, it
+moves back and removes the leaf once the command is reaped.
+*/
+int lsh_cg_seq = 0;
+char lsh_cg_leaf[4096] = "";
+char lsh_cg_base[4096] = "";
+char lsh_cg_controllers[64] = "";
+
+/**
+@brief Find the directory of the shell's cgroup in the v2 hierarchy.
+@param buf Buffer for the path.
+@param size Size of buf.
+@return 0 on success, -1 if there is no cgroup v2 hierarchy.
+*/
+int lsh_cg_self(char *buf, size_t size)
+{
+	char line[4096], mount[1024] = "", rel[4096] = "", *p, *q;
+	FILE *f;
+	int i;
+
+	if ((f = fopen("/proc/self/mountinfo", "r")) == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		// Mount point is the fifth field; fstype follows the " - " separator.
+		if ((q = strstr(line, " - cgroup2 ")) == NULL) {
+			continue;
+		}
+		for (p = line, i = 0; i < 4 && p != NULL; i++) {
+			p = strchr(p, ' ');
+			p = p ? p + 1 : NULL;
+		}
+		if (p != NULL && (q = strchr(p, ' ')) != NULL) {
+			snprintf(mount, sizeof(mount), "%.*s", (int) (q - p), p);
+			break;
+		}
+	}
+	fclose(f);
+
+	if ((f = fopen("/proc/self/cgroup", "r")) == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "0::", 3) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			snprintf(rel, sizeof(rel), "%s", line + 3);
+		}
+	}
+	fclose(f);
+
+	if (mount[0] == '\0' || rel[0] == '\0') {
+		return -1;
+	}
+	snprintf(buf, size, "%s%s", mount, strcmp(rel, "/") == 0 ? "" : rel);
+	return 0;
+}
+
+/**
+@brief Enable controllers for the children of the shell's cgroup.  A cgroup
+with member processes cannot also hand controllers to children (EBUSY), so
+the shell first moves itself into a leaf of its own.
+@param base Path of the shell's cgroup.
+@param controllers Controllers to enable, e.g. "+memory +pids".
+@return 0 on success, -1 with errno set on failure.
+*/
+int lsh_cg_enable(const char *base, const char *controllers)
+{
+	char path[4096], pid[32];
+	int dir, leaf, result;
+
+	if ((dir = open(base, O_DIRECTORY | O_CLOEXEC)) < 0) {
+		return -1;
+	}
+	result = lsh_cg_write(dir, "cgroup.subtree_control", controllers);
+	if (result != 0 && errno == EBUSY) {
+		snprintf(path, sizeof(path), "%s/aash-%d", base, (int) getpid());
+		if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+			close(dir);
+			return -1;
+		}
+		if ((leaf = open(path, O_DIRECTORY | O_CLOEXEC)) < 0) {
+			close(dir);
+			return -1;
+		}
+		snprintf(pid, sizeof(pid), "%d", (int) getpid());
+		result = lsh_cg_write(leaf, "cgroup.procs", pid);
+		close(leaf);
+		if (result == 0) {
+			snprintf(lsh_cg_leaf, sizeof(lsh_cg_leaf), "%s", path);
+			snprintf(lsh_cg_base, sizeof(lsh_cg_base), "%s", base);
+			snprintf(lsh_cg_controllers, sizeof(lsh_cg_controllers), "%s", controllers);
+			result = lsh_cg_write(dir, "cgroup.subtree_control", controllers);
+		}
+	}
+	close(dir);
+	return result;
+}
+
+/**
+@brief Undo lsh_cg_enable()'s move into a leaf: disable the controllers it
+enabled, move the shell back and remove the leaf.  The leaf stays while
+other children of the shell are still in it.
+*/
+void lsh_cg_restore(void)
+{
+	char pid[32], *p;
+	int dir;
+
+	if (lsh_cg_leaf[0] == '\0' || (dir = open(lsh_cg_base, O_DIRECTORY | O_CLOEXEC)) < 0) {
+		return;
+	}
+	for (p = lsh_cg_controllers; (p = strchr(p, '+')) != NULL; p++) {
+		*p = '-';
+	}
+	snprintf(pid, sizeof(pid), "%d", (int) getpid());
+	if (lsh_cg_write(dir, "cgroup.subtree_control", lsh_cg_controllers) == 0 &&
+		lsh_cg_write(dir, "cgroup.procs", pid) == 0 && rmdir(lsh_cg_leaf) == 0) {
+		lsh_cg_leaf[0] = '\0';
+	}
+	close(dir);
+}
+
+/**
+@brief Wait until a cgroup has no processes left, as reported by
+cgroup.events, which the kernel marks for poll() when it changes.
+@param dir The cgroup directory fd.
+@param ms Longest time to wait, in milliseconds.
+*/
+void lsh_cg_wait_empty(int dir, int ms)
+{
+	struct pollfd pfd;
+	char events[256];
+	ssize_t n;
+
+	if ((pfd.fd = openat(dir, "cgroup.events", O_RDONLY | O_CLOEXEC)) < 0) {
+		return;
+	}
+	pfd.events = POLLPRI;
+	for (;;) {
+		n = pread(pfd.fd, events, sizeof(events) - 1, 0);
+		if (n < 0) {
+			break;
+		}
+		events[n] = '\0';
+		if (strstr(events, "populated 0") != NULL || poll(&pfd, 1, ms) <= 0) {
+			break;
+		}
+	}
+	close(pfd.fd);
+}
+
+/**
+@brief Parse a memory size with an optional K, M, G or T suffix.
+@param str The string.
+@return Size in bytes, or -1 if invalid.
+*/
+long long lsh_parse_size(const char *str)
+{
+	char *end;
+	long long value;
+	int shift = 0;
+
+	errno = 0;
+	value = strtoll(str, &end, 10);
+	if (errno != 0 || end == str || value < 0) {
+		return -1;
+	}
+	switch (*end) {
+	case 'k': case 'K': shift = 10; end++; break;
+	case 'm': case 'M': shift = 20; end++; break;
+	case 'g': case 'G': shift = 30; end++; break;
+	case 't': case 'T': shift = 40; end++; break;
+	}
+	if (*end != '\0' || value > (LLONG_MAX >> shift)) {
+		return -1;
+	}
+	return value << shift;
+}
+
+/**
+@brief Bultin command: run a command inside a cgroup with resource limits.
+@param args List of args.  args[0] is "limit".  Then [--mem size] [--cpu
+cpus] [--pids n] cmd...  Prints the command's peak memory use when it exits.
+@return Always returns 1, to continue executing.
+*/
+int lsh_limit(char **args)
+{
+	char base[4096], path[4160], value[64], controllers[64] = "";
+	char *mem = NULL, *pids = NULL;
+	double cpu = 0;
+	long long bytes = 0, peak;
+	int i = 1, dir, fd, id, ok = 1;
+	ssize_t n;
+	pid_t pid;
+
+	while (args[i] != NULL && args[i][0] == '-' && args[i + 1] != NULL) {
+		if (strcmp(args[i], "--mem") == 0) {
+			mem = args[i + 1];
+			if ((bytes = lsh_parse_size(mem)) < 0) {
+				fprintf(stderr, "lsh: limit: invalid size \"%s\"\n", mem);
+				return 1;
+			}
+		}
+		else if (strcmp(args[i], "--cpu") == 0) {
+			cpu = strtod(args[i + 1], NULL);
+			if (cpu <= 0) {
+				fprintf(stderr, "lsh: limit: invalid cpu count \"%s\"\n", args[i + 1]);
+				return 1;
+			}
+		}
+		else if (strcmp(args[i], "--pids") == 0) {
+			pids = args[i + 1];
+		}
+		else {
+			break;
+		}
+		i += 2;
+	}
+	if (args[i] == NULL) {
+		fprintf(stderr, "lsh: usage: limit [--mem size] [--cpu cpus] [--pids n] cmd...\n");
+		return 1;
+	}
+	if (lsh_background) {
+		fprintf(stderr, "lsh: limit: cannot run in the background\n");
+		return 1;
+	}
+	if (lsh_cg_self(base, sizeof(base)) != 0) {
+		fprintf(stderr, "lsh: limit: no cgroup v2 hierarchy\n");
+		return 1;
+	}
+
+	if (mem) {
+		strcat(controllers, "+memory ");
+	}
+	if (cpu > 0) {
+		strcat(controllers, "+cpu ");
+	}
+	if (pids) {
+		strcat(controllers, "+pids ");
+	}
+	if (controllers[0] != '\0' && lsh_cg_enable(base, controllers) != 0) {
+		fprintf(stderr, "lsh: limit: cannot enable controllers in %s: %s\n", base, strerror(errno));
+		lsh_cg_restore();
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/aash-%d.%d", base, (int) getpid(), ++lsh_cg_seq);
+	if (mkdir(path, 0755) != 0 || (dir = open(path, O_DIRECTORY | O_CLOEXEC)) < 0) {
+		fprintf(stderr, "lsh: limit: %s: %s\n", path, strerror(errno));
+		lsh_cg_restore();
+		return 1;
+	}
+	if (mem) {
+		snprintf(value, sizeof(value), "%lld", bytes);
+		ok = lsh_cg_write(dir, "memory.max", value) == 0;
+	}
+	if (ok && cpu > 0) {
+		snprintf(value, sizeof(value), "%ld 100000", (long) (cpu * 100000));
+		ok = lsh_cg_write(dir, "cpu.max", value) == 0;
+	}
+	if (ok && pids) {
+		ok = lsh_cg_write(dir, "pids.max", pids) == 0;
+	}
+	if (!ok) {
+		fprintf(stderr, "lsh: limit: cannot set limits in %s: %s\n", path, strerror(errno));
+		close(dir);
+		rmdir(path);
+		lsh_cg_restore();
+		return 1;
+	}
+
+	lsh_spawn_cgroup = dir;
+	pid = lsh_spawn(args + i);
+	lsh_spawn_cgroup = -1;
+	if (pid < 0) {
+		perror("lsh");
+	}
+	else {
+		id = lsh_job_add(pid);
+		lsh_job_foreground(id);
+		lsh_job_wait(id);
+		lsh_last_status = lsh_job_reap(id);
+		if ((fd = openat(dir, "memory.peak", O_RDONLY | O_CLOEXEC)) >= 0) {
+			n = read(fd, value, sizeof(value) - 1);
+			close(fd);
+			if (n > 0) {
+				value[n] = '\0';
+				peak = atoll(value);
+				fprintf(stderr, "lsh: limit: peak memory %.1f MiB\n", peak / 1048576.0);
+			}
+		}
+	}
+	// Descendants the command left behind would keep the cgroup busy.
+	if (lsh_cg_write(dir, "cgroup.kill", "1") == 0) {
+		lsh_cg_wait_empty(dir, 1000);
+	}
+	close(dir);
+	if (rmdir(path) != 0) {
+		fprintf(stderr, "lsh: limit: %s: %s\n", path, strerror(errno));
+	}
+	lsh_cg_restore();
+	return 1;
+}
+
+/**
+@brief Copy a NULL terminated argument list, for commands that outlive the
+line they were typed on.
+@param args The arguments.
+@return Newly allocated copy; release with lsh_free_args().
+*/
+char **lsh_dup_args(char **args)
+{
+	char **copy;
+	int i, n;
+
+	for (n = 0; args[n] != NULL; n++) {
+	}
+	copy = malloc((n + 1) * sizeof(char *));
+	if (!copy) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n; i++) {
+		if (!(copy[i] = strdup(args[i]))) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	copy[n] = NULL;
+	return copy;
+}
+
+/**
+@brief Free an argument list made by lsh_dup_args().
+@param args The arguments.
+*/
+void lsh_free_args(char **args)
+{
+	int i;
+
+	for (i = 0; args[i] != NULL; i++) {
+		free(args[i]);
+	}
+	free(args);
+}
+
+/**
+@brief Print a message about something that finished in the background,
+redrawing the prompt if the shell is waiting at it.
+@param msg The message, without a trailing newline.
+*/
+void lsh_notice(const char *msg)
+{
+	printf("%s%s\n", lsh_at_prompt ? "\n" : "", msg);
+	if (lsh_at_prompt) {
+		lsh_prompt();
+	}
+}
+
+#define LSH_RETRY_CODES 32
+/*
+A retry run: the command is restarted from job callbacks and timers on the
+event loop, so waiting between attempts costs nothing and several retries
+can be in flight at once.
+*/
+struct lsh_retry {
+	char **argv;
+	int attempts;
+	int attempt;
+	long base;
+	long max;
+	int codes[LSH_RETRY_CODES];
+	int ncodes;
+	int background;
+	int done;
+	int status;
+	int job;
+	struct lsh_timer *timer;
+};
+
+void lsh_retry_attempt(int fd, void *data);
+
+/**
+@brief Finish a retry run, reporting it if it ran in the background.
+@param r The retry run.
+@param status Final exit status.
+*/
+void lsh_retry_finish(struct lsh_retry *r, int status)
+{
+	char msg[256];
+
+	r->done = 1;
+	r->status = status;
+	if (r->background) {
+		snprintf(msg, sizeof(msg), "[retry] Done (%d) after %d attempt%s\t%s",
+			status, r->attempt, r->attempt == 1 ? "" : "s", r->argv[0]);
+		lsh_notice(msg);
+		lsh_free_args(r->argv);
+		free(r);
+	}
+}
+
+/**
+@brief Decide whether a failed attempt should be retried.
+@param r The retry run.
+@param status The attempt's exit status.
+@return Nonzero to retry.
+*/
+int lsh_retry_wanted(struct lsh_retry *r, int status)
+{
+	int i;
+
+	if (status == 0 || r->attempt >= r->attempts || (!r->background && lsh_interrupted)) {
+		return 0;
+	}
+	if (r->ncodes == 0) {
+		return 1;
+	}
+	for (i = 0; i < r->ncodes; i++) {
+		if (r->codes[i] == status) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+@brief Handle the end of an attempt: finish, or schedule the next attempt
+after an exponential backoff with jitter.
+@param r The retry run.
+@param status The attempt's exit status.
+*/
+void lsh_retry_ended(struct lsh_retry *r, int status)
+{
+	long delay = r->base;
+	int i;
+
+	if (!lsh_retry_wanted(r, status)) {
+		lsh_retry_finish(r, status);
+		return;
+	}
+	for (i = 1; i < r->attempt && delay < r->max; i++) {
+		delay *= 2;
+	}
+	if (delay > r->max) {
+		delay = r->max;
+	}
+	// Equal jitter: half the delay, plus a random part of the other half.
+	delay = delay / 2 + (delay > 1 ? random() % (delay - delay / 2 + 1) : delay % 2);
+	r->timer = lsh_timer_start(delay, lsh_retry_attempt, r);
+}
+
+/**
+@brief Job callback: an attempt exited.
+@param id The job id.
+@param data The retry run.
+*/
+void lsh_retry_exited(int id, void *data)
+{
+	lsh_retry_ended(data, lsh_job_reap(id));
+}
+
+/**
+@brief Start the next attempt (also a timer callback).
+@param fd Unused.
+@param data The retry run.
+*/
+void lsh_retry_attempt(int fd, void *data)
+{
+	struct lsh_retry *r = data;
+	pid_t pid;
+	int status;
+
+	r->timer = NULL;
+	r->attempt++;
+	pid = lsh_spawn(r->argv);
+	if (pid < 0) {
+		// As for exec failures; a failed fork or pipe leaves no status.
+		status = errno == ENOENT ? 127 : 126;
+		perror("lsh: retry");
+		lsh_retry_ended(r, status);
+		return;
+	}
+	r->job = lsh_job_add(pid);
+	lsh_jobs[r->job].fn = lsh_retry_exited;
+	lsh_jobs[r->job].data = r;
+	if (lsh_jobs[r->job].done) {
+		lsh_retry_exited(r->job, r);
+	}
+}
+
+/**
+@brief Bultin command: rerun a failing command with exponential backoff.
+@param args List of args.  args[0] is "retry".  Then [-n attempts]
+[--backoff base,max] [--on-exit codes] cmd...  Defaults are 5 attempts and
+a 1s to 60s backoff; without --on-exit any nonzero status is retried.
+@return Always returns 1, to continue executing.
+*/
+int lsh_retry(char **args)
+{
+	static int seeded = 0;
+	struct lsh_retry *r;
+	char *p, *comma;
+	int i = 1;
+
+	r = calloc(1, sizeof(*r));
+	if (!r) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	r->attempts = 5;
+	r->base = 1000;
+	r->max = 60000;
+
+	for (; args[i] != NULL && args[i][0] == '-' && args[i + 1] != NULL; i += 2) {
+		if (strcmp(args[i], "-n") == 0) {
+			r->attempts = atoi(args[i + 1]);
+		}
+		else if (strcmp(args[i], "--backoff") == 0) {
+			comma = strchr(args[i + 1], ',');
+			if (comma != NULL) {
+				*comma = '\0';
+				r->max = lsh_parse_duration(comma + 1);
+			}
+			r->base = lsh_parse_duration(args[i + 1]);
+			if (r->base < 0 || r->max < r->base) {
+				fprintf(stderr, "lsh: retry: invalid backoff\n");
+				free(r);
+				return 1;
+			}
+		}
+		else if (strcmp(args[i], "--on-exit") == 0) {
+			for (p = strtok(args[i + 1], ","); p != NULL && r->ncodes < LSH_RETRY_CODES; p = strtok(NULL, ",")) {
+				r->codes[r->ncodes++] = atoi(p);
+			}
+		}
+		else {
+			break;
+		}
+	}
+	if (args[i] == NULL || r->attempts < 1) {
+		fprintf(stderr, "lsh: usage: retry [-n attempts] [--backoff base,max] [--on-exit codes] cmd...\n");
+		free(r);
+		return 1;
+	}
+	if (!seeded) {
+		srandom(lsh_wheel_clock() ^ getpid());
+		seeded = 1;
+	}
+
+	r->argv = lsh_dup_args(args + i);
+	r->background = lsh_background;
+	lsh_retry_attempt(-1, r);
+	if (r->background) {
+		lsh_last_status = 0;
+		return 1;
+	}
+
+	while (!r->done) {
+		lsh_event_wait(-1);
+		if (lsh_interrupted && r->timer != NULL) {
+			lsh_timer_stop(r->timer);
+			lsh_retry_finish(r, 130);
+		}
+	}
+	lsh_last_status = r->status;
+	lsh_free_args(r->argv);
+	free(r);
+	return 1;
+}
+
+#define LSH_WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+	IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+/*
+State of an on-change run: the inotify watch set, the debounce timer and
+the command instance currently running, if any.
+*/
+struct lsh_watch {
+	int fd;
+	char **paths;
+	int cap;
+	char **argv;
+	long debounce;
+	struct lsh_timer *timer;
+	int job;
+	int pending;
+};
+
+/**
+@brief Watch a path, and every directory below it.
+@param w The watch state.
+@param path File or directory.
+@return 0 on success, -1 if the path itself could not be watched.
+*/
+int lsh_watch_add(struct lsh_watch *w, const char *path)
+{
+	struct dirent *ep;
+	struct stat st;
+	char *sub;
+	DIR *dp;
+	int wd, cap;
+
+	wd = inotify_add_watch(w->fd, path, LSH_WATCH_MASK | IN_DONT_FOLLOW);
+	if (wd < 0) {
+		return -1;
+	}
+	if (wd >= w->cap) {
+		cap = w->cap ? w->cap : 64;
+		while (cap <= wd) {
+			cap *= 2;
+		}
+		w->paths = realloc(w->paths, cap * sizeof(char *));
+		if (!w->paths) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(w->paths + w->cap, 0, (cap - w->cap) * sizeof(char *));
+		w->cap = cap;
+	}
+	free(w->paths[wd]);
+	w->paths[wd] = strdup(path);
+
+	if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode) || (dp = opendir(path)) == NULL) {
+		return 0;
+	}
+	while ((ep = readdir(dp)) != NULL) {
+		if (ep->d_type != DT_DIR && ep->d_type != DT_UNKNOWN) {
+			continue;
+		}
+		if (strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0) {
+			continue;
+		}
+		sub = malloc(strlen(path) + strlen(ep->d_name) + 2);
+		if (!sub) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		sprintf(sub, "%s/%s", path, ep->d_name);
+		if (ep->d_type == DT_DIR || (lstat(sub, &st) == 0 && S_ISDIR(st.st_mode))) {
+			lsh_watch_add(w, sub);
+		}
+		free(sub);
+	}
+	closedir(dp);
+	return 0;
+}
+
+/**
+@brief Start the command.
+@param w The watch state.
+*/
+void lsh_watch_run(struct lsh_watch *w);
+
+/**
+@brief Job callback: the command exited.  Start it again if changes came in
+while it was being cancelled.
+@param id The job id.
+@param data The watch state.
+*/
+void lsh_watch_exited(int id, void *data)
+{
+	struct lsh_watch *w = data;
+
+	lsh_job_reap(id);
+	w->job = -1;
+	if (w->pending) {
+		w->pending = 0;
+		lsh_watch_run(w);
+	}
+}
+
+void lsh_watch_run(struct lsh_watch *w)
+{
+	pid_t pid;
+
+	pid = lsh_spawn(w->argv);
+	if (pid < 0) {
+		perror("lsh: on-change");
+		return;
+	}
+	w->job = lsh_job_add(pid);
+	lsh_jobs[w->job].fn = lsh_watch_exited;
+	lsh_jobs[w->job].data = w;
+	if (lsh_jobs[w->job].done) {
+		lsh_watch_exited(w->job, w);
+	}
+}
+
+/**
+@brief Timer callback: changes have settled.  Cancel a running instance
+(it is restarted when it exits) or start the command.
+@param fd Unused.
+@param data The watch state.
+*/
+void lsh_watch_settled(int fd, void *data)
+{
+	struct lsh_watch *w = data;
+
+	w->timer = NULL;
+	if (w->job >= 0) {
+		w->pending = 1;
+		kill(lsh_jobs[w->job].pid, SIGTERM);
+	}
+	else {
+		lsh_watch_run(w);
+	}
+}
+
+/**
+@brief Event callback: inotify events arrived.  New directories join the
+watch set, and the debounce timer restarts.
+@param fd The inotify fd.
+@param data The watch state.
+*/
+void lsh_watch_ready(int fd, void *data)
+{
+	struct lsh_watch *w = data;
+	struct inotify_event *ev;
+	char buf[65536], *p, *sub;
+	ssize_t n;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)p;
+			if (ev->wd < 0 || ev->wd >= w->cap || w->paths[ev->wd] == NULL) {
+				continue;
+			}
+			if (ev->mask & IN_IGNORED) {
+				free(w->paths[ev->wd]);
+				w->paths[ev->wd] = NULL;
+				continue;
+			}
+			if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && ev->len > 0) {
+				sub = malloc(strlen(w->paths[ev->wd]) + strlen(ev->name) + 2);
+				if (!sub) {
+					fprintf(stderr, "lsh: allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+				sprintf(sub, "%s/%s", w->paths[ev->wd], ev->name);
+				lsh_watch_add(w, sub);
+				free(sub);
+			}
+		}
+	}
+
+	if (w->timer != NULL) {
+		lsh_timer_stop(w->timer);
+	}
+	w->timer = lsh_timer_start(w->debounce, lsh_watch_settled, w);
+}
+
+/**
+@brief Bultin command: rerun a command whenever files change.
+@param args List of args.  args[0] is "on-change".  Then [-d debounce]
+path... -- cmd...  Directories are watched recursively.  The command runs
+once at start and again after each burst of changes has been quiet for
+the debounce time (default 100ms); a still running instance is sent
+SIGTERM first.  Runs until interrupted.
+@return Always returns 1, to continue executing.
+*/
+int lsh_on_change(char **args)
+{
+	struct lsh_watch w;
+	int i = 1, sep, watched = 0;
+
+	memset(&w, 0, sizeof(w));
+	w.debounce = 100;
+	w.job = -1;
+	if (args[i] != NULL && strcmp(args[i], "-d") == 0) {
+		if (args[i + 1] == NULL || (w.debounce = lsh_parse_duration(args[i + 1])) < 0) {
+			fprintf(stderr, "lsh: on-change: invalid debounce time\n");
+			return 1;
+		}
+		i += 2;
+	}
+	for (sep = i; args[sep] != NULL && strcmp(args[sep], "--") != 0; sep++) {
+	}
+	if (sep == i || args[sep] == NULL || args[sep + 1] == NULL) {
+		fprintf(stderr, "lsh: usage: on-change [-d debounce] path... -- cmd...\n");
+		return 1;
+	}
+
+	w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w.fd < 0) {
+		perror("lsh: on-change");
+		return 1;
+	}
+	for (; i < sep; i++) {
+		if (lsh_watch_add(&w, args[i]) != 0) {
+			fprintf(stderr, "lsh: on-change: %s: %s\n", args[i], strerror(errno));
+		}
+		else {
+			watched++;
+		}
+	}
+
+	w.argv = args + sep + 1;
+	if (watched > 0 && lsh_event_add(w.fd, lsh_watch_ready, &w) == 0) {
+		lsh_watch_run(&w);
+		while (!lsh_interrupted) {
+			lsh_event_wait(-1);
+		}
+		lsh_event_del(w.fd);
+	}
+
+	if (w.timer != NULL) {
+		lsh_timer_stop(w.timer);
+	}
+	if (w.job >= 0) {
+		// Leave the last instance to finish on its own; Ctrl-C reached it too.
+		lsh_jobs[w.job].fn = NULL;
+		lsh_job_wait(w.job);
+		lsh_job_reap(w.job);
+	}
+	close(w.fd);
+	for (i = 0; i < w.cap; i++) {
+		free(w.paths[i]);
+	}
+	free(w.paths);
+	lsh_last_status = lsh_interrupted ? 130 : 1;
+	return 1;
+}
+
+#define LSH_LOG_KEEP 3
+/*
+Size-capped log writer: when the file would grow past the cap it is rotated
+to file.1 (file.1 to file.2, and so on) and started afresh.
+*/
+struct lsh_logw {
+	const char *path;
+	int fd;
+	off_t size;
+	off_t cap;
+};
+
+/**
+@brief Open a log file for appending.
+@param log The log writer; path and cap must be set.
+@return 0 on success, -1 on error (errno is set).
+*/
+int lsh_logw_open(struct lsh_logw *log)
+{
+	struct stat st;
+
+	log->fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (log->fd < 0) {
+		return -1;
+	}
+	log->size = fstat(log->fd, &st) == 0 ? st.st_size : 0;
+	return 0;
+}
+
+/**
+@brief Append to a log, rotating it first if it would exceed its cap.
+@param log The log writer.
+@param data Bytes to write.
+@param len Number of bytes.
+*/
+void lsh_logw_write(struct lsh_logw *log, const char *data, size_t len)
+{
+	char from[4096], to[4096];
+	int i;
+
+	if (log->cap > 0 && log->size > 0 && log->size + (off_t)len > log->cap) {
+		close(log->fd);
+		for (i = LSH_LOG_KEEP; i > 1; i--) {
+			snprintf(from, sizeof(from), "%s.%d", log->path, i - 1);
+			snprintf(to, sizeof(to), "%s.%d", log->path, i);
+			rename(from, to);
+		}
+		snprintf(to, sizeof(to), "%s.1", log->path);
+		rename(log->path, to);
+		if (lsh_logw_open(log) != 0) {
+			perror("lsh: log");
+			return;
+		}
+	}
+	while (len > 0) {
+		ssize_t n = write(log->fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		data += n;
+		len -= n;
+		log->size += n;
+	}
+}
+
+#define LSH_SVC_HISTORY 64
+struct lsh_supervise;
+
+/*
+One supervised instance: its current job, the pipe its output comes in
+on, and recent restart times for crash-loop detection.  The shell keeps
+the pipe's write end while it supervises, so every run writes to the same
+pipe even if something from an earlier run still holds it.
+*/
+struct lsh_svc_inst {
+	struct lsh_supervise *sv;
+	int index;
+	int job;
+	int outfd;
+	int logfd;
+	struct lsh_timer *timer;
+	uint64_t started;
+	int fails;
+	uint64_t restarts[LSH_SVC_HISTORY];
+	int nrestarts;
+};
+
+struct lsh_supervise {
+	char **argv;
+	int n;
+	long base;
+	long max;
+	int loop_count;
+	long loop_window;
+	int logging;
+	struct lsh_logw log;
+	int stopping;
+	int running;
+	struct lsh_svc_inst *inst;
+};
+
+/**
+@brief Event callback: output from an instance.  Copied to the log.
+@param fd The read end of the instance's pipe.
+@param data The instance.
+*/
+void lsh_svc_output(int fd, void *data)
+{
+	struct lsh_svc_inst *in = data;
+	char buf[65536];
+	ssize_t n;
+
+	n = read(fd, buf, sizeof(buf));
+	if (n > 0) {
+		lsh_logw_write(&in->sv->log, buf, n);
+	}
+	else if (n == 0 || errno != EINTR) {
+		lsh_event_del(fd);
+		close(fd);
+		in->outfd = -1;
+	}
+}
+
+void lsh_svc_start(int fd, void *data);
+
+/**
+@brief Schedule the restart of an instance that ended, with backoff;
+restarts that come too fast too often count as a crash loop and wait the
+maximum backoff.
+@param in The instance.
+@param status Its exit status, 127 if it could not be started.
+*/
+void lsh_svc_ended(struct lsh_svc_inst *in, int status)
+{
+	struct lsh_supervise *sv = in->sv;
+	uint64_t now = lsh_wheel_clock();
+	long delay;
+	int i, recent = 0;
+
+	// Ctrl-C reaches the instances too; do not restart them for it.
+	if (sv->stopping || lsh_check_interrupt()) {
+		return;
+	}
+
+	// A run that lasted a whole window resets the backoff.
+	in->fails = now - in->started >= (uint64_t)sv->loop_window ? 0 : in->fails + 1;
+	delay = in->fails == 0 ? 0 : sv->base;
+	for (i = 1; i < in->fails && delay < sv->max; i++) {
+		delay *= 2;
+	}
+	if (delay > sv->max) {
+		delay = sv->max;
+	}
+
+	in->restarts[in->nrestarts++ % LSH_SVC_HISTORY] = now;
+	for (i = 0; i < in->nrestarts && i < LSH_SVC_HISTORY; i++) {
+		if (now - in->restarts[i] < (uint64_t)sv->loop_window) {
+			recent++;
+		}
+	}
+	if (recent >= sv->loop_count) {
+		fprintf(stderr, "lsh: supervise: [%d] crash loop (%d restarts in %lds)\n",
+			in->index, recent, sv->loop_window / 1000);
+		delay = sv->max;
+	}
+
+	fprintf(stderr, "lsh: supervise: [%d] exited with status %d, restarting in %.1fs\n",
+		in->index, status, delay / 1000.0);
+	in->timer = lsh_timer_start(delay, lsh_svc_start, in);
+}
+
+/**
+@brief Job callback: an instance exited.
+@param id The job id.
+@param data The instance.
+*/
+void lsh_svc_exited(int id, void *data)
+{
+	struct lsh_svc_inst *in = data;
+	int status;
+
+	status = lsh_job_reap(id);
+	in->job = -1;
+	in->sv->running--;
+	lsh_svc_ended(in, status);
+}
+
+/**
+@brief Start an instance (also a timer callback for restarts).
+@param fd Unused.
+@param data The instance.
+*/
+void lsh_svc_start(int fd, void *data)
+{
+	struct lsh_svc_inst *in = data;
+	struct lsh_supervise *sv = in->sv;
+	int fds[2];
+	pid_t pid;
+
+	in->timer = NULL;
+	in->started = lsh_wheel_clock();
+	if (sv->logging && in->logfd < 0) {
+		if (pipe2(fds, O_CLOEXEC) != 0) {
+			perror("lsh: supervise");
+		}
+		else {
+			in->logfd = fds[1];
+			in->outfd = fds[0];
+			fcntl(in->outfd, F_SETFL, O_NONBLOCK);
+			lsh_event_add(in->outfd, lsh_svc_output, in);
+		}
+	}
+
+	pid = lsh_spawn_fds(sv->argv, -1, in->logfd, in->logfd);
+	if (pid < 0) {
+		perror("lsh: supervise");
+		// Same as a command that is not found: an instant exit, with
+		// the backoff and crash-loop checks that come with it.
+		lsh_svc_ended(in, 127);
+		return;
+	}
+
+	in->job = lsh_job_add(pid);
+	sv->running++;
+	lsh_jobs[in->job].fn = lsh_svc_exited;
+	lsh_jobs[in->job].data = in;
+	if (lsh_jobs[in->job].done) {
+		lsh_svc_exited(in->job, in);
+	}
+}
+
+/**
+@brief Parse a "a,b" option value.
+@param value The value; modified.
+@param first Where to store the first part.
+@param second Where to store the second part, if present.
+*/
+void lsh_split_pair(char *value, char **first, char **second)
+{
+	char *comma = strchr(value, ',');
+
+	*first = value;
+	if (comma != NULL) {
+		*comma = '\0';
+		*second = comma + 1;
+	}
+}
+
+/**
+@brief Bultin command: keep instances of a command running.
+@param args List of args.  args[0] is "supervise".  Then [-n instances]
+[--backoff base,max] [--crash-loop restarts,window] [--log file]
+[--log-size bytes] cmd...  Defaults: 1 instance, 1s to 60s backoff, a
+crash loop is 5 restarts within 60s.  Runs until interrupted, then stops
+the instances with SIGTERM.
+@return Always returns 1, to continue executing.
+*/
+int lsh_supervise(char **args)
+{
+	struct lsh_supervise sv;
+	char *a, *b;
+	int i = 1, k;
+
+	memset(&sv, 0, sizeof(sv));
+	sv.n = 1;
+	sv.base = 1000;
+	sv.max = 60000;
+	sv.loop_count = 5;
+	sv.loop_window = 60000;
+	for (; args[i] != NULL && args[i][0] == '-' && args[i + 1] != NULL; i += 2) {
+		a = b = NULL;
+		if (strcmp(args[i], "-n") == 0) {
+			sv.n = atoi(args[i + 1]);
+		}
+		else if (strcmp(args[i], "--backoff") == 0) {
+			lsh_split_pair(args[i + 1], &a, &b);
+			sv.base = lsh_parse_duration(a);
+			sv.max = b ? lsh_parse_duration(b) : sv.max;
+		}
+		else if (strcmp(args[i], "--crash-loop") == 0) {
+			lsh_split_pair(args[i + 1], &a, &b);
+			sv.loop_count = atoi(a);
+			sv.loop_window = b ? lsh_parse_duration(b) : sv.loop_window;
+		}
+		else if (strcmp(args[i], "--log") == 0) {
+			sv.log.path = args[i + 1];
+			sv.logging = 1;
+		}
+		else if (strcmp(args[i], "--log-size") == 0) {
+			sv.log.cap = atol(args[i + 1]);
+		}
+		else {
+			break;
+		}
+	}
+	if (args[i] == NULL || sv.n < 1 || sv.base < 0 || sv.max < sv.base ||
+		sv.loop_count < 1 || sv.loop_window <= 0) {
+		fprintf(stderr, "lsh: usage: supervise [-n instances] [--backoff base,max] "
+			"[--crash-loop restarts,window] [--log file] [--log-size bytes] cmd...\n");
+		return 1;
+	}
+	if (sv.logging && lsh_logw_open(&sv.log) != 0) {
+		fprintf(stderr, "lsh: supervise: %s: %s\n", sv.log.path, strerror(errno));
+		return 1;
+	}
+
+	sv.argv = args + i;
+	sv.inst = calloc(sv.n, sizeof(struct lsh_svc_inst));
+	if (!sv.inst) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (k = 0; k < sv.n; k++) {
+		sv.inst[k].sv = &sv;
+		sv.inst[k].index = k + 1;
+		sv.inst[k].job = -1;
+		sv.inst[k].outfd = -1;
+		sv.inst[k].logfd = -1;
+		lsh_svc_start(-1, &sv.inst[k]);
+	}
+
+	while (!lsh_interrupted) {
+		lsh_event_wait(-1);
+	}
+
+	sv.stopping = 1;
+	for (k = 0; k < sv.n; k++) {
+		if (sv.inst[k].timer != NULL) {
+			lsh_timer_stop(sv.inst[k].timer);
+		}
+		if (sv.inst[k].job >= 0) {
+			kill(lsh_jobs[sv.inst[k].job].pid, SIGTERM);
+		}
+	}
+	while (sv.running > 0) {
+		lsh_event_wait(-1);
+	}
+	for (k = 0; k < sv.n; k++) {
+		// Drain what is left of their output.
+		if (sv.inst[k].logfd >= 0) {
+			close(sv.inst[k].logfd);
+		}
+		while (sv.inst[k].outfd >= 0) {
+			lsh_svc_output(sv.inst[k].outfd, &sv.inst[k]);
+		}
+	}
+	if (sv.logging) {
+		close(sv.log.fd);
+	}
+	free(sv.inst);
+	lsh_last_status = 130;
+	return 1;
+}
+
+/**
+@brief Check whether the seq builtin takes these arguments.  Options and
+decimals are left to the system's seq.
+@param args As for lsh_seq().
+@return Nonzero if they are [first [inc]] last, all integers.
+*/
+int lsh_seq_handles(char **args)
+{
+	long long v;
+	int i;
+
+	for (i = 1; args[i] != NULL; i++) {
+		if (i > 3 || lsh_parse_ll(args[i], &v) != 0) {
+			return 0;
+		}
+	}
+	return i > 1;
+}
+
+/**
+@brief Bultin command: print a sequence of integers.
+@param args List of args.  args[0] is "seq".  Then [first [inc]] last.
+@return Always returns 1, to continue executing.
+*/
+int lsh_seq(char **args)
+{
+	long long first = 1, inc = 1, last, i, gap;
+	char buf[24];
+	int argc = 0, n, err = 0;
+
+	while (args[argc + 1] != NULL) {
+		argc++;
+	}
+	if (argc < 1 || argc > 3) {
+		fprintf(stderr, "lsh: usage: seq [first [inc]] last\n");
+		return 1;
+	}
+	if (lsh_parse_ll(args[argc], &last) != 0 ||
+		(argc >= 2 && lsh_parse_ll(args[1], &first) != 0) ||
+		(argc == 3 && lsh_parse_ll(args[2], &inc) != 0)) {
+		fprintf(stderr, "lsh: seq: invalid integer argument\n");
+		return 1;
+	}
+	if (inc == 0) {
+		fprintf(stderr, "lsh: seq: increment must not be zero\n");
+		return 1;
+	}
+
+	if (inc == 1 && first >= 0) {
+		if (first <= last) {
+			err = lsh_seq_count_up(first, (unsigned long long)(last - first) + 1);
+		}
+	}
+	else {
+		for (i = first; inc > 0 ? i <= last : i >= last; i += inc) {
+			n = lsh_fmt_ll(i, buf);
+			buf[n++] = '\n';
+			if ((err = lsh_out_write(buf, n)) != 0) {
+				break;
+			}
+			// Stop before i + inc could overflow.  When last - i itself
+			// overflows, last is further away than any increment.
+			if (!__builtin_sub_overflow(last, i, &gap) && (inc > 0 ? gap < inc : gap > inc)) {
+				break;
+			}
+		}
+	}
+
+	if (err == 0) {
+		err = lsh_out_flush();
+	}
+	if (err != 0 && errno != EPIPE && errno != EINTR) {
+		perror("lsh: seq");
+	}
+	lsh_out_len = 0;
+	return 1;
+}
+
+/**
+@brief Bultin command: repeatedly print a line until output fails.
+@param args List of args.  args[0] is "yes".  The rest form the line, "y" if
+none are given.
+@return Always returns 1, to continue executing.
+*/
+int lsh_yes(char **args)
+{
+	char *block;
+	size_t len = 0, linelen, fill;
+	int i;
+
+	for (i = 1; args[i] != NULL; i++) {
+		len += strlen(args[i]) + 1;
+	}
+	if (len == 0) {
+		len = 2;
+	}
+	linelen = len;
+	// Repeat the line to fill a whole output buffer.
+	fill = linelen < LSH_OUT_BUFSIZE ? LSH_OUT_BUFSIZE / linelen * linelen : linelen;
+	block = malloc(fill);
+	if (!block) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (args[1] == NULL) {
+		memcpy(block, "y\n", 2);
+	}
+	else {
+		len = 0;
+		for (i = 1; args[i] != NULL; i++) {
+			memcpy(block + len, args[i], strlen(args[i]));
+			len += strlen(args[i]);
+			block[len++] = args[i + 1] != NULL ? ' ' : '\n';
+		}
+	}
+	for (len = linelen; len < fill; len += linelen) {
+		memcpy(block + len, block, linelen);
+	}
+
+	while (lsh_out_write(block, fill) == 0) {
+	}
+	if (errno != EPIPE && errno != EINTR) {
+		perror("lsh: yes");
+	}
+	lsh_out_len = 0;
+	free(block);
+	return 1;
+}
+
+/**
+@brief Open a builtin's input file as a reader.
+@param name The file, or "-" for standard input.
+@param file Reader to set up for a file.
+@return The reader (lsh_stdin for "-"), or NULL with errno set.
+*/
+struct lsh_reader *lsh_reader_open(const char *name, struct lsh_reader *file)
+{
+	if (strcmp(name, "-") == 0) {
+		return &lsh_stdin;
+	}
+	memset(file, 0, sizeof(*file));
+	if ((file->fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+		return NULL;
+	}
+	return file;
+}
+
+/**
+@brief Release a reader from lsh_reader_open().
+@param r The reader.
+*/
+void lsh_reader_close(struct lsh_reader *r)
+{
+	if (r != &lsh_stdin) {
+		close(r->fd);
+		free(r->buf);
+	}
+}
+
+/**
+@brief Copy everything left in a reader to the output.
+@param r The reader.
+@return 0 on success, -1 on error (errno is set).
+*/
+int lsh_reader_copy(struct lsh_reader *r)
+{
+	ssize_t n;
+
+	do {
+		if (r->pos < r->len && lsh_out_write(r->buf + r->pos, r->len - r->pos) != 0) {
+			return -1;
+		}
+		r->pos = r->len;
+	} while ((n = lsh_reader_fill(r)) > 0);
+	return n < 0 ? -1 : 0;
+}
+
+
+/**
+@brief Read from a reader until a buffer is full or the input ends, without
+going through the reader's own buffer.
+@param r The reader.
+@param buf Destination.
+@param len Bytes wanted.
+@return Bytes read (less than len only at end of input), or -1 on error.
+*/
+ssize_t lsh_reader_read(struct lsh_reader *r, void *buf, size_t len)
+{
+	size_t got = 0;
+	ssize_t n;
+
+	if (r->pos < r->len) {
+		got = r->len - r->pos < len ? r->len - r->pos : len;
+		memcpy(buf, r->buf + r->pos, got);
+		r->pos += got;
+	}
+	while (got < len) {
+		if (r->ring != NULL) {
+			n = lsh_ring_read(r->ring, (char *)buf + got, len - got);
+		}
+		else {
+			n = lsh_read_input(r->fd, (char *)buf + got, len - got);
+		}
+		if (n < 0) {
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		got += n;
+	}
+	return got;
+}
+
+/**
+@brief Check that no argument from one on looks like an option.  The cat
+builtin has none, and grep and wc take theirs before the files.
+@param args Null terminated list of arguments.
+@param first Index of the first one to check.
+@return Nonzero if each is a file name or "-".
+*/
+int lsh_only_files(char **args, int first)
+{
+	int i;
+
+	for (i = first; args[i] != NULL; i++) {
+		if (args[i][0] == '-' && args[i][1] != '\0') {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+@brief Check whether the grep builtin implements these arguments: options
+out of -vcinFE before the pattern, and only files after it.
+@param args As for lsh_grep().
+@return Nonzero if it does.
+*/
+int lsh_grep_handles(char **args)
+{
+	int i;
+
+	for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		if (args[i][strspn(args[i] + 1, "vcinFE") + 1] != '\0') {
+			return 0;
+		}
+	}
+	return args[i] != NULL && lsh_only_files(args, i + 1);
+}
+
+/**
+@brief Check whether the wc builtin implements these arguments: options out
+of -lwc, then only files.
+@param args As for lsh_wc().
+@return Nonzero if it does.
+*/
+int lsh_wc_handles(char **args)
+{
+	int i;
+
+	for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+		if (args[i][strspn(args[i] + 1, "lwc") + 1] != '\0') {
+			return 0;
+		}
+	}
+	return lsh_only_files(args, i);
+}
+
+/**
+@brief Bultin command: concatenate files to the output.
+@param args List of args.  args[0] is "cat".  Then files, "-" or none for
+standard input.
+@return Always returns 1, to continue executing.
+*/
+int lsh_cat(char **args)
+{
+	struct lsh_reader file, *r;
+	char *dash[] = { "-", NULL };
+	char **names = args[1] != NULL ? args + 1 : dash;
+	int i, err = 0;
+
+	for (i = 0; names[i] != NULL && err == 0; i++) {
+		if ((r = lsh_reader_open(names[i], &file)) == NULL) {
+			fprintf(stderr, "lsh: cat: %s: %s\n", names[i], strerror(errno));
+			lsh_last_status = 1;
+			continue;
+		}
+		err = lsh_reader_copy(r);
+		lsh_reader_close(r);
+	}
+	if (err == 0) {
+		err = lsh_out_flush();
+	}
+	if (err != 0) {
+		if (errno != EPIPE && errno != EINTR) {
+			perror("lsh: cat");
+		}
+		lsh_last_status = 1;
+	}
+	return 1;
+}
+
+/**
+@brief Bultin command: print lines that match a pattern.
+@param args List of args.  args[0] is "grep".  Then options (-v invert, -c
+count, -i ignore case, -n line numbers, -F fixed string, -E extended
+regex), the pattern and files ("-" or none for standard input).  As
+"grep-count", which the optimizer puts in place of "grep ... | wc -l", it
+prints one count for all files and always succeeds.
+@return Always returns 1, to continue executing.
+*/
+int lsh_grep(char **args)
+{
+	struct lsh_reader file, *r;
+	char *dash[] = { "-", NULL };
+	char **names, *pattern, *line, num[24];
+	int invert = 0, count = 0, icase = 0, number = 0, fixed = 0, cflags = REG_NOSUB;
+	int i, j, n, multi, matched, found = 0, failed = 0, err = 0;
+	int total = strcmp(args[0], "grep-count") == 0;
+	long long lineno, hits, sum = 0;
+	regex_t re;
+	size_t len;
+
+	for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		for (j = 1; args[i][j] != '\0'; j++) {
+			switch (args[i][j]) {
+			case 'v': invert = 1; break;
+			case 'c': count = 1; break;
+			case 'i': icase = 1; cflags |= REG_ICASE; break;
+			case 'n': number = 1; break;
+			case 'F': fixed = 1; break;
+			case 'E': cflags |= REG_EXTENDED; break;
+			default:
+				fprintf(stderr, "lsh: grep: unknown option -%c\n", args[i][j]);
+				lsh_last_status = 2;
+				return 1;
+			}
+		}
+	}
+	if (args[i] == NULL) {
+		fprintf(stderr, "lsh: usage: grep [-vcinFE] pattern [file...]\n");
+		lsh_last_status = 2;
+		return 1;
+	}
+	pattern = args[i++];
+	names = args[i] != NULL ? args + i : dash;
+	multi = names[1] != NULL && !total;
+	count |= total;
+	// A pattern without special characters matches itself; a substring
+	// search is much faster than the regex engine.
+	if (strpbrk(pattern, (cflags & REG_EXTENDED) ? ".[]*^$\\+?(){}|" : ".[]*^$\\") == NULL) {
+		fixed = 1;
+	}
+	if (!fixed && regcomp(&re, pattern, cflags) != 0) {
+		fprintf(stderr, "lsh: grep: invalid pattern \"%s\"\n", pattern);
+		lsh_last_status = 2;
+		return 1;
+	}
+
+	for (i = 0; names[i] != NULL && err == 0; i++) {
+		if ((r = lsh_reader_open(names[i], &file)) == NULL) {
+			fprintf(stderr, "lsh: grep: %s: %s\n", names[i], strerror(errno));
+			failed = 1;
+			continue;
+		}
+		lineno = hits = 0;
+		while (err == 0 && (line = lsh_reader_next(r, '\n', &len)) != NULL) {
+			lineno++;
+			if (fixed) {
+				matched = (icase ? strcasestr(line, pattern) : strstr(line, pattern)) != NULL;
+			}
+			else {
+				matched = regexec(&re, line, 0, NULL, 0) == 0;
+			}
+			if (matched == invert) {
+				continue;
+			}
+			hits++;
+			if (count) {
+				continue;
+			}
+			if (multi) {
+				err = lsh_out_write(names[i], strlen(names[i])) || lsh_out_write(":", 1);
+			}
+			if (number && err == 0) {
+				n = lsh_fmt_ll(lineno, num);
+				num[n++] = ':';
+				err = lsh_out_write(num, n);
+			}
+			if (err == 0) {
+				err = lsh_out_write(line, len) || lsh_out_write("\n", 1);
+			}
+		}
+		sum += hits;
+		if (count && !total && err == 0) {
+			if (multi) {
+				err = lsh_out_write(names[i], strlen(names[i])) || lsh_out_write(":", 1);
+			}
+			n = lsh_fmt_ll(hits, num);
+			num[n++] = '\n';
+			err = err || lsh_out_write(num, n);
+		}
+		found |= hits > 0;
+		lsh_reader_close(r);
+	}
+	if (total && err == 0) {
+		n = lsh_fmt_ll(sum, num);
+		num[n++] = '\n';
+		err = lsh_out_write(num, n);
+	}
+
+	if (err == 0) {
+		err = lsh_out_flush();
+	}
+	if (err != 0 && errno != EPIPE && errno != EINTR) {
+		perror("lsh: grep");
+	}
+	if (!fixed) {
+		regfree(&re);
+	}
+	lsh_last_status = total ? 0 : failed || err ? 2 : found ? 0 : 1;
+	return 1;
+}
+
+/**
+@brief Count the lines, words and bytes left in a reader.
+@param r The reader.
+@param counts Filled with the three counts.
+@param want Which counts are needed; words are the slowest.
+@return 0 on success, -1 on read error.
+*/
+int lsh_wc_count(struct lsh_reader *r, long long *counts, const int *want)
+{
+	const char *p, *end;
+	int inword = 0, space;
+	ssize_t n;
+
+	counts[0] = counts[1] = counts[2] = 0;
+	do {
+		p = r->buf + r->pos;
+		end = r->buf + r->len;
+		counts[2] += end - p;
+		if (want[1]) {
+			for (; p < end; p++) {
+				space = *p == ' ' || (*p >= '\t' && *p <= '\r');
+				counts[0] += *p == '\n';
+				counts[1] += !space && !inword;
+				inword = !space;
+			}
+		}
+		else if (want[0]) {
+			while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+				counts[0]++;
+				p++;
+			}
+		}
+		r->pos = r->len;
+	} while ((n = lsh_reader_fill(r)) > 0);
+	return n < 0 ? -1 : 0;
+}
+
+/**
+@brief Print one line of wc output.
+@param counts Lines, words and bytes.
+@param want Which of them to print.
+@param name File name, or NULL.
+@return 0 on success, -1 on error (errno is set).
+*/
+int lsh_wc_print(const long long *counts, const int *want, const char *name)
+{
+	char buf[80];
+	int i, n = 0;
+
+	for (i = 0; i < 3; i++) {
+		if (want[i]) {
+			if (n > 0) {
+				buf[n++] = ' ';
+			}
+			n += lsh_fmt_ll(counts[i], buf + n);
+		}
+	}
+	if (name != NULL) {
+		buf[n++] = ' ';
+		if (lsh_out_write(buf, n) != 0 || lsh_out_write(name, strlen(name)) != 0) {
+			return -1;
+		}
+		n = 0;
+	}
+	buf[n++] = '\n';
+	return lsh_out_write(buf, n);
+}
+
+/**
+@brief Bultin command: count lines, words and bytes.
+@param args List of args.  args[0] is "wc".  Then -l, -w, -c (all three if
+none are given) and files ("-" or none for standard input).
+@return Always returns 1, to continue executing.
+*/
+int lsh_wc(char **args)
+{
+	struct lsh_reader file, *r;
+	char *dash[] = { "-", NULL };
+	char **names;
+	long long counts[3], total[3] = { 0, 0, 0 };
+	int want[3] = { 0, 0, 0 };
+	int i, j, nfiles = 0, err = 0;
+
+	for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+		for (j = 1; args[i][j] != '\0'; j++) {
+			switch (args[i][j]) {
+			case 'l': want[0] = 1; break;
+			case 'w': want[1] = 1; break;
+			case 'c': want[2] = 1; break;
+			default:
+				fprintf(stderr, "lsh: wc: unknown option -%c\n", args[i][j]);
+				lsh_last_status = 1;
+				return 1;
+			}
+		}
+	}
+	if (!want[0] && !want[1] && !want[2]) {
+		want[0] = want[1] = want[2] = 1;
+	}
+	names = args[i] != NULL ? args + i : dash;
+
+	for (i = 0; names[i] != NULL && err == 0; i++) {
+		if ((r = lsh_reader_open(names[i], &file)) == NULL || lsh_wc_count(r, counts, want) != 0) {
+			fprintf(stderr, "lsh: wc: %s: %s\n", names[i], strerror(errno));
+			lsh_last_status = 1;
+			if (r != NULL) {
+				lsh_reader_close(r);
+			}
+			continue;
+		}
+		lsh_reader_close(r);
+		for (j = 0; j < 3; j++) {
+			total[j] += counts[j];
+		}
+		nfiles++;
+		err = lsh_wc_print(counts, want, names == dash ? NULL : names[i]);
+	}
+	if (err == 0 && nfiles > 1) {
+		err = lsh_wc_print(total, want, "total");
+	}
+	if (err == 0) {
+		err = lsh_out_flush();
+	}
+	if (err != 0 && errno != EPIPE && errno != EINTR) {
+		perror("lsh: wc");
+	}
+	return 1;
+}
+
+/**
+@brief Bultin command: read a line of standard input into variables.
+@param args List of args.  args[0] is "read".  Then variable names
+("REPLY" if none); words go to them in order, and the last one gets the
+rest of the line.
+@return Always returns 1, to continue executing.
+*/
+int lsh_read(char **args)
+{
+	char *reply[] = { "read", "REPLY", NULL };
+	char empty[1] = "", *line, *word, *end;
+	size_t len;
+	int i;
+
+	if (args[1] == NULL) {
+		args = reply;
+	}
+	line = lsh_reader_next(&lsh_stdin, '\n', &len);
+	if (line == NULL) {
+		// Variables are still set (to empty), but the status says EOF.
+		line = empty;
+		lsh_last_status = 1;
+	}
+	for (i = 1; args[i] != NULL; i++) {
+		line += strspn(line, " \t");
+		word = line;
+		if (args[i + 1] == NULL) {
+			end = line + strlen(line);
+			while (end > line && (end[-1] == ' ' || end[-1] == '\t')) {
+				*--end = '\0';
+			}
+		}
+		else {
+			line += strcspn(line, " \t");
+			if (*line != '\0') {
+				*line++ = '\0';
+			}
+		}
+		lsh_scope_save_var(args[i]);
+		if (setenv(args[i], word, 1) != 0) {
+			fprintf(stderr, "lsh: read: %s: %s\n", args[i], strerror(errno));
+			lsh_last_status = 1;
+		}
+		else if (strcmp(args[i], "PATH") == 0) {
+			lsh_path_forget();
+		}
+	}
+	return 1;
+}
+
+/*
+tee.  When standard input is a pipe, data is not copied through the
+shell: each round, tee(2) duplicates what is in the input pipe to every
+destination but the last (through a private pipe for destinations that
+are not pipes), and splice(2) moves it to the last one, consuming it.  A
+destination that takes less than the others, or cannot be spliced to,
+gets the rest of the round from one read() of the input.
+*/
+#define LSH_TEE_ROUND (1 << 20)
+
+struct lsh_tee_dest {
+	int fd;
+	int pipe;
+	const char *name;
+	size_t done;
+};
+
+/**
+@brief Write a whole buffer to an fd.
+@return 0 on success, -1 on error (errno is set).
+*/
+int lsh_tee_write(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+@brief Stop writing to a destination that failed.  Standard output failing
+ends tee, as it would kill coreutils tee with SIGPIPE.
+@param d The destination.
+@param err The errno.
+@return 1 if tee should stop, 0 to go on with the others.
+*/
+int lsh_tee_drop(struct lsh_tee_dest *d, int err)
+{
+	if (d->name == NULL) {
+		if (err != EPIPE) {
+			fprintf(stderr, "lsh: tee: %s\n", strerror(err));
+		}
+		d->fd = -1;
+		return 1;
+	}
+	fprintf(stderr, "lsh: tee: %s: %s\n", d->name, strerror(err));
+	close(d->fd);
+	d->fd = -1;
+	lsh_last_status = 1;
+	return 0;
+}
+
+/**
+@brief Duplicate what is at the front of the input pipe to a destination,
+without consuming it.
+@param in The input pipe.
+@param d The destination.
+@param len At most this much.
+@param scratch A private pipe, for destinations that are not pipes.
+@return Bytes duplicated, 0 at end of input, or -1 on error.
+*/
+ssize_t lsh_tee_dup(int in, struct lsh_tee_dest *d, size_t len, int *scratch)
+{
+	ssize_t n, m;
+	size_t left;
+	char sink[4096];
+	int err;
+
+	if (d->pipe) {
+		do {
+			n = tee(in, d->fd, len, 0);
+		} while (n < 0 && errno == EINTR);
+		return n;
+	}
+	do {
+		n = tee(in, scratch[1], len, 0);
+	} while (n < 0 && errno == EINTR);
+	for (left = n > 0 ? n : 0; left > 0; left -= m) {
+		m = splice(scratch[0], NULL, d->fd, NULL, left, SPLICE_F_MOVE);
+		if (m <= 0 && errno != EINTR) {
+			// Leave the private pipe empty for the next destination.
+			err = m < 0 ? errno : EIO;
+			n = -1;
+			while (left > 0 && (m = read(scratch[0], sink, left < sizeof(sink) ? left : sizeof(sink))) > 0) {
+				left -= m;
+			}
+			errno = err;
+			return n;
+		}
+		m = m < 0 ? 0 : m;
+	}
+	return n;
+}
+
+/**
+@brief Copy a pipe to the destinations with tee(2) and splice(2).
+@param in The input pipe.
+@param d The destinations.
+@param count Number of destinations.
+@return 0 at end of input or when tee should stop, 1 if the rest has to
+be copied by lsh_tee_copy(), -1 if interrupted.
+*/
+int lsh_tee_splice(int in, struct lsh_tee_dest *d, int count)
+{
+	struct lsh_tee_dest *first, *last;
+	int scratch[2] = { -1, -1 }, i, active, fallback = 0, ret = 0, ok;
+	char *buf = NULL;
+	ssize_t n, m;
+	size_t consumed;
+
+	for (i = 0; i < count; i++) {
+		if (d[i].fd >= 0 && !d[i].pipe && scratch[0] < 0) {
+			if (pipe2(scratch, O_CLOEXEC) != 0) {
+				return 1;
+			}
+			fcntl(scratch[1], F_SETPIPE_SZ, LSH_TEE_ROUND);
+		}
+	}
+	while (!fallback) {
+		if (lsh_check_interrupt()) {
+			ret = -1;
+			break;
+		}
+		first = last = NULL;
+		for (active = 0, i = 0; i < count; i++) {
+			if (d[i].fd >= 0) {
+				first = first ? first : &d[i];
+				last = &d[i];
+				active++;
+			}
+			d[i].done = 0;
+		}
+		if (active == 0) {
+			break;
+		}
+
+		// The first destination decides how much this round moves.
+		if (active == 1) {
+			n = LSH_TEE_ROUND;
+		}
+		else if ((n = lsh_tee_dup(in, first, LSH_TEE_ROUND, scratch)) < 0) {
+			if (errno == EINVAL) {
+				ret = 1;
+				break;
+			}
+			if (lsh_tee_drop(first, errno)) {
+				break;
+			}
+			continue;
+		}
+		else if (n == 0) {
+			break;
+		}
+		first->done = n;
+		ok = 1;
+		for (i = first - d + 1; active > 1 && i < last - d; i++) {
+			if (d[i].fd < 0) {
+				continue;
+			}
+			m = lsh_tee_dup(in, &d[i], n, scratch);
+			if (m < 0 && errno == EINVAL) {
+				fallback = 1;
+			}
+			else if (m < 0 && lsh_tee_drop(&d[i], errno)) {
+				ret = 0;
+				goto out;
+			}
+			d[i].done = m > 0 ? m : 0;
+			ok = ok && (d[i].fd < 0 || d[i].done == (size_t)n);
+		}
+
+		// The last one consumes the round, unless someone fell short.
+		consumed = 0;
+		while (ok && consumed < (size_t)n) {
+			m = splice(in, NULL, last->fd, NULL, n - consumed, SPLICE_F_MOVE);
+			if (m == 0 && active == 1) {
+				goto out;
+			}
+			if (m > 0) {
+				consumed += m;
+				if (active == 1) {
+					n = consumed;
+				}
+			}
+			else if (m < 0 && errno == EINTR) {
+				continue;
+			}
+			else if (m < 0 && errno == EINVAL && consumed == 0) {
+				fallback = 1;
+				break;
+			}
+			else if (lsh_tee_drop(last, m < 0 ? errno : EIO)) {
+				goto out;
+			}
+			else {
+				break;
+			}
+		}
+		last->done = consumed;
+		if (consumed == (size_t)n) {
+			continue;
+		}
+
+		// Read the rest of the round and write what each one is missing.
+		if (buf == NULL && !(buf = malloc(LSH_TEE_ROUND))) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		while (consumed < (size_t)n) {
+			m = read(in, buf + consumed, n - consumed);
+			if (m <= 0) {
+				if (m < 0 && errno == EINTR) {
+					continue;
+				}
+				n = consumed;
+				break;
+			}
+			consumed += m;
+		}
+		for (i = 0; i < count; i++) {
+			if (d[i].fd >= 0 && d[i].done < (size_t)n &&
+				lsh_tee_write(d[i].fd, buf + d[i].done, n - d[i].done) != 0 && lsh_tee_drop(&d[i], errno)) {
+				goto out;
+			}
+		}
+	}
+	ret = fallback ? 1 : ret;
+out:
+	if (scratch[0] >= 0) {
+		close(scratch[0]);
+		close(scratch[1]);
+	}
+	free(buf);
+	return ret;
+}
+
+/**
+@brief Copy standard input to the destinations through the shell.
+@param d The destinations; the first is standard output.
+@param count Number of destinations.
+@return 0 on success, -1 if interrupted or standard output failed.
+*/
+int lsh_tee_copy(struct lsh_tee_dest *d, int count)
+{
+	struct lsh_reader *r = &lsh_stdin;
+	size_t len;
+	int i;
+
+	while (r->pos < r->len || lsh_reader_fill(r) > 0) {
+		len = r->len - r->pos;
+		if (d[0].fd != -1 && lsh_out_write(r->buf + r->pos, len) != 0) {
+			lsh_tee_drop(&d[0], errno);
+			return -1;
+		}
+		for (i = 1; i < count; i++) {
+			if (d[i].fd >= 0 && lsh_tee_write(d[i].fd, r->buf + r->pos, len) != 0) {
+				lsh_tee_drop(&d[i], errno);
+			}
+		}
+		r->pos = r->len;
+	}
+	return lsh_out_flush();
+}
+
+/**
+@brief Bultin command: copy standard input to standard output and files.
+@param args List of args.  args[0] is "tee".  Then -a to append, and the
+files.
+@return Always returns 1, to continue executing.
+*/
+int lsh_tee(char **args)
+{
+	struct lsh_tee_dest *d;
+	struct stat st;
+	int i = 1, count = 1, flags = O_TRUNC, status, fast;
+
+	if (args[i] != NULL && strcmp(args[i], "-a") == 0) {
+		flags = O_APPEND;
+		i++;
+	}
+	while (args[i + count - 1] != NULL) {
+		count++;
+	}
+	d = calloc(count, sizeof(struct lsh_tee_dest));
+	if (!d) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	status = 0;
+	count = 1;
+	// -2: standard output is a ring, only lsh_out_write() reaches it.
+	d[0].fd = lsh_out_ring == NULL ? lsh_out_fd : -2;
+	d[0].pipe = d[0].fd >= 0 && fstat(d[0].fd, &st) == 0 && S_ISFIFO(st.st_mode);
+	for (; args[i] != NULL; i++) {
+		if ((d[count].fd = open(args[i], O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0666)) < 0) {
+			fprintf(stderr, "lsh: tee: %s: %s\n", args[i], strerror(errno));
+			status = 1;
+			continue;
+		}
+		d[count].name = args[i];
+		d[count].pipe = fstat(d[count].fd, &st) == 0 && S_ISFIFO(st.st_mode);
+		count++;
+	}
+
+	fast = lsh_stdin.ring == NULL && lsh_stdin.pos == lsh_stdin.len && d[0].fd >= 0 &&
+		fstat(lsh_stdin.fd, &st) == 0 && S_ISFIFO(st.st_mode) && lsh_out_flush() == 0;
+	lsh_last_status = status;
+	if (!fast || (status = lsh_tee_splice(lsh_stdin.fd, d, count)) == 1) {
+		status = lsh_tee_copy(d, count);
+	}
+	for (i = 1; i < count; i++) {
+		if (d[i].fd >= 0) {
+			close(d[i].fd);
+		}
+	}
+	if (status != 0 || d[0].fd == -1) {
+		lsh_last_status = 1;
+	}
+	free(d);
+	return 1;
+}
+
+/*
+Structured records.  "ls" can produce a table of file records instead of
+text, and record operators (where, sort-by, select, group-by, sum) work on
+it a column at a time.  A run of them in a pipeline, such as
+"ls | where size -gt 1M | sort-by size", is one stage that hands the table
+from operator to operator in memory; it becomes text only at the end of
+the run.  With "set -o structured", a bare "ls" prints its table too.
+*/
+#define LSH_COL_STR 0
+#define LSH_COL_INT 1
+#define LSH_COL_TIME 2
+#define LSH_COL_MODE 3
+
+#define LSH_TABLE_MAXCOLS 8
+#define LSH_TABLE_CHUNK 65536
+
+struct lsh_column {
+	char name[16];
+	int type;
+	long long *ints;
+	char **strs;
+};
+
+struct lsh_chunk {
+	struct lsh_chunk *next;
+	size_t used;
+	size_t cap;	// Bigger than LSH_TABLE_CHUNK for a long string.
+	char data[LSH_TABLE_CHUNK];
+};
+
+struct lsh_table {
+	int ncols;
+	size_t nrows;
+	size_t cap;
+	struct lsh_column cols[LSH_TABLE_MAXCOLS];
+	struct lsh_chunk *strings;
+};
+
+/**
+@brief Add a column to an empty table.
+@param t The table.
+@param name Column name.
+@param type One of the LSH_COL_ types.
+@return The column.
+*/
+struct lsh_column *lsh_table_column(struct lsh_table *t, const char *name, int type)
+{
+	struct lsh_column *c = &t->cols[t->ncols++];
+
+	snprintf(c->name, sizeof(c->name), "%s", name);
+	c->type = type;
+	c->ints = NULL;
+	c->strs = NULL;
+	return c;
+}
+
+/**
+@brief Make room for one more row.
+@param t The table.
+*/
+void lsh_table_grow(struct lsh_table *t)
+{
+	struct lsh_column *c;
+	int i;
+
+	if (t->nrows < t->cap) {
+		return;
+	}
+	t->cap = t->cap ? t->cap * 2 : 256;
+	for (i = 0; i < t->ncols; i++) {
+		c = &t->cols[i];
+		if (c->type == LSH_COL_STR) {
+			c->strs = realloc(c->strs, t->cap * sizeof(char *));
+		}
+		else {
+			c->ints = realloc(c->ints, t->cap * sizeof(long long));
+		}
+		if ((c->type == LSH_COL_STR ? (void *)c->strs : (void *)c->ints) == NULL) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/**
+@brief Copy a string into a table's own storage.
+@param t The table.
+@param s The string.
+@return The copy, valid until the table is freed.
+*/
+char *lsh_table_strdup(struct lsh_table *t, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	struct lsh_chunk *ch = t->strings;
+	char *copy;
+
+	if (ch == NULL || ch->cap - ch->used < len) {
+		ch = malloc(sizeof(struct lsh_chunk) + (len > LSH_TABLE_CHUNK ? len - LSH_TABLE_CHUNK : 0));
+		if (!ch) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		ch->used = 0;
+		ch->cap = len > LSH_TABLE_CHUNK ? len : LSH_TABLE_CHUNK;
+		ch->next = t->strings;
+		t->strings = ch;
+	}
+	copy = ch->data + ch->used;
+	memcpy(copy, s, len);
+	ch->used += len;
+	return copy;
+}
+
+/**
+@brief Free a table's columns and strings.
+@param t The table.
+*/
+void lsh_table_free(struct lsh_table *t)
+{
+	struct lsh_chunk *ch, *next;
+	int i;
+
+	for (i = 0; i < t->ncols; i++) {
+		free(t->cols[i].ints);
+		free(t->cols[i].strs);
+	}
+	for (ch = t->strings; ch != NULL; ch = next) {
+		next = ch->next;
+		free(ch);
+	}
+	memset(t, 0, sizeof(*t));
+}
+
+/**
+@brief Find a column by name, reporting a missing one.
+@param t The table.
+@param op The operator asking, for the message.
+@param name The column.
+@return The column's index, or -1.
+*/
+int lsh_table_find(struct lsh_table *t, const char *op, const char *name)
+{
+	int i;
+
+	for (i = 0; name != NULL && i < t->ncols; i++) {
+		if (strcmp(t->cols[i].name, name) == 0) {
+			return i;
+		}
+	}
+	fprintf(stderr, "lsh: %s: no column \"%s\"\n", op, name ? name : "");
+	return -1;
+}
+
+/**
+@brief Keep only the given rows, in the given order.
+@param t The table.
+@param idx Row numbers.
+@param n How many.
+*/
+void lsh_table_take(struct lsh_table *t, const size_t *idx, size_t n)
+{
+	struct lsh_column *c;
+	long long *ints;
+	char **strs;
+	size_t i;
+	int j;
+
+	for (j = 0; j < t->ncols; j++) {
+		c = &t->cols[j];
+		if (c->type == LSH_COL_STR) {
+			strs = malloc((n ? n : 1) * sizeof(char *));
+			if (!strs) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+			for (i = 0; i < n; i++) {
+				strs[i] = c->strs[idx[i]];
+			}
+			free(c->strs);
+			c->strs = strs;
+		}
+		else {
+			ints = malloc((n ? n : 1) * sizeof(long long));
+			if (!ints) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+			for (i = 0; i < n; i++) {
+				ints[i] = c->ints[idx[i]];
+			}
+			free(c->ints);
+			c->ints = ints;
+		}
+	}
+	t->nrows = t->cap = n;
+}
+
+/**
+@brief Producer: one record per directory entry.
+@param t The (empty) table to fill.
+@param args The ls command; args[1] may name the directory.
+@return 0 on success, -1 on error.
+*/
+int lsh_records_ls(struct lsh_table *t, char **args)
+{
+	const char *dir = args[1] != NULL ? args[1] : ".";
+	struct dirent *ep;
+	struct stat sb;
+	DIR *dp;
+
+	if ((dp = opendir(dir)) == NULL) {
+		fprintf(stderr, "lsh: ls: %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	lsh_table_column(t, "name", LSH_COL_STR);
+	lsh_table_column(t, "type", LSH_COL_STR);
+	lsh_table_column(t, "size", LSH_COL_INT);
+	lsh_table_column(t, "mtime", LSH_COL_TIME);
+	lsh_table_column(t, "mode", LSH_COL_MODE);
+	while ((ep = readdir(dp)) != NULL) {
+		if (fstatat(dirfd(dp), ep->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+			continue;
+		}
+		lsh_table_grow(t);
+		t->cols[0].strs[t->nrows] = lsh_table_strdup(t, ep->d_name);
+		t->cols[1].strs[t->nrows] = S_ISDIR(sb.st_mode) ? "dir" : S_ISREG(sb.st_mode) ? "file" :
+			S_ISLNK(sb.st_mode) ? "link" : "other";
+		t->cols[2].ints[t->nrows] = sb.st_size;
+		t->cols[3].ints[t->nrows] = sb.st_mtime;
+		t->cols[4].ints[t->nrows] = sb.st_mode;
+		t->nrows++;
+	}
+	closedir(dp);
+	return 0;
+}
+
+/**
+@brief Parse a value to compare an integer-like column with.  Sizes take
+K/M/G/T suffixes, times are durations back from now ("1d"), or "@seconds"
+since the epoch, and modes are octal permission bits.
+@param c The column.
+@param str The value.
+@param out Where to store it.
+@return 0 on success, -1 if invalid.
+*/
+int lsh_record_value(struct lsh_column *c, const char *str, long long *out)
+{
+	char *end;
+	long ms;
+
+	switch (c->type) {
+	case LSH_COL_TIME:
+		if (str[0] == '@') {
+			return lsh_parse_ll(str + 1, out);
+		}
+		if ((ms = lsh_parse_duration(str)) < 0) {
+			return -1;
+		}
+		*out = time(NULL) - ms / 1000;
+		return 0;
+	case LSH_COL_MODE:
+		*out = strtoll(str, &end, 8);
+		return *str == '\0' || *end != '\0' ? -1 : 0;
+	default:
+		return (*out = lsh_parse_size(str)) < 0 && lsh_parse_ll(str, out) != 0 ? -1 : 0;
+	}
+}
+
+/*
+Comparison loops for where.  Each writes every row number and advances
+only past the ones that match, so there is no branch per row.
+*/
+#define LSH_WHERE_LOOP(cond) \
+	for (i = 0; i < t->nrows; i++) { \
+		idx[k] = i; \
+		k += (cond); \
+	}
+
+/**
+@brief Operator: keep the rows where a column compares true with a value.
+@param t The table.
+@param args "where" column op value, op being = != -lt -le -gt -ge, or
+~ and !~ for glob matches.
+@return 0 on success, -1 on error.
+*/
+int lsh_op_where(struct lsh_table *t, char **args)
+{
+	static char *ops[] = { "=", "!=", "-lt", "-le", "-gt", "-ge", "~", "!~", NULL };
+	struct lsh_column *c;
+	long long v = 0, *col;
+	size_t i, k = 0, *idx;
+	int op, j, mask;
+
+	if (args[1] == NULL || args[2] == NULL || args[3] == NULL || args[4] != NULL) {
+		fprintf(stderr, "lsh: usage: where column op value\n");
+		return -1;
+	}
+	if ((j = lsh_table_find(t, "where", args[1])) < 0) {
+		return -1;
+	}
+	c = &t->cols[j];
+	for (op = 0; ops[op] != NULL && strcmp(ops[op], args[2]) != 0; op++) {
+	}
+	if (ops[op] == NULL || (c->type != LSH_COL_STR && op >= 6) ||
+		(c->type != LSH_COL_STR && lsh_record_value(c, args[3], &v) != 0)) {
+		fprintf(stderr, "lsh: where: cannot compare %s %s %s\n", args[1], args[2], args[3]);
+		return -1;
+	}
+	idx = malloc((t->nrows ? t->nrows : 1) * sizeof(size_t));
+	if (!idx) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (c->type == LSH_COL_STR) {
+		for (i = 0; i < t->nrows; i++) {
+			idx[k] = i;
+			j = op >= 6 ? fnmatch(args[3], c->strs[i], 0) : strcmp(c->strs[i], args[3]);
+			switch (op) {
+			case 0: case 6: k += j == 0; break;
+			case 1: case 7: k += j != 0; break;
+			case 2: k += j < 0; break;
+			case 3: k += j <= 0; break;
+			case 4: k += j > 0; break;
+			case 5: k += j >= 0; break;
+			}
+		}
+	}
+	else {
+		col = c->ints;
+		// Modes compare by permission bits.
+		mask = c->type == LSH_COL_MODE ? 07777 : -1;
+		switch (op) {
+		case 0: LSH_WHERE_LOOP((col[i] & mask) == v); break;
+		case 1: LSH_WHERE_LOOP((col[i] & mask) != v); break;
+		case 2: LSH_WHERE_LOOP((col[i] & mask) < v); break;
+		case 3: LSH_WHERE_LOOP((col[i] & mask) <= v); break;
+		case 4: LSH_WHERE_LOOP((col[i] & mask) > v); break;
+		case 5: LSH_WHERE_LOOP((col[i] & mask) >= v); break;
+		}
+	}
+	lsh_table_take(t, idx, k);
+	free(idx);
+	return 0;
+}
+
+struct lsh_sort_key {
+	long long num;
+	const char *str;
+	size_t row;
+};
+
+/**
+@brief qsort_r comparator for sort keys; ties keep their original order
+either way.
+@param dir Points to 1 for ascending order, -1 for descending.
+*/
+int lsh_sort_key_cmp(const void *a, const void *b, void *dir)
+{
+	const struct lsh_sort_key *x = a, *y = b;
+	int c;
+
+	if (x->str != NULL) {
+		c = strcmp(x->str, y->str);
+	}
+	else {
+		c = (x->num > y->num) - (x->num < y->num);
+	}
+	return c != 0 ? c * *(int *)dir : (x->row > y->row) - (x->row < y->row);
+}
+
+/**
+@brief Sort a table's rows by one column.
+@param t The table.
+@param col The column index.
+@param reverse Nonzero for descending order.
+*/
+void lsh_table_sort(struct lsh_table *t, int col, int reverse)
+{
+	struct lsh_column *c = &t->cols[col];
+	struct lsh_sort_key *keys;
+	size_t i, *idx;
+	int dir = reverse ? -1 : 1;
+
+	keys = malloc((t->nrows ? t->nrows : 1) * sizeof(struct lsh_sort_key));
+	idx = malloc((t->nrows ? t->nrows : 1) * sizeof(size_t));
+	if (!keys || !idx) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	// Keys are copied out next to their row number, so the comparator
+	// does not chase pointers into the column.
+	for (i = 0; i < t->nrows; i++) {
+		keys[i].num = c->type == LSH_COL_STR ? 0 : c->ints[i];
+		keys[i].str = c->type == LSH_COL_STR ? c->strs[i] : NULL;
+		keys[i].row = i;
+	}
+	qsort_r(keys, t->nrows, sizeof(struct lsh_sort_key), lsh_sort_key_cmp, &dir);
+	for (i = 0; i < t->nrows; i++) {
+		idx[i] = keys[i].row;
+	}
+	lsh_table_take(t, idx, t->nrows);
+	free(keys);
+	free(idx);
+}
+
+/**
+@brief Operator: sort rows by a column.
+@param t The table.
+@param args "sort-by" column, then -r for descending order.
+@return 0 on success, -1 on error.
+*/
+int lsh_op_sort_by(struct lsh_table *t, char **args)
+{
+	int col, reverse = 0;
+
+	if (args[1] == NULL || (args[2] != NULL && (strcmp(args[2], "-r") != 0 || args[3] != NULL))) {
+		fprintf(stderr, "lsh: usage: sort-by column [-r]\n");
+		return -1;
+	}
+	if ((col = lsh_table_find(t, "sort-by", args[1])) < 0) {
+		return -1;
+	}
+	reverse = args[2] != NULL;
+	lsh_table_sort(t, col, reverse);
+	return 0;
+}
+
+/**
+@brief Drop every column not listed, and put the rest in the listed order.
+@param t The table.
+@param keep Column indexes to keep.
+@param n How many.
+*/
+void lsh_table_keep(struct lsh_table *t, const int *keep, int n)
+{
+	struct lsh_column cols[LSH_TABLE_MAXCOLS];
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		cols[i] = t->cols[keep[i]];
+	}
+	for (j = 0; j < t->ncols; j++) {
+		for (i = 0; i < n && keep[i] != j; i++) {
+		}
+		if (i == n) {
+			free(t->cols[j].ints);
+			free(t->cols[j].strs);
+		}
+	}
+	memcpy(t->cols, cols, n * sizeof(struct lsh_column));
+	t->ncols = n;
+}
+
+/**
+@brief Operator: keep only some columns.
+@param t The table.
+@param args "select" then column names.
+@return 0 on success, -1 on error.
+*/
+int lsh_op_select(struct lsh_table *t, char **args)
+{
+	int keep[LSH_TABLE_MAXCOLS];
+	int i, j, n = 0;
+
+	for (i = 1; args[i] != NULL; i++) {
+		if ((keep[n] = lsh_table_find(t, "select", args[i])) < 0) {
+			return -1;
+		}
+		// A column listed twice is kept once.
+		for (j = 0; j < n && keep[j] != keep[n]; j++) {
+		}
+		n += j == n;
+	}
+	if (n == 0) {
+		fprintf(stderr, "lsh: usage: select column...\n");
+		return -1;
+	}
+	lsh_table_keep(t, keep, n);
+	return 0;
+}
+
+/**
+@brief Operator: one row per distinct value of a column, with the number of
+rows in the group and the sum of every size-like column.
+@param t The table.
+@param args "group-by" column.
+@return 0 on success, -1 on error.
+*/
+int lsh_op_group_by(struct lsh_table *t, char **args)
+{
+	int keep[LSH_TABLE_MAXCOLS];
+	struct lsh_column *key, *count;
+	size_t i, g = 0;
+	int col, j, n, same;
+
+	if (args[1] == NULL || args[2] != NULL) {
+		fprintf(stderr, "lsh: usage: group-by column\n");
+		return -1;
+	}
+	if ((col = lsh_table_find(t, "group-by", args[1])) < 0) {
+		return -1;
+	}
+	if (t->ncols == LSH_TABLE_MAXCOLS) {
+		fprintf(stderr, "lsh: group-by: too many columns\n");
+		return -1;
+	}
+	lsh_table_sort(t, col, 0);
+	key = &t->cols[col];
+	count = lsh_table_column(t, "count", LSH_COL_INT);
+	count->ints = calloc(t->cap ? t->cap : 1, sizeof(long long));
+	if (!count->ints) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Rows are sorted, so each group is a run; fold each run into its
+	// first slot, g.
+	for (i = 0; i < t->nrows; i++) {
+		if (i > 0) {
+			same = key->type == LSH_COL_STR ? strcmp(key->strs[i], key->strs[g]) == 0 :
+				key->ints[i] == key->ints[g];
+			if (!same) {
+				g++;
+				if (key->type == LSH_COL_STR) {
+					key->strs[g] = key->strs[i];
+				}
+				else {
+					key->ints[g] = key->ints[i];
+				}
+				for (j = 0; j < t->ncols - 1; j++) {
+					if (j != col && t->cols[j].type == LSH_COL_INT) {
+						t->cols[j].ints[g] = t->cols[j].ints[i];
+					}
+				}
+			}
+			else {
+				for (j = 0; j < t->ncols - 1; j++) {
+					if (j != col && t->cols[j].type == LSH_COL_INT) {
+						t->cols[j].ints[g] += t->cols[j].ints[i];
+					}
+				}
+			}
+		}
+		count->ints[g]++;
+	}
+	t->nrows = t->nrows ? g + 1 : 0;
+
+	n = 0;
+	keep[n++] = col;
+	keep[n++] = t->ncols - 1;
+	for (j = 0; j < t->ncols - 1; j++) {
+		if (j != col && t->cols[j].type == LSH_COL_INT) {
+			keep[n++] = j;
+		}
+	}
+	lsh_table_keep(t, keep, n);
+	return 0;
+}
+
+/**
+@brief Operator: total size-like columns into a single row, with a count.
+@param t The table.
+@param args "sum", then the columns (every integer column if none).
+@return 0 on success, -1 on error.
+*/
+int lsh_op_sum(struct lsh_table *t, char **args)
+{
+	int keep[LSH_TABLE_MAXCOLS];
+	long long total;
+	size_t i;
+	int col, j, k, n = 0;
+
+	// The count column needs a free slot; every kept column is distinct,
+	// so n stays below ncols and keep[n] has room for the count.
+	if (t->ncols == LSH_TABLE_MAXCOLS) {
+		fprintf(stderr, "lsh: sum: too many columns\n");
+		return -1;
+	}
+	for (j = 1; args[j] != NULL; j++) {
+		if ((col = lsh_table_find(t, "sum", args[j])) < 0) {
+			return -1;
+		}
+		if (t->cols[col].type == LSH_COL_STR) {
+			fprintf(stderr, "lsh: sum: \"%s\" is not a number\n", args[j]);
+			return -1;
+		}
+		// A column listed twice is summed once.
+		for (k = 0; k < n && keep[k] != col; k++) {
+		}
+		if (k == n && n < LSH_TABLE_MAXCOLS - 1) {
+			keep[n++] = col;
+		}
+	}
+	for (j = 0; args[1] == NULL && j < t->ncols; j++) {
+		if (t->cols[j].type == LSH_COL_INT && n < LSH_TABLE_MAXCOLS - 1) {
+			keep[n++] = j;
+		}
+	}
+	lsh_table_grow(t);
+	for (j = 0; j < n; j++) {
+		total = 0;
+		for (i = 0; i < t->nrows; i++) {
+			total += t->cols[keep[j]].ints[i];
+		}
+		t->cols[keep[j]].ints[0] = total;
+	}
+	keep[n] = t->ncols;
+	lsh_table_column(t, "count", LSH_COL_INT)->ints = malloc(sizeof(long long));
+	if (!t->cols[t->ncols - 1].ints) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	t->cols[t->ncols - 1].ints[0] = t->nrows;
+	t->nrows = t->cap = 1;
+	lsh_table_keep(t, keep, n + 1);
+	return 0;
+}
+
+/**
+@brief Format one cell.
+@param c The column.
+@param row The row.
+@param buf Scratch space of at least 32 bytes.
+@return The text, NUL terminated.
+*/
+const char *lsh_cell_text(struct lsh_column *c, size_t row, char *buf)
+{
+	static const char rwx[] = "rwxrwxrwx";
+	time_t when;
+	struct tm tm;
+	long long v;
+	int i;
+
+	if (c->type == LSH_COL_STR) {
+		return c->strs[row];
+	}
+	v = c->ints[row];
+	if (c->type == LSH_COL_TIME) {
+		when = v;
+		localtime_r(&when, &tm);
+		strftime(buf, 32, "%Y-%m-%d %H:%M", &tm);
+	}
+	else if (c->type == LSH_COL_MODE) {
+		buf[0] = S_ISDIR(v) ? 'd' : S_ISLNK(v) ? 'l' : S_ISREG(v) ? '-' : '?';
+		for (i = 0; i < 9; i++) {
+			buf[i + 1] = v & (0400 >> i) ? rwx[i] : '-';
+		}
+		buf[10] = '\0';
+	}
+	else {
+		buf[lsh_fmt_ll(v, buf)] = '\0';
+	}
+	return buf;
+}
+
+/**
+@brief Render a table as text: aligned columns under a header on a
+terminal, tab-separated rows for anything else.
+@param t The table.
+@return 0 on success, -1 on error (errno is set).
+*/
+int lsh_table_print(struct lsh_table *t)
+{
+	size_t width[LSH_TABLE_MAXCOLS], len, i;
+	const char *text;
+	char buf[32], pad[64];
+	int j, tty, err = 0;
+
+	tty = lsh_out_ring == NULL && isatty(lsh_out_fd);
+	memset(pad, ' ', sizeof(pad));
+	for (j = 0; j < t->ncols; j++) {
+		width[j] = strlen(t->cols[j].name);
+		for (i = 0; tty && i < t->nrows; i++) {
+			len = strlen(lsh_cell_text(&t->cols[j], i, buf));
+			width[j] = len > width[j] ? len : width[j];
+		}
+	}
+	for (i = 0; i <= t->nrows && err == 0; i++) {
+		if (i == 0 && !tty) {
+			continue;
+		}
+		for (j = 0; j < t->ncols && err == 0; j++) {
+			text = i == 0 ? t->cols[j].name : lsh_cell_text(&t->cols[j], i - 1, buf);
+			len = strlen(text);
+			if (tty && t->cols[j].type == LSH_COL_INT && i > 0) {
+				// Numbers line up on the right.
+				err = lsh_out_write(pad, width[j] - len < sizeof(pad) ? width[j] - len : sizeof(pad));
+			}
+			err = err || lsh_out_write(text, len);
+			if (j + 1 == t->ncols) {
+				err = err || lsh_out_write("\n", 1);
+			}
+			else if (!tty) {
+				err = err || lsh_out_write("\t", 1);
+			}
+			else if (t->cols[j].type != LSH_COL_INT || i == 0) {
+				err = err || lsh_out_write(pad, width[j] - len + 2 < sizeof(pad) ? width[j] - len + 2 : sizeof(pad));
+			}
+			else {
+				err = err || lsh_out_write("  ", 2);
+			}
+		}
+	}
+	return err ? -1 : lsh_out_flush();
+}
+
+struct lsh_record_op {
+	char *name;
+	int (*fn)(struct lsh_table *t, char **args);
+};
+
+struct lsh_record_op lsh_record_ops[] = {
+	{ "where", lsh_op_where },
+	{ "sort-by", lsh_op_sort_by },
+	{ "select", lsh_op_select },
+	{ "group-by", lsh_op_group_by },
+	{ "sum", lsh_op_sum },
+	{ NULL, NULL }
+};
+
+/**
+@brief Check whether a command produces or transforms records.
+@param args The command.
+@return 2 for an operator, 1 for a producer, 0 otherwise.
+*/
+int lsh_record_role(char **args)
+{
+	int i;
+
+	if (args == NULL || args[0] == NULL) {
+		return 0;
+	}
+	for (i = 0; lsh_record_ops[i].name != NULL; i++) {
+		if (strcmp(args[0], lsh_record_ops[i].name) == 0) {
+			return 2;
+		}
+	}
+	return strcmp(args[0], "ls") == 0;
+}
+
+/**
+@brief Run a producer and the record operators after it, then print the
+table.
+@param stages The commands, the producer first.
+@param count How many.
+*/
+void lsh_records_run(char ***stages, int count)
+{
+	struct lsh_table t;
+	int i, j, err = 0;
+
+	memset(&t, 0, sizeof(t));
+	if (lsh_record_role(stages[0]) != 1) {
+		fprintf(stderr, "lsh: %s: expects records, as in \"ls | %s ...\"\n", stages[0][0], stages[0][0]);
+		lsh_last_status = 2;
+		return;
+	}
+	err = lsh_records_ls(&t, stages[0]);
+	for (i = 1; i < count && err == 0; i++) {
+		for (j = 0; strcmp(lsh_record_ops[j].name, stages[i][0]) != 0; j++) {
+		}
+		err = lsh_record_ops[j].fn(&t, stages[i]);
+	}
+	if (err == 0 && lsh_table_print(&t) != 0 && errno != EPIPE && errno != EINTR) {
+		perror("lsh");
+	}
+	lsh_table_free(&t);
+	lsh_last_status = err ? 1 : 0;
+}
+
+/**
+@brief Bultin command: a record operator on its own, with nothing to read
+records from.
+@param args List of args.  args[0] is the operator.
+@return Always returns 1, to continue executing.
+*/
+int lsh_record_builtin(char **args)
+{
+	lsh_records_run(&args, 1);
+	return 1;
+}
+
+/*
+Hash functions used by hashsum: XXH64 (fast, non-cryptographic) and SHA-256.
+*/
+#define LSH_XXH_P1 11400714785074694791ULL
+#define LSH_XXH_P2 14029467366897019727ULL
+#define LSH_XXH_P3 1609587929392839161ULL
+#define LSH_XXH_P4 9650029242287828579ULL
+#define LSH_XXH_P5 2870177450012600261ULL
+#define LSH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define LSH_ROTR32(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+uint64_t lsh_read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+uint32_t lsh_read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+uint64_t lsh_xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * LSH_XXH_P2;
+	acc = LSH_ROTL64(acc, 31);
+	return acc * LSH_XXH_P1;
+}
+
+uint64_t lsh_xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= lsh_xxh64_round(0, val);
+	return acc * LSH_XXH_P1 + LSH_XXH_P4;
+}
+
+/**
+@brief Compute the XXH64 hash of a buffer (little-endian hosts).
+@param data Bytes to hash.
+@param len Number of bytes.
+@param seed Hash seed.
+@return The 64-bit hash.
+*/
+uint64_t lsh_xxh64(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data, *end = p + len;
+	uint64_t h, v1, v2, v3, v4;
+
+	if (len >= 32) {
+		v1 = seed + LSH_XXH_P1 + LSH_XXH_P2;
+		v2 = seed + LSH_XXH_P2;
+		v3 = seed;
+		v4 = seed - LSH_XXH_P1;
+		do {
+			v1 = lsh_xxh64_round(v1, lsh_read64(p));
+			v2 = lsh_xxh64_round(v2, lsh_read64(p + 8));
+			v3 = lsh_xxh64_round(v3, lsh_read64(p + 16));
+			v4 = lsh_xxh64_round(v4, lsh_read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+		h = LSH_ROTL64(v1, 1) + LSH_ROTL64(v2, 7) + LSH_ROTL64(v3, 12) + LSH_ROTL64(v4, 18);
+		h = lsh_xxh64_merge(h, v1);
+		h = lsh_xxh64_merge(h, v2);
+		h = lsh_xxh64_merge(h, v3);
+		h = lsh_xxh64_merge(h, v4);
+	}
+	else {
+		h = seed + LSH_XXH_P5;
+	}
+	h += len;
+
+	while (p + 8 <= end) {
+		h ^= lsh_xxh64_round(0, lsh_read64(p));
+		h = LSH_ROTL64(h, 27) * LSH_XXH_P1 + LSH_XXH_P4;
+		p += 8;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)lsh_read32(p) * LSH_XXH_P1;
+		h = LSH_ROTL64(h, 23) * LSH_XXH_P2 + LSH_XXH_P3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= *p * LSH_XXH_P5;
+		h = LSH_ROTL64(h, 11) * LSH_XXH_P1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= LSH_XXH_P2;
+	h ^= h >> 29;
+	h *= LSH_XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+XXH32, the checksum of the LZ4 frame format, also incrementally.
+*/
+#define LSH_XXH32_P1 2654435761U
+#define LSH_XXH32_P2 2246822519U
+#define LSH_XXH32_P3 3266489917U
+#define LSH_XXH32_P4 668265263U
+#define LSH_XXH32_P5 374761393U
+#define LSH_ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+struct lsh_xxh32 {
+	uint32_t v[4];
+	uint32_t total;
+	int large;
+	unsigned char mem[16];
+	size_t memlen;
+};
+
+uint32_t lsh_xxh32_round(uint32_t acc, const unsigned char *p)
+{
+	acc += lsh_read32(p) * LSH_XXH32_P2;
+	acc = LSH_ROTL32(acc, 13);
+	return acc * LSH_XXH32_P1;
+}
+
+/**
+@brief Start a checksum.
+@param s The state.
+@param seed The seed.
+*/
+void lsh_xxh32_init(struct lsh_xxh32 *s, uint32_t seed)
+{
+	memset(s, 0, sizeof(*s));
+	s->v[0] = seed + LSH_XXH32_P1 + LSH_XXH32_P2;
+	s->v[1] = seed + LSH_XXH32_P2;
+	s->v[2] = seed;
+	s->v[3] = seed - LSH_XXH32_P1;
+}
+
+/**
+@brief Add data to a checksum.
+@param s The state.
+@param data The data.
+@param len Its length.
+*/
+void lsh_xxh32_update(struct lsh_xxh32 *s, const void *data, size_t len)
+{
+	const unsigned char *p = data, *end = p + len;
+	size_t fill;
+
+	s->total += len;
+	s->large |= len >= 16 || s->total >= 16;
+	if (s->memlen + len < 16) {
+		memcpy(s->mem + s->memlen, p, len);
+		s->memlen += len;
+		return;
+	}
+	if (s->memlen > 0) {
+		fill = 16 - s->memlen;
+		memcpy(s->mem + s->memlen, p, fill);
+		p += fill;
+		s->v[0] = lsh_xxh32_round(s->v[0], s->mem);
+		s->v[1] = lsh_xxh32_round(s->v[1], s->mem + 4);
+		s->v[2] = lsh_xxh32_round(s->v[2], s->mem + 8);
+		s->v[3] = lsh_xxh32_round(s->v[3], s->mem + 12);
+		s->memlen = 0;
+	}
+	for (; end - p >= 16; p += 16) {
+		s->v[0] = lsh_xxh32_round(s->v[0], p);
+		s->v[1] = lsh_xxh32_round(s->v[1], p + 4);
+		s->v[2] = lsh_xxh32_round(s->v[2], p + 8);
+		s->v[3] = lsh_xxh32_round(s->v[3], p + 12);
+	}
+	memcpy(s->mem, p, end - p);
+	s->memlen = end - p;
+}
+
+/**
+@brief Finish a checksum.
+@param s The state.
+@return The checksum.
+*/
+uint32_t lsh_xxh32_digest(struct lsh_xxh32 *s)
+{
+	const unsigned char *p = s->mem, *end = s->mem + s->memlen;
+	uint32_t h;
+
+	if (s->large) {
+		h = LSH_ROTL32(s->v[0], 1) + LSH_ROTL32(s->v[1], 7) + LSH_ROTL32(s->v[2], 12) +
+			LSH_ROTL32(s->v[3], 18);
+	}
+	else {
+		h = s->v[2] + LSH_XXH32_P5;
+	}
+	h += s->total;
+	for (; end - p >= 4; p += 4) {
+		h = LSH_ROTL32(h + lsh_read32(p) * LSH_XXH32_P3, 17) * LSH_XXH32_P4;
+	}
+	for (; p < end; p++) {
+		h = LSH_ROTL32(h + *p * LSH_XXH32_P5, 11) * LSH_XXH32_P1;
+	}
+	h ^= h >> 15;
+	h *= LSH_XXH32_P2;
+	h ^= h >> 13;
+	h *= LSH_XXH32_P3;
+	h ^= h >> 16;
+	return h;
+}
+
+/**
+@brief Checksum a buffer.
+*/
+uint32_t lsh_xxh32(const void *data, size_t len, uint32_t seed)
+{
+	struct lsh_xxh32 s;
+
+	lsh_xxh32_init(&s, seed);
+	lsh_xxh32_update(&s, data, len);
+	return lsh_xxh32_digest(&s);
+}
+
+const uint32_t lsh_sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/**
+@brief Run the SHA-256 compression function over one 64 byte block.
+@param state The eight word hash state.
+@param block The block.
+*/
+void lsh_sha256_block(uint32_t *state, const unsigned char *block)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+			(uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	}
+	for (i = 16; i < 64; i++) {
+		w[i] = w[i - 16] + w[i - 7] +
+			(LSH_ROTR32(w[i - 15], 7) ^ LSH_ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			(LSH_ROTR32(w[i - 2], 17) ^ LSH_ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + (LSH_ROTR32(e, 6) ^ LSH_ROTR32(e, 11) ^ LSH_ROTR32(e, 25)) +
+			((e & f) ^ (~e & g)) + lsh_sha256_k[i] + w[i];
+		t2 = (LSH_ROTR32(a, 2) ^ LSH_ROTR32(a, 13) ^ LSH_ROTR32(a, 22)) +
+			((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/**
+@brief Compute the SHA-256 digest of a buffer.
+@param data Bytes to hash.
+@param len Number of bytes.
+@param out 32 byte digest.
+*/
+void lsh_sha256(const void *data, size_t len, unsigned char *out)
+{
+	uint32_t state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	const unsigned char *p = data;
+	unsigned char tail[128];
+	size_t rest = len % 64, padded, block;
+	uint64_t bits = (uint64_t)len * 8;
+	int i;
+
+	for (block = 0; block < len / 64; block++) {
+		lsh_sha256_block(state, p + block * 64);
+	}
+
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, p + len - rest, rest);
+	tail[rest] = 0x80;
+	padded = rest < 56 ? 64 : 128;
+	for (i = 0; i < 8; i++) {
+		tail[padded - 1 - i] = bits >> (i * 8);
+	}
+	lsh_sha256_block(state, tail);
+	if (padded == 128) {
+		lsh_sha256_block(state, tail + 64);
+	}
+
+	for (i = 0; i < 8; i++) {
+		out[i * 4] = state[i] >> 24;
+		out[i * 4 + 1] = state[i] >> 16;
+		out[i * 4 + 2] = state[i] >> 8;
+		out[i * 4 + 3] = state[i];
+	}
+}
+
+#define LSH_HASH_XXH64 0
+#define LSH_HASH_SHA256 1
+#define LSH_HASH_MAXLEN 32
+#define LSH_HASH_CHUNK (8 << 20)
+
+/**
+@brief Hash a buffer with the selected algorithm.
+@param algo LSH_HASH_XXH64 or LSH_HASH_SHA256.
+@param data Bytes to hash.
+@param len Number of bytes.
+@param out Digest, big-endian (at most LSH_HASH_MAXLEN bytes).
+@return Digest length in bytes.
+*/
+int lsh_hash_buf(int algo, const void *data, size_t len, unsigned char *out)
+{
+	uint64_t h;
+	int i;
+
+	if (algo == LSH_HASH_SHA256) {
+		lsh_sha256(data, len, out);
+		return 32;
+	}
+	h = lsh_xxh64(data, len, 0);
+	for (i = 0; i < 8; i++) {
+		out[i] = h >> (56 - i * 8);
+	}
+	return 8;
+}
+
+/*
+One unit of hashsum work: a whole file, or one chunk of a file in --tree mode.
+*/
+struct lsh_hash_job {
+	const char *name;
+	const unsigned char *data;
+	size_t len;
+	int err;
+	int digestlen;
+	unsigned char digest[LSH_HASH_MAXLEN];
+};
+
+struct lsh_hash_pool {
+	struct lsh_hash_job *jobs;
+	int njobs;
+	int next;
+	int algo;
+	int map;
+	pthread_mutex_t lock;
+};
+
+/**
+@brief Map a file read-only.
+@param name File name.
+@param len Where to store the file size.
+@param err Where to store errno on failure.
+@return The mapping (NULL for an empty file or on failure).
+*/
+void *lsh_map_file(const char *name, size_t *len, int *err)
+{
+	struct stat st;
+	void *data = NULL;
+	int fd;
+
+	*len = 0;
+	*err = 0;
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		*err = errno;
+	}
+	else if (!S_ISREG(st.st_mode)) {
+		*err = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+	}
+	else if (st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			*err = errno;
+			data = NULL;
+		}
+		else {
+			*len = st.st_size;
+			madvise(data, *len, MADV_SEQUENTIAL);
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	return data;
+}
+
+/**
+@brief Worker thread: take jobs off the pool until it is empty.
+@param arg The struct lsh_hash_pool.
+@return NULL.
+*/
+void *lsh_hash_worker(void *arg)
+{
+	struct lsh_hash_pool *pool = arg;
+	struct lsh_hash_job *job;
+	void *data;
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= pool->njobs) {
+			return NULL;
+		}
+
+		job = &pool->jobs[i];
+		if (pool->map) {
+			data = lsh_map_file(job->name, &job->len, &job->err);
+			if (job->err == 0) {
+				job->digestlen = lsh_hash_buf(pool->algo, data, job->len, job->digest);
+			}
+			if (data != NULL) {
+				munmap(data, job->len);
+			}
+		}
+		else {
+			job->digestlen = lsh_hash_buf(pool->algo, job->data, job->len, job->digest);
+		}
+	}
+}
+
+/**
+@brief Run all jobs of a pool on up to nthreads threads.
+@param pool The pool.
+@param nthreads Maximum number of threads.
+*/
+void lsh_hash_run(struct lsh_hash_pool *pool, int nthreads)
+{
+	pthread_t *threads;
+	int i, started = 0;
+
+	if (nthreads > pool->njobs) {
+		nthreads = pool->njobs;
+	}
+	pool->next = 0;
+	pthread_mutex_init(&pool->lock, NULL);
+	threads = malloc(sizeof(pthread_t) * (nthreads > 0 ? nthreads : 1));
+	if (!threads) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	// The calling thread works too, so only nthreads - 1 are created.
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL, lsh_hash_worker, pool) == 0) {
+			started++;
+		}
+	}
+	lsh_hash_worker(pool);
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(threads);
+}
+
+/**
+@brief Format a digest as lowercase hex.
+@param digest The digest.
+@param len Its length in bytes.
+@param out Buffer of at least len * 2 + 1 bytes.
+*/
+void lsh_hex(const unsigned char *digest, int len, char *out)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < len; i++) {
+		out[i * 2] = hex[digest[i] >> 4];
+		out[i * 2 + 1] = hex[digest[i] & 15];
+	}
+	out[len * 2] = '\0';
+}
+
+/**
+@brief Print a digest and file name in the usual "hex  name" format.
+@param digest The digest.
+@param len Digest length.
+@param name File name.
+*/
+void lsh_hash_print(const unsigned char *digest, int len, const char *name)
+{
+	char line[LSH_HASH_MAXLEN * 2 + 2];
+
+	lsh_hex(digest, len, line);
+	line[len * 2] = ' ';
+	line[len * 2 + 1] = ' ';
+	lsh_out_write(line, len * 2 + 2);
+	lsh_out_write(name, strlen(name));
+	lsh_out_write("\n", 1);
+}
+
+/**
+@brief Hash one file as a tree: chunks are hashed in parallel, then the
+concatenated chunk digests are hashed again.
+@param name File name.
+@param algo Hash algorithm.
+@param nthreads Maximum number of threads.
+*/
+void lsh_hash_tree(const char *name, int algo, int nthreads)
+{
+	struct lsh_hash_pool pool;
+	unsigned char *data, *digests, digest[LSH_HASH_MAXLEN];
+	size_t len, off;
+	int err, i, dlen = 0, digestlen;
+
+	data = lsh_map_file(name, &len, &err);
+	if (err != 0) {
+		fprintf(stderr, "lsh: hashsum: %s: %s\n", name, strerror(err));
+		return;
+	}
+
+	memset(&pool, 0, sizeof(pool));
+	pool.algo = algo;
+	pool.njobs = len == 0 ? 1 : (len + LSH_HASH_CHUNK - 1) / LSH_HASH_CHUNK;
+	pool.jobs = calloc(pool.njobs, sizeof(struct lsh_hash_job));
+	digests = malloc((size_t)pool.njobs * LSH_HASH_MAXLEN);
+	if (!pool.jobs || !digests) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0, off = 0; i < pool.njobs; i++, off += LSH_HASH_CHUNK) {
+		pool.jobs[i].data = data + off;
+		pool.jobs[i].len = len - off < LSH_HASH_CHUNK ? len - off : LSH_HASH_CHUNK;
+	}
+	lsh_hash_run(&pool, nthreads);
+
+	for (i = 0; i < pool.njobs; i++) {
+		memcpy(digests + dlen, pool.jobs[i].digest, pool.jobs[i].digestlen);
+		dlen += pool.jobs[i].digestlen;
+	}
+	digestlen = lsh_hash_buf(algo, digests, dlen, digest);
+	lsh_hash_print(digest, digestlen, name);
+
+	if (data != NULL) {
+		munmap(data, len);
+	}
+	free(digests);
+	free(pool.jobs);
+}
+
+/**
+@brief Bultin command: hash files.
+@param args List of args.  args[0] is "hashsum".  Options are -a xxh64|sha256
+(default sha256), -j threads and --tree, followed by the files.
+@return Always returns 1, to continue executing.
+*/
+int lsh_hashsum(char **args)
+{
+	struct lsh_hash_pool pool;
+	int algo = LSH_HASH_SHA256, tree = 0, i = 1, j;
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (; args[i] != NULL && args[i][0] == '-'; i++) {
+		if (strcmp(args[i], "--tree") == 0) {
+			tree = 1;
+		}
+		else if (strcmp(args[i], "-a") == 0 && args[i + 1] != NULL) {
+			i++;
+			if (strcmp(args[i], "xxh64") == 0) {
+				algo = LSH_HASH_XXH64;
+			}
+			else if (strcmp(args[i], "sha256") == 0) {
+				algo = LSH_HASH_SHA256;
+			}
+			else {
+				fprintf(stderr, "lsh: hashsum: unknown algorithm \"%s\"\n", args[i]);
+				return 1;
+			}
+		}
+		else if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+			nthreads = atol(args[++i]);
+		}
+		else {
+			fprintf(stderr, "lsh: usage: hashsum [-a xxh64|sha256] [-j threads] [--tree] file...\n");
+			return 1;
+		}
+	}
+	if (args[i] == NULL) {
+		fprintf(stderr, "lsh: expected argument to \"hashsum\"\n");
+		return 1;
+	}
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+
+	if (tree) {
+		for (; args[i] != NULL; i++) {
+			lsh_hash_tree(args[i], algo, nthreads);
+		}
+		lsh_out_flush();
+		return 1;
+	}
+
+	memset(&pool, 0, sizeof(pool));
+	pool.algo = algo;
+	pool.map = 1;
+	for (j = i; args[j] != NULL; j++) {
+		pool.njobs++;
+	}
+	pool.jobs = calloc(pool.njobs, sizeof(struct lsh_hash_job));
+	if (!pool.jobs) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (j = 0; j < pool.njobs; j++) {
+		pool.jobs[j].name = args[i + j];
+	}
+	lsh_hash_run(&pool, nthreads);
+
+	for (j = 0; j < pool.njobs; j++) {
+		if (pool.jobs[j].err != 0) {
+			lsh_out_flush();
+			fprintf(stderr, "lsh: hashsum: %s: %s\n", pool.jobs[j].name, strerror(pool.jobs[j].err));
+		}
+		else {
+			lsh_hash_print(pool.jobs[j].digest, pool.jobs[j].digestlen, pool.jobs[j].name);
+		}
+	}
+	lsh_out_flush();
+	free(pool.jobs);
+	return 1;
+}
+
+/*
+LZ4.  Blocks are compressed independently with the greedy hash-chain-free
+matcher of the reference "fast" mode, and written in the LZ4 frame format
+(so the lz4 tool reads them), with a content checksum and optionally one per
+block.  Input is cut into blocks that a pool of threads compresses or
+decompresses while the stage's own thread reads ahead and writes finished
+blocks out in order.
+*/
+#define LSH_LZ4_MAGIC 0x184D2204U
+#define LSH_LZ4_BLOCK (1 << 20)
+#define LSH_LZ4_BD 0x60
+#define LSH_LZ4_HASHLOG 14
+#define LSH_LZ4_MINMATCH 4
+#define LSH_LZ4_MFLIMIT 12
+#define LSH_LZ4_LASTLITERALS 5
+#define LSH_LZ4_MAXTHREADS 32
+
+/**
+@brief Store a little-endian 32-bit number.
+*/
+void lsh_lz4_put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/**
+@brief Bound on the compressed size of a block.
+*/
+size_t lsh_lz4_bound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+uint32_t lsh_lz4_hash(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return (v * 2654435761U) >> (32 - LSH_LZ4_HASHLOG);
+}
+
+/**
+@brief Write a length that did not fit in its token nibble.
+*/
+unsigned char *lsh_lz4_length(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		*op++ = 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+/**
+@brief Compress one block.
+@param src The data.
+@param len Its length.
+@param dst Room for lsh_lz4_bound(len) bytes.
+@param table Hash table of 1 << LSH_LZ4_HASHLOG entries.
+@return The compressed length.
+*/
+size_t lsh_lz4_compress(const unsigned char *src, size_t len, unsigned char *dst, uint32_t *table)
+{
+	const unsigned char *ip = src, *anchor = src, *end = src + len, *ref, *start;
+	const unsigned char *mflimit = end - LSH_LZ4_MFLIMIT, *matchlimit = end - LSH_LZ4_LASTLITERALS;
+	unsigned char *op = dst, *token;
+	uint64_t a, b;
+	uint32_t h, x, y;
+	size_t lit, mlen, off;
+	unsigned attempts;
+
+	if (len < LSH_LZ4_MFLIMIT + 1) {
+		goto last;
+	}
+	memset(table, 0, sizeof(uint32_t) << LSH_LZ4_HASHLOG);
+	ip++;
+	while (1) {
+		// Find a match, stepping faster the longer none turns up.
+		for (attempts = 1 << 6; ; attempts++) {
+			if (ip > mflimit) {
+				goto last;
+			}
+			h = lsh_lz4_hash(ip);
+			ref = src + table[h];
+			table[h] = ip - src;
+			memcpy(&x, ref, 4);
+			memcpy(&y, ip, 4);
+			if (x == y && ip - ref <= 65535 && ref < ip) {
+				break;
+			}
+			ip += attempts >> 6;
+		}
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		lit = ip - anchor;
+		token = op++;
+		if (lit >= 15) {
+			*token = 15 << 4;
+			op = lsh_lz4_length(op, lit - 15);
+		}
+		else {
+			*token = lit << 4;
+		}
+		memcpy(op, anchor, lit);
+		op += lit;
+		off = ip - ref;
+		*op++ = off;
+		*op++ = off >> 8;
+
+		start = ip;
+		ip += LSH_LZ4_MINMATCH;
+		ref += LSH_LZ4_MINMATCH;
+		while (ip + 8 <= matchlimit) {
+			memcpy(&a, ip, 8);
+			memcpy(&b, ref, 8);
+			if (a != b) {
+				ip += __builtin_ctzll(a ^ b) >> 3;
+				goto counted;
+			}
+			ip += 8;
+			ref += 8;
+		}
+		while (ip < matchlimit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+counted:
+		mlen = ip - start - LSH_LZ4_MINMATCH;
+		if (mlen >= 15) {
+			*token |= 15;
+			op = lsh_lz4_length(op, mlen - 15);
+		}
+		else {
+			*token |= mlen;
+		}
+		anchor = ip;
+		if (ip > mflimit) {
+			break;
+		}
+		table[lsh_lz4_hash(ip - 2)] = ip - 2 - src;
+	}
+
+last:
+	lit = end - anchor;
+	token = op++;
+	if (lit >= 15) {
+		*token = 15 << 4;
+		op = lsh_lz4_length(op, lit - 15);
+	}
+	else {
+		*token = lit << 4;
+	}
+	memcpy(op, anchor, lit);
+	return op + lit - dst;
+}
+
+/**
+@brief Decompress one block, checking every length against both buffers.
+@param src The compressed block.
+@param len Its length.
+@param dst Destination.
+@param cap Room in dst.
+@return The decompressed length, or -1 if the block is corrupt.
+*/
+long lsh_lz4_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap)
+{
+	const unsigned char *ip = src, *iend = src + len, *match;
+	unsigned char *op = dst, *oend = dst + cap;
+	size_t lit, mlen, off;
+	unsigned char token, b;
+
+	while (ip < iend) {
+		token = *ip++;
+		lit = token >> 4;
+		if (lit == 15) {
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		}
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+			return -1;
+		}
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - dst)) {
+			return -1;
+		}
+		mlen = token & 15;
+		if (mlen == 15) {
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += LSH_LZ4_MINMATCH;
+		if (mlen > (size_t)(oend - op)) {
+			return -1;
+		}
+		match = op - off;
+		if (off >= mlen) {
+			memcpy(op, match, mlen);
+			op += mlen;
+			continue;
+		}
+		// Overlapping: the match repeats what it is writing.
+		if (off >= 8) {
+			for (; mlen >= 8; mlen -= 8, op += 8, match += 8) {
+				memcpy(op, match, 8);
+			}
+		}
+		while (mlen-- > 0) {
+			*op++ = *match++;
+		}
+	}
+	return op - dst;
+}
+
+/*
+A block on its way through the pool.  For compression in holds the data
+and out the block as written; for decompression in holds the block as read
+and out the data.
+*/
+struct lsh_lz4_slot {
+	unsigned char *in;
+	unsigned char *out;
+	size_t len;
+	size_t outlen;
+	int raw;
+	uint32_t sum;
+	int state;
+	int err;
+};
+
+struct lsh_lz4 {
+	int decompress;
+	int blocksum;
+	size_t block;
+	struct lsh_reader *r;
+	struct lsh_xxh32 content;
+	struct lsh_lz4_slot *slots;
+	int nslots;
+	int threads;
+	long queued;
+	long taken;
+	long written;
+	int quit;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+};
+
+/**
+@brief Compress or decompress the block in a slot.
+@param z The stream.
+@param s The slot.
+@param table Hash table for compression.
+*/
+void lsh_lz4_process(struct lsh_lz4 *z, struct lsh_lz4_slot *s, uint32_t *table)
+{
+	long n;
+
+	s->err = 0;
+	if (!z->decompress) {
+		s->outlen = lsh_lz4_compress(s->in, s->len, s->out, table);
+		// Blocks that do not shrink are stored as they are.
+		s->raw = s->outlen >= s->len;
+		if (z->blocksum) {
+			s->sum = lsh_xxh32(s->raw ? s->in : s->out, s->raw ? s->len : s->outlen, 0);
+		}
+		return;
+	}
+	if (z->blocksum && s->sum != lsh_xxh32(s->in, s->len, 0)) {
+		s->err = 2;
+	}
+	else if (s->raw) {
+		memcpy(s->out, s->in, s->len);
+		s->outlen = s->len;
+	}
+	else if ((n = lsh_lz4_decompress(s->in, s->len, s->out, z->block)) < 0) {
+		s->err = 1;
+	}
+	else {
+		s->outlen = n;
+	}
+}
+
+/**
+@brief Pool thread: process queued blocks in order of arrival.
+@param arg The struct lsh_lz4.
+@return NULL.
+*/
+void *lsh_lz4_worker(void *arg)
+{
+	struct lsh_lz4 *z = arg;
+	struct lsh_lz4_slot *s;
+	uint32_t *table = malloc(sizeof(uint32_t) << LSH_LZ4_HASHLOG);
+
+	if (!table) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_lock(&z->lock);
+	while (1) {
+		while (!z->quit && z->taken == z->queued) {
+			pthread_cond_wait(&z->work, &z->lock);
+		}
+		if (z->taken == z->queued) {
+			break;
+		}
+		s = &z->slots[z->taken++ % z->nslots];
+		pthread_mutex_unlock(&z->lock);
+		lsh_lz4_process(z, s, table);
+		pthread_mutex_lock(&z->lock);
+		s->state = 2;
+		pthread_cond_broadcast(&z->done);
+	}
+	pthread_mutex_unlock(&z->lock);
+	free(table);
+	return NULL;
+}
+
+/**
+@brief Write out finished blocks in order.
+@param z The stream.
+@param upto Write blocks before this sequence number.
+@param wait Nonzero to wait for blocks still being processed; otherwise
+stop at the first one.
+@return 0 on success, -1 if output failed or a block was corrupt.
+*/
+int lsh_lz4_flush(struct lsh_lz4 *z, long upto, int wait)
+{
+	struct lsh_lz4_slot *s;
+	unsigned char head[4];
+	uint32_t size;
+	int err = 0;
+
+	while (z->written < upto) {
+		s = &z->slots[z->written % z->nslots];
+		if (z->threads > 0) {
+			pthread_mutex_lock(&z->lock);
+			while (wait && s->state != 2) {
+				pthread_cond_wait(&z->done, &z->lock);
+			}
+			pthread_mutex_unlock(&z->lock);
+			if (s->state != 2) {
+				return 0;
+			}
+		}
+		s->state = 0;
+		z->written++;
+		if (s->err != 0) {
+			fprintf(stderr, "lsh: lz4: %s\n", s->err == 2 ? "block checksum mismatch" : "corrupt input");
+			return -1;
+		}
+		if (z->decompress) {
+			lsh_xxh32_update(&z->content, s->out, s->outlen);
+			err = lsh_out_write((char *)s->out, s->outlen);
+		}
+		else {
+			lsh_xxh32_update(&z->content, s->in, s->len);
+			size = s->raw ? s->len | 0x80000000U : s->outlen;
+			lsh_lz4_put32(head, size);
+			err = lsh_out_write((char *)head, 4) ||
+				lsh_out_write((char *)(s->raw ? s->in : s->out), s->raw ? s->len : s->outlen);
+			if (z->blocksum && err == 0) {
+				lsh_lz4_put32(head, s->sum);
+				err = lsh_out_write((char *)head, 4);
+			}
+		}
+		if (err != 0) {
+			if (errno != EPIPE && errno != EINTR) {
+				perror("lsh: lz4");
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+@brief Hand a filled slot to the pool, or process it here without one.
+@param z The stream.
+@param s The slot.
+@param table Hash table for processing here.
+@return As lsh_lz4_flush().
+*/
+int lsh_lz4_queue(struct lsh_lz4 *z, struct lsh_lz4_slot *s, uint32_t *table)
+{
+	if (z->threads == 0) {
+		lsh_lz4_process(z, s, table);
+		z->queued++;
+		return lsh_lz4_flush(z, z->queued, 1);
+	}
+	pthread_mutex_lock(&z->lock);
+	s->state = 1;
+	z->queued++;
+	pthread_cond_signal(&z->work);
+	pthread_mutex_unlock(&z->lock);
+	// Write what is ready, so slow input still comes out promptly.
+	return lsh_lz4_flush(z, z->queued, 0);
+}
+
+/**
+@brief Get a free slot for the next block, writing out the block using it.
+@param z The stream.
+@param s Where to store the slot.
+@return As lsh_lz4_flush().
+*/
+int lsh_lz4_slot(struct lsh_lz4 *z, struct lsh_lz4_slot **s)
+{
+	*s = &z->slots[z->queued % z->nslots];
+	return lsh_lz4_flush(z, z->queued - z->nslots + 1, 1);
+}
+
+/**
+@brief Compress the input as one frame.
+@param z The stream.
+@param table Hash table for blocks compressed on this thread.
+@return 0 on success, -1 on error (reported).
+*/
+int lsh_lz4_encode(struct lsh_lz4 *z, uint32_t *table)
+{
+	struct lsh_lz4_slot *s;
+	unsigned char head[8];
+	ssize_t n;
+
+	lsh_lz4_put32(head, LSH_LZ4_MAGIC);
+	head[4] = 0x40 | 0x20 | (z->blocksum ? 0x10 : 0) | 0x04;
+	head[5] = LSH_LZ4_BD;
+	head[6] = lsh_xxh32(head + 4, 2, 0) >> 8;
+	if (lsh_out_write((char *)head, 7) != 0) {
+		return -1;
+	}
+	while (1) {
+		if (lsh_lz4_slot(z, &s) != 0 || lsh_check_interrupt()) {
+			return -1;
+		}
+		if ((n = lsh_reader_read(z->r, s->in, z->block)) < 0) {
+			perror("lsh: lz4");
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		s->len = n;
+		if (lsh_lz4_queue(z, s, table) != 0) {
+			return -1;
+		}
+		if ((size_t)n < z->block) {
+			break;
+		}
+	}
+	if (lsh_lz4_flush(z, z->queued, 1) != 0) {
+		return -1;
+	}
+	lsh_lz4_put32(head, 0);
+	lsh_lz4_put32(head + 4, lsh_xxh32_digest(&z->content));
+	return lsh_out_write((char *)head, 8);
+}
+
+/**
+@brief Read exactly len bytes of a frame.
+@return 0 on success, -1 at a premature end (reported).
+*/
+int lsh_lz4_need(struct lsh_lz4 *z, void *buf, size_t len)
+{
+	ssize_t n = lsh_reader_read(z->r, buf, len);
+
+	if (n == (ssize_t)len) {
+		return 0;
+	}
+	if (n < 0) {
+		perror("lsh: lz4");
+	}
+	else {
+		fprintf(stderr, "lsh: lz4: unexpected end of input\n");
+	}
+	return -1;
+}
+
+/**
+@brief Decompress one frame whose magic number has been read.
+@param z The stream.
+@param table Unused hash table, as for lsh_lz4_encode().
+@return 0 on success, -1 on error (reported).
+*/
+int lsh_lz4_decode(struct lsh_lz4 *z, uint32_t *table)
+{
+	struct lsh_lz4_slot *s;
+	unsigned char desc[15], word[4];
+	uint32_t size;
+	size_t len = 3, block;
+	int flg;
+
+	if (lsh_lz4_need(z, desc, 2) != 0) {
+		return -1;
+	}
+	flg = desc[0];
+	if ((flg & 0xC0) != 0x40 || (desc[1] >> 4 & 7) < 4) {
+		fprintf(stderr, "lsh: lz4: unsupported frame\n");
+		return -1;
+	}
+	if (!(flg & 0x20)) {
+		fprintf(stderr, "lsh: lz4: linked blocks are not supported\n");
+		return -1;
+	}
+	len += (flg & 0x08 ? 8 : 0) + (flg & 0x01 ? 4 : 0);
+	if (lsh_lz4_need(z, desc + 2, len - 2) != 0) {
+		return -1;
+	}
+	if (desc[len - 1] != (unsigned char)(lsh_xxh32(desc, len - 1, 0) >> 8)) {
+		fprintf(stderr, "lsh: lz4: header checksum mismatch\n");
+		return -1;
+	}
+	block = (size_t)1 << (8 + 2 * (desc[1] >> 4 & 7));
+	if (block > z->block) {
+		// Slots are sized for the largest block yet.
+		if (lsh_lz4_flush(z, z->queued, 1) != 0) {
+			return -1;
+		}
+		for (len = 0; len < (size_t)z->nslots; len++) {
+			z->slots[len].in = realloc(z->slots[len].in, block);
+			z->slots[len].out = realloc(z->slots[len].out, block);
+			if (!z->slots[len].in || !z->slots[len].out) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		z->block = block;
+	}
+	z->blocksum = flg & 0x10;
+	lsh_xxh32_init(&z->content, 0);
+
+	while (1) {
+		if (lsh_lz4_slot(z, &s) != 0 || lsh_check_interrupt() || lsh_lz4_need(z, word, 4) != 0) {
+			return -1;
+		}
+		if ((size = lsh_read32(word)) == 0) {
+			break;
+		}
+		s->raw = size >> 31;
+		s->len = size & 0x7FFFFFFFU;
+		if (s->len > block) {
+			fprintf(stderr, "lsh: lz4: corrupt input\n");
+			return -1;
+		}
+		if (lsh_lz4_need(z, s->in, s->len) != 0 || (z->blocksum && lsh_lz4_need(z, word, 4) != 0)) {
+			return -1;
+		}
+		s->sum = lsh_read32(word);
+		if (lsh_lz4_queue(z, s, table) != 0) {
+			return -1;
+		}
+	}
+	if (lsh_lz4_flush(z, z->queued, 1) != 0) {
+		return -1;
+	}
+	if (flg & 0x04) {
+		if (lsh_lz4_need(z, word, 4) != 0) {
+			return -1;
+		}
+		if (lsh_read32(word) != lsh_xxh32_digest(&z->content)) {
+			fprintf(stderr, "lsh: lz4: content checksum mismatch\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+@brief Decompress every frame of the input, skipping skippable frames.
+@param z The stream.
+@param table As for lsh_lz4_decode().
+@return 0 on success, -1 on error (reported).
+*/
+int lsh_lz4_decode_all(struct lsh_lz4 *z, uint32_t *table)
+{
+	unsigned char skip[4096], word[4];
+	uint32_t magic, size;
+	ssize_t n;
+
+	while ((n = lsh_reader_read(z->r, word, 4)) == 4) {
+		magic = lsh_read32(word);
+		if ((magic & 0xFFFFFFF0U) == 0x184D2A50U) {
+			if (lsh_lz4_need(z, word, 4) != 0) {
+				return -1;
+			}
+			size = lsh_read32(word);
+			for (; size > 0; size -= n) {
+				n = lsh_reader_read(z->r, skip, size < sizeof(skip) ? size : sizeof(skip));
+				if (n <= 0) {
+					fprintf(stderr, "lsh: lz4: unexpected end of input\n");
+					return -1;
+				}
+			}
+			continue;
+		}
+		if (magic != LSH_LZ4_MAGIC) {
+			fprintf(stderr, "lsh: lz4: not in lz4 format\n");
+			return -1;
+		}
+		if (lsh_lz4_decode(z, table) != 0) {
+			return -1;
+		}
+	}
+	if (n < 0) {
+		perror("lsh: lz4");
+		return -1;
+	}
+	if (n != 0) {
+		fprintf(stderr, "lsh: lz4: unexpected end of input\n");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+@brief Bultin command: compress or decompress with LZ4.
+@param args List of args.  args[0] is "lz4".  Then -d to decompress, -BX
+to also checksum every block, and the input file ("-" or none for standard
+input).  Output goes to standard output.
+@return Always returns 1, to continue executing.
+*/
+int lsh_lz4(char **args)
+{
+	struct lsh_lz4 z;
+	struct lsh_reader file;
+	pthread_t threads[LSH_LZ4_MAXTHREADS];
+	uint32_t *table;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, err, nslots;
+
+	memset(&z, 0, sizeof(z));
+	for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+		if (strcmp(args[i], "-d") == 0) {
+			z.decompress = 1;
+		}
+		else if (strcmp(args[i], "-BX") == 0) {
+			z.blocksum = 1;
+		}
+		else {
+			fprintf(stderr, "lsh: usage: lz4 [-d] [-BX] [file]\n");
+			lsh_last_status = 2;
+			return 1;
+		}
+	}
+	if ((z.r = lsh_reader_open(args[i] != NULL ? args[i] : "-", &file)) == NULL) {
+		fprintf(stderr, "lsh: lz4: %s: %s\n", args[i], strerror(errno));
+		lsh_last_status = 1;
+		return 1;
+	}
+
+	// The stage's thread reads and writes; the pool does the rest.
+	z.threads = cpus > 1 ? (cpus < LSH_LZ4_MAXTHREADS ? cpus : LSH_LZ4_MAXTHREADS) : 0;
+	z.nslots = nslots = z.threads > 0 ? 2 * z.threads : 1;
+	z.block = LSH_LZ4_BLOCK;
+	z.slots = calloc(z.nslots, sizeof(struct lsh_lz4_slot));
+	table = malloc(sizeof(uint32_t) << LSH_LZ4_HASHLOG);
+	if (!z.slots || !table) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < z.nslots; i++) {
+		z.slots[i].in = malloc(z.block);
+		z.slots[i].out = malloc(lsh_lz4_bound(z.block));
+		if (!z.slots[i].in || !z.slots[i].out) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	lsh_xxh32_init(&z.content, 0);
+	pthread_mutex_init(&z.lock, NULL);
+	pthread_cond_init(&z.work, NULL);
+	pthread_cond_init(&z.done, NULL);
+	for (i = 0; i < z.threads; i++) {
+		if (pthread_create(&threads[i], NULL, lsh_lz4_worker, &z) != 0) {
+			break;
+		}
+	}
+	if (i < z.threads) {
+		// Without a full pool, finish on this thread alone.
+		pthread_mutex_lock(&z.lock);
+		z.quit = 1;
+		pthread_cond_broadcast(&z.work);
+		pthread_mutex_unlock(&z.lock);
+		for (z.threads = i; i > 0; i--) {
+			pthread_join(threads[i - 1], NULL);
+		}
+		z.threads = 0;
+		z.nslots = 1;
+	}
+
+	err = z.decompress ? lsh_lz4_decode_all(&z, table) : lsh_lz4_encode(&z, table);
+	if (err == 0 && lsh_out_flush() != 0) {
+		if (errno != EPIPE && errno != EINTR) {
+			perror("lsh: lz4");
+		}
+		err = -1;
+	}
+
+	pthread_mutex_lock(&z.lock);
+	z.quit = 1;
+	pthread_cond_broadcast(&z.work);
+	pthread_mutex_unlock(&z.lock);
+	for (i = 0; i < z.threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&z.lock);
+	pthread_cond_destroy(&z.work);
+	pthread_cond_destroy(&z.done);
+	for (i = 0; i < nslots; i++) {
+		free(z.slots[i].in);
+		free(z.slots[i].out);
+	}
+	free(z.slots);
+	free(table);
+	lsh_reader_close(z.r);
+	lsh_last_status = err != 0;
+	return 1;
+}
+
+/*
+JSON and CSV extraction.  Input is indexed first, 64 bytes at a time: with
+SSE2 a block's quotes, backslashes and structural characters are found
+with a few vector compares, the bytes inside strings follow from a prefix
+XOR over the unescaped quote bits, and the positions of what is left are
+recorded.  Extraction then walks those positions instead of the bytes.
+Files are mapped and, when several are given, handled on parallel threads;
+pipes are read in blocks of whole lines.
+*/
+#define LSH_EX_GET 0
+#define LSH_EX_LINES 1
+#define LSH_EX_CSV 2
+
+#define LSH_EX_CHUNK (1 << 20)
+#define LSH_EX_MAXSTEPS 32
+
+struct lsh_scan {
+	uint32_t *pos;
+	size_t n;
+	size_t cap;
+	uint64_t *instr;
+	size_t blocks;
+};
+
+struct lsh_jstep {
+	const char *key;
+	size_t keylen;
+	long index;
+};
+
+struct lsh_extract {
+	int mode;
+	int raw;
+	struct lsh_jstep steps[LSH_EX_MAXSTEPS];
+	int nsteps;
+	char **spec;
+	int nspec;
+	int named;
+};
+
+/*
+Output of one input: straight to the output layer, or collected in memory
+when inputs are handled in parallel and must come out in order.
+*/
+struct lsh_sink {
+	int direct;
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+/**
+@brief Write to a sink.
+@param s The sink.
+@param data Bytes.
+@param len Number of bytes.
+@return 0 on success, -1 on error (errno is set).
+*/
+int lsh_sink_write(struct lsh_sink *s, const char *data, size_t len)
+{
+	if (s->direct) {
+		return lsh_out_write(data, len);
+	}
+	if (s->len + len > s->cap) {
+		s->cap = s->cap ? s->cap : 4096;
+		while (s->len + len > s->cap) {
+			s->cap *= 2;
+		}
+		s->buf = realloc(s->buf, s->cap);
+		if (!s->buf) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(s->buf + s->len, data, len);
+	s->len += len;
+	return 0;
+}
+
+struct lsh_masks {
+	uint64_t quote;
+	uint64_t backslash;
+	uint64_t structural;
+};
+
+#ifdef __SSE2__
+/**
+@brief Compare 64 bytes with a set of characters.
+@param v The bytes, as four vectors.
+@param set The characters.
+@return Bit i set where byte i is one of them.
+*/
+uint64_t lsh_simd_match(const __m128i *v, const char *set)
+{
+	uint64_t bits = 0;
+	__m128i any;
+	int i;
+	const char *c;
+
+	for (i = 0; i < 4; i++) {
+		any = _mm_setzero_si128();
+		for (c = set; *c != '\0'; c++) {
+			any = _mm_or_si128(any, _mm_cmpeq_epi8(v[i], _mm_set1_epi8(*c)));
+		}
+		bits |= (uint64_t)(uint16_t)_mm_movemask_epi8(any) << (16 * i);
+	}
+	return bits;
+}
+#endif
+
+/**
+@brief Classify the bytes of one 64-byte block.
+@param p The block.
+@param structural Characters that count as structural.
+@param m Filled with one bit per byte for each class.
+*/
+void lsh_scan_block(const char *p, const char *structural, struct lsh_masks *m)
+{
+#ifdef __SSE2__
+	__m128i v[4];
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		v[i] = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+	}
+	m->quote = lsh_simd_match(v, "\"");
+	m->backslash = lsh_simd_match(v, "\\");
+	m->structural = lsh_simd_match(v, structural);
+#else
+	uint64_t bit;
+	int i;
+
+	m->quote = m->backslash = m->structural = 0;
+	for (i = 0; i < 64; i++) {
+		bit = 1ULL << i;
+		if (p[i] == '"') {
+			m->quote |= bit;
+		}
+		else if (p[i] == '\\') {
+			m->backslash |= bit;
+		}
+		else if (p[i] != '\0' && strchr(structural, p[i]) != NULL) {
+			m->structural |= bit;
+		}
+	}
+#endif
+}
+
+/**
+@brief Find the characters escaped by a backslash, carrying odd runs of
+backslashes over from the previous block.
+@param backslash Backslash bits of the block.
+@param carry In: whether the block's first byte is escaped.  Out: the
+same for the next block.
+@return Bits of the escaped characters.
+*/
+uint64_t lsh_scan_escaped(uint64_t backslash, uint64_t *carry)
+{
+	const uint64_t even = 0x5555555555555555ULL;
+	uint64_t follows, odd_starts, sum, invert;
+
+	backslash &= ~*carry;
+	follows = backslash << 1 | *carry;
+	odd_starts = backslash & ~even & ~follows;
+	// Adding the odd starts to the runs clears runs that start on odd bits;
+	// the carry out is a run that continues into the next block.
+	*carry = __builtin_add_overflow(odd_starts, backslash, &sum);
+	invert = sum << 1;
+	return (even ^ invert) & follows;
+}
+
+/**
+@brief Prefix XOR: bit i of the result is the parity of bits 0..i.
+@param x The bits.
+@return The prefix XOR.
+*/
+uint64_t lsh_prefix_xor(uint64_t x)
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
+
+/**
+@brief Index a buffer: record the positions of structural characters and
+quotes outside strings, and which bytes are inside strings.
+@param s The index to fill.
+@param buf The buffer.
+@param len Its length (below 4 GiB).
+@param structural Characters that count as structural.
+@param csv Nonzero for CSV quoting (no backslash escapes; quotes are not
+recorded).
+*/
+void lsh_scan_index(struct lsh_scan *s, const char *buf, size_t len, const char *structural, int csv)
+{
+	uint64_t carry = 0, prev = 0, escaped, quote, instr, bits;
+	struct lsh_masks m;
+	char tail[64];
+	const char *p;
+	size_t off;
+
+	s->n = 0;
+	s->blocks = (len + 63) / 64;
+	s->instr = realloc(s->instr, (s->blocks ? s->blocks : 1) * sizeof(uint64_t));
+	if (!s->instr) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (off = 0; off < len; off += 64) {
+		p = buf + off;
+		if (len - off < 64) {
+			memset(tail, ' ', sizeof(tail));
+			memcpy(tail, p, len - off);
+			p = tail;
+		}
+		lsh_scan_block(p, structural, &m);
+		escaped = csv ? 0 : lsh_scan_escaped(m.backslash, &carry);
+		quote = m.quote & ~escaped;
+		instr = lsh_prefix_xor(quote) ^ prev;
+		prev = (uint64_t)((int64_t)instr >> 63);
+		s->instr[off / 64] = instr;
+
+		bits = m.structural & ~instr;
+		if (!csv) {
+			bits |= quote;
+		}
+		if (s->n + 64 > s->cap) {
+			s->cap = s->cap ? s->cap * 2 : 4096;
+			s->pos = realloc(s->pos, s->cap * sizeof(uint32_t));
+			if (!s->pos) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		while (bits != 0) {
+			s->pos[s->n++] = off + __builtin_ctzll(bits);
+			bits &= bits - 1;
+		}
+	}
+}
+
+/**
+@brief Skip whitespace.
+@param buf The buffer.
+@param p Position.
+@param end End of the record.
+@return Position of the next other byte, or end.
+*/
+size_t lsh_json_ws(const char *buf, size_t p, size_t end)
+{
+	while (p < end && (buf[p] == ' ' || buf[p] == '\t' || buf[p] == '\r' || buf[p] == '\n')) {
+		p++;
+	}
+	return p;
+}
+
+/**
+@brief Skip the string, object or array whose first structural is index k.
+@param buf The buffer.
+@param s The index.
+@param k The value's first structural.
+@param end Index the record ends at.
+@return Index of the first structural after the value.
+*/
+size_t lsh_json_skip(const char *buf, struct lsh_scan *s, size_t k, size_t end)
+{
+	int depth = 0;
+	char c;
+
+	if (buf[s->pos[k]] == '"') {
+		return k + 2 <= end ? k + 2 : end;
+	}
+	for (; k < end; k++) {
+		c = buf[s->pos[k]];
+		if (c == '{' || c == '[') {
+			depth++;
+		}
+		else if ((c == '}' || c == ']') && --depth == 0) {
+			return k + 1;
+		}
+	}
+	return end;
+}
+
+/**
+@brief Find the extent of the value starting at a position.
+@param buf The buffer.
+@param s The index.
+@param start Where the value starts (whitespace may come first).
+@param k In: the first structural at or after start.  Out: the first one
+after the value.
+@param end Index the record ends at.
+@param textend Where the record's text ends.
+@param len Where to store the value's length.
+@return Position of the value, or -1 if there is none.
+*/
+long lsh_json_value(const char *buf, struct lsh_scan *s, size_t start, size_t *k, size_t end,
+	size_t textend, size_t *len)
+{
+	size_t p = lsh_json_ws(buf, start, textend), e;
+
+	if (p >= textend) {
+		return -1;
+	}
+	if (buf[p] == '{' || buf[p] == '[' || buf[p] == '"') {
+		if (*k >= end || s->pos[*k] != p) {
+			return -1;
+		}
+		*k = lsh_json_skip(buf, s, *k, end);
+		*len = s->pos[*k - 1] + 1 - p;
+		return p;
+	}
+	// A scalar runs up to the next structural.
+	e = *k < end ? s->pos[*k] : textend;
+	if (buf[p] == ',' || buf[p] == '}' || buf[p] == ']' || buf[p] == ':') {
+		return -1;
+	}
+	while (e > p && (buf[e - 1] == ' ' || buf[e - 1] == '\t' || buf[e - 1] == '\r' || buf[e - 1] == '\n')) {
+		e--;
+	}
+	*len = e - p;
+	return p;
+}
+
+/**
+@brief Follow a path into one JSON record.
+@param x The extraction, with the path.
+@param buf The buffer.
+@param s The index.
+@param k The record's first structural.
+@param end Index the record ends at.
+@param start Where the record's text starts.
+@param textend Where it ends.
+@param len Where to store the value's length.
+@return Position of the value, or -1 if the path does not exist.
+*/
+long lsh_json_find(struct lsh_extract *x, const char *buf, struct lsh_scan *s, size_t k, size_t end,
+	size_t start, size_t textend, size_t *len)
+{
+	struct lsh_jstep *step;
+	size_t p, kstart, vk;
+	long i;
+	int found;
+
+	for (step = x->steps; step < x->steps + x->nsteps; step++) {
+		p = lsh_json_ws(buf, start, textend);
+		if (p >= textend || k >= end || s->pos[k] != p || buf[p] != (step->key ? '{' : '[')) {
+			return -1;
+		}
+		k++;
+		found = 0;
+		for (i = 0; k < end && !found; i++) {
+			if (step->key != NULL) {
+				// "key" : value
+				if (buf[s->pos[k]] != '"' || k + 2 >= end || buf[s->pos[k + 2]] != ':') {
+					return -1;
+				}
+				found = s->pos[k + 1] - s->pos[k] - 1 == step->keylen &&
+					memcmp(buf + s->pos[k] + 1, step->key, step->keylen) == 0;
+				start = s->pos[k + 2] + 1;
+				k += 3;
+			}
+			else {
+				start = s->pos[k - 1] + 1;
+				found = i == step->index;
+			}
+			if (found) {
+				break;
+			}
+			vk = k;
+			kstart = start;
+			if (lsh_json_value(buf, s, kstart, &vk, end, textend, len) < 0) {
+				return -1;
+			}
+			k = vk;
+			if (k >= end || buf[s->pos[k]] != ',') {
+				return -1;
+			}
+			k++;
+		}
+		if (!found) {
+			return -1;
+		}
+	}
+	return lsh_json_value(buf, s, start, &k, end, textend, len);
+}
+
+/**
+@brief Write a JSON string's contents without quotes or escapes.
+@param out The sink.
+@param p The string, quotes included.
+@param len Its length.
+@return 0 on success, -1 on error.
+*/
+int lsh_json_unescape(struct lsh_sink *out, const char *p, size_t len)
+{
+	const char *end = p + len - 1, *run;
+	unsigned long cp, lo;
+	char utf[4];
+	int n, err = 0;
+
+	for (p++; p < end && err == 0; ) {
+		for (run = p; p < end && *p != '\\'; p++) {
+		}
+		err = lsh_sink_write(out, run, p - run);
+		if (p + 1 >= end || err != 0) {
+			break;
+		}
+		p++;
+		switch (*p++) {
+		case 'n': err = lsh_sink_write(out, "\n", 1); break;
+		case 't': err = lsh_sink_write(out, "\t", 1); break;
+		case 'r': err = lsh_sink_write(out, "\r", 1); break;
+		case 'b': err = lsh_sink_write(out, "\b", 1); break;
+		case 'f': err = lsh_sink_write(out, "\f", 1); break;
+		case 'u':
+			if (end - p < 4) {
+				return lsh_sink_write(out, "?", 1);
+			}
+			cp = strtoul((char [5]){ p[0], p[1], p[2], p[3], '\0' }, NULL, 16);
+			p += 4;
+			if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+				lo = strtoul((char [5]){ p[2], p[3], p[4], p[5], '\0' }, NULL, 16);
+				if (lo >= 0xDC00 && lo < 0xE000) {
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+					p += 6;
+				}
+			}
+			if (cp < 0x80) {
+				utf[0] = cp;
+				n = 1;
+			}
+			else if (cp < 0x800) {
+				utf[0] = 0xC0 | (cp >> 6);
+				utf[1] = 0x80 | (cp & 0x3F);
+				n = 2;
+			}
+			else if (cp < 0x10000) {
+				utf[0] = 0xE0 | (cp >> 12);
+				utf[1] = 0x80 | ((cp >> 6) & 0x3F);
+				utf[2] = 0x80 | (cp & 0x3F);
+				n = 3;
+			}
+			else {
+				utf[0] = 0xF0 | (cp >> 18);
+				utf[1] = 0x80 | ((cp >> 12) & 0x3F);
+				utf[2] = 0x80 | ((cp >> 6) & 0x3F);
+				utf[3] = 0x80 | (cp & 0x3F);
+				n = 4;
+			}
+			err = lsh_sink_write(out, utf, n);
+			break;
+		default:
+			// \" \\ \/ stand for themselves.
+			err = lsh_sink_write(out, p - 1, 1);
+			break;
+		}
+	}
+	return err;
+}
+
+/**
+@brief Write part of the buffer without the whitespace outside strings.
+@param out The sink.
+@param buf The buffer.
+@param s The index, for which bytes are inside strings.
+@param p Start.
+@param len Length.
+@return 0 on success, -1 on error.
+*/
+int lsh_json_compact(struct lsh_sink *out, const char *buf, struct lsh_scan *s, size_t p, size_t len)
+{
+	size_t end = p + len, run;
+	int err = 0;
+	char c;
+
+	while (p < end && err == 0) {
+		for (run = p; p < end; p++) {
+			c = buf[p];
+			if ((c == ' ' || c == '\t' || c == '\r' || c == '\n') && !(s->instr[p / 64] >> (p % 64) & 1)) {
+				break;
+			}
+		}
+		err = lsh_sink_write(out, buf + run, p - run);
+		p++;
+	}
+	return err;
+}
+
+/**
+@brief Write one extracted JSON value and a newline.
+@param x The extraction.
+@param out The sink.
+@param buf The buffer.
+@param at The value, or -1 for a missing one.
+@param len Its length.
+@return 0 on success, -1 on error.
+*/
+int lsh_json_emit(struct lsh_extract *x, struct lsh_sink *out, const char *buf, long at, size_t len)
+{
+	int err;
+
+	if (at < 0) {
+		err = lsh_sink_write(out, "null", 4);
+	}
+	else if (x->raw && buf[at] == '"') {
+		err = lsh_json_unescape(out, buf + at, len);
+	}
+	else {
+		err = lsh_sink_write(out, buf + at, len);
+	}
+	return err || lsh_sink_write(out, "\n", 1);
+}
+
+/**
+@brief Write the selected fields of one CSV record.
+@param x The extraction.
+@param out The sink.
+@param buf The buffer.
+@param field Start of each field, plus one past the end of the last (at
+the separator or newline).
+@param nfields Number of fields.
+@param cols Fields to write, 0-based.
+@param ncols How many.
+@return 0 on success, -1 on error.
+*/
+int lsh_csv_emit(struct lsh_sink *out, const char *buf, const size_t *field, int nfields, const int *cols, int ncols)
+{
+	size_t start, end;
+	int i, err = 0;
+
+	for (i = 0; i < ncols && err == 0; i++) {
+		if (i > 0) {
+			err = lsh_sink_write(out, ",", 1);
+		}
+		if (cols[i] < nfields) {
+			start = field[cols[i]];
+			end = field[cols[i] + 1] - 1;
+			if (cols[i] + 1 == nfields && end > start && buf[end - 1] == '\r') {
+				end--;
+			}
+			err = err || lsh_sink_write(out, buf + start, end - start);
+		}
+	}
+	return err || lsh_sink_write(out, "\n", 1);
+}
+
+/**
+@brief Turn a csv column spec into field numbers, using the header record
+for names.
+@param x The extraction.
+@param buf The buffer.
+@param field The header's fields, as for lsh_csv_emit.
+@param nfields Number of header fields (0 if the spec has no names).
+@param cols Filled with 0-based field numbers.
+@return Number of columns, or -1 if a name is not in the header.
+*/
+int lsh_csv_columns(struct lsh_extract *x, const char *buf, const size_t *field, int nfields, int *cols)
+{
+	long first, last;
+	char *end;
+	size_t len, flen;
+	int i, j, n = 0;
+
+	for (i = 0; i < x->nspec; i++) {
+		first = strtol(x->spec[i], &end, 10);
+		last = *end == '-' ? strtol(end + 1, &end, 10) : first;
+		if (*end == '\0' && first >= 1 && last >= first) {
+			for (; first <= last && n < 256; first++) {
+				cols[n++] = first - 1;
+			}
+			continue;
+		}
+		len = strlen(x->spec[i]);
+		for (j = 0; j < nfields; j++) {
+			// The last field ends at the newline; drop a CR before it,
+			// but an empty field has no byte to look at.
+			flen = field[j + 1] - 1 - field[j];
+			if (j + 1 == nfields && flen > 0 && buf[field[j + 1] - 2] == '\r') {
+				flen--;
+			}
+			if (flen == len && memcmp(buf + field[j], x->spec[i], len) == 0) {
+				break;
+			}
+		}
+		if (j == nfields) {
+			fprintf(stderr, "lsh: csv: no column \"%s\"\n", x->spec[i]);
+			return -1;
+		}
+		if (n < 256) {
+			cols[n++] = j;
+		}
+	}
+	return n;
+}
+
+/*
+Per-input state: the index, and for csv the resolved columns.
+*/
+struct lsh_ex_input {
+	struct lsh_scan scan;
+	int cols[256];
+	int ncols;
+	int header;
+	size_t *field;
+	int fieldcap;
+};
+
+/**
+@brief Extract from a buffer of whole records (newline-delimited JSON, or
+CSV lines).
+@param x The extraction.
+@param in The input's state.
+@param buf The buffer.
+@param len Its length.
+@param out The sink.
+@return 0 on success, -1 on error.
+*/
+int lsh_extract_records(struct lsh_extract *x, struct lsh_ex_input *in, const char *buf, size_t len,
+	struct lsh_sink *out)
+{
+	struct lsh_scan *s = &in->scan;
+	size_t k = 0, end, start = 0, textend, vlen;
+	int nfields, err = 0;
+	long at;
+
+	lsh_scan_index(s, buf, len, x->mode == LSH_EX_CSV ? ",\n" : "{}[]:,\n", x->mode == LSH_EX_CSV);
+	while (start < len && err == 0) {
+		for (end = k; end < s->n && buf[s->pos[end]] != '\n'; end++) {
+		}
+		textend = end < s->n ? s->pos[end] : len;
+
+		if (x->mode == LSH_EX_GET) {
+			if (lsh_json_ws(buf, start, textend) < textend) {
+				at = lsh_json_find(x, buf, s, k, end, start, textend, &vlen);
+				err = lsh_json_emit(x, out, buf, at, vlen);
+			}
+		}
+		else {
+			// Field boundaries: the record start, then one past each comma.
+			nfields = 1 + end - k;
+			if (nfields + 1 > in->fieldcap) {
+				in->fieldcap = (nfields + 1) * 2;
+				in->field = realloc(in->field, in->fieldcap * sizeof(size_t));
+				if (!in->field) {
+					fprintf(stderr, "lsh: allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			in->field[0] = start;
+			for (vlen = k; vlen < end; vlen++) {
+				in->field[vlen - k + 1] = s->pos[vlen] + 1;
+			}
+			in->field[nfields] = textend + 1;
+			if (!in->header) {
+				in->header = 1;
+				in->ncols = lsh_csv_columns(x, buf, in->field, x->named ? nfields : 0, in->cols);
+				if (in->ncols < 0) {
+					return -1;
+				}
+			}
+			if (textend > start) {
+				err = lsh_csv_emit(out, buf, in->field, nfields, in->cols, in->ncols);
+			}
+		}
+		start = textend + 1;
+		k = end + 1;
+	}
+	return err;
+}
+
+/**
+@brief Split a whole JSON document into one compact value per line: the
+elements of a top-level array, or each top-level object or string.
+@param in The input's state.
+@param buf The document.
+@param len Its length.
+@param out The sink.
+@return 0 on success, -1 on error.
+*/
+int lsh_extract_lines(struct lsh_ex_input *in, const char *buf, size_t len, struct lsh_sink *out)
+{
+	struct lsh_scan *s = &in->scan;
+	size_t k = 0, e, start, vlen;
+	int err = 0;
+	long at;
+	char c;
+
+	lsh_scan_index(s, buf, len, "{}[]:,", 0);
+	while (k < s->n && err == 0) {
+		c = buf[s->pos[k]];
+		if (c == '[') {
+			start = s->pos[k++] + 1;
+			while (err == 0) {
+				at = lsh_json_value(buf, s, start, &k, s->n, len, &vlen);
+				if (at >= 0) {
+					err = lsh_json_compact(out, buf, s, at, vlen) || lsh_sink_write(out, "\n", 1);
+				}
+				if (k >= s->n || buf[s->pos[k]] != ',') {
+					break;
+				}
+				start = s->pos[k++] + 1;
+			}
+			// Past the closing bracket.
+			k++;
+		}
+		else if (c == '{' || c == '"') {
+			e = lsh_json_skip(buf, s, k, s->n);
+			err = lsh_json_compact(out, buf, s, s->pos[k], s->pos[e - 1] + 1 - s->pos[k]) ||
+				lsh_sink_write(out, "\n", 1);
+			k = e;
+		}
+		else {
+			fprintf(stderr, "lsh: json: unexpected \"%c\" at offset %u\n", c, s->pos[k]);
+			return -1;
+		}
+	}
+	return err;
+}
+
+/**
+@brief Extract from a stream, in blocks of whole lines (or all of it for
+json lines).
+@param x The extraction.
+@param in The input's state.
+@param r The reader.
+@param out The sink.
+@return 0 on success, -1 on error.
+*/
+int lsh_extract_stream(struct lsh_extract *x, struct lsh_ex_input *in, struct lsh_reader *r, struct lsh_sink *out)
+{
+	const char *p, *nl;
+	size_t len;
+	int eof = 0, err = 0;
+
+	while (!eof && err == 0) {
+		eof = lsh_reader_fill(r) <= 0;
+		p = r->buf + r->pos;
+		len = r->len - r->pos;
+		if (x->mode == LSH_EX_LINES) {
+			if (eof) {
+				err = lsh_extract_lines(in, p, len, out);
+			}
+			continue;
+		}
+		if (!eof) {
+			nl = memrchr(p, '\n', len);
+			len = nl ? nl - p + 1 : 0;
+		}
+		if (len > 0) {
+			err = lsh_extract_records(x, in, p, len, out);
+			r->pos += len;
+		}
+	}
+	return err;
+}
+
+/**
+@brief Extract from a mapped file, a chunk of whole lines at a time so the
+index stays small (json lines indexes the whole document).
+@param x The extraction.
+@param in The input's state.
+@param buf The mapping.
+@param len Its length.
+@param out The sink.
+@return 0 on success, -1 on error.
+*/
+int lsh_extract_mapped(struct lsh_extract *x, struct lsh_ex_input *in, const char *buf, size_t len,
+	struct lsh_sink *out)
+{
+	const char *nl;
+	size_t off, end;
+	int err = 0;
+
+	if (x->mode == LSH_EX_LINES) {
+		return lsh_extract_lines(in, buf, len, out);
+	}
+	for (off = 0; off < len && err == 0; off = end) {
+		end = len - off > LSH_EX_CHUNK ? off + LSH_EX_CHUNK : len;
+		if (end < len) {
+			nl = memrchr(buf + off, '\n', end - off);
+			if (nl == NULL) {
+				nl = memchr(buf + end, '\n', len - end);
+			}
+			end = nl ? (size_t)(nl - buf) + 1 : len;
+		}
+		err = lsh_extract_records(x, in, buf + off, end - off, out);
+	}
+	return err;
+}
+
+/**
+@brief Extract from one named input ("-" is standard input).
+@param x The extraction.
+@param name The input.
+@param out The sink.
+@return 0 on success, -1 on error (reported).
+*/
+int lsh_extract_input(struct lsh_extract *x, const char *name, struct lsh_sink *out)
+{
+	struct lsh_ex_input in;
+	struct lsh_reader file, *r;
+	void *data;
+	size_t len;
+	int err;
+
+	memset(&in, 0, sizeof(in));
+	data = strcmp(name, "-") == 0 ? NULL : lsh_map_file(name, &len, &err);
+	if (data != NULL) {
+		err = lsh_extract_mapped(x, &in, data, len, out);
+		munmap(data, len);
+	}
+	else if (strcmp(name, "-") != 0 && err != EINVAL) {
+		// Empty (err 0) or unreadable.
+		if (err != 0) {
+			fprintf(stderr, "lsh: %s: %s\n", name, strerror(err));
+		}
+		err = err ? -1 : 0;
+	}
+	else if ((r = lsh_reader_open(name, &file)) == NULL) {
+		fprintf(stderr, "lsh: %s: %s\n", name, strerror(errno));
+		err = -1;
+	}
+	else {
+		// Pipes and other files that cannot be mapped.
+		err = lsh_extract_stream(x, &in, r, out);
+		lsh_reader_close(r);
+	}
+	free(in.scan.pos);
+	free(in.scan.instr);
+	free(in.field);
+	return err;
+}
+
+struct lsh_ex_job {
+	const char *name;
+	struct lsh_sink out;
+	int err;
+};
+
+struct lsh_ex_pool {
+	struct lsh_extract *x;
+	struct lsh_ex_job *jobs;
+	int njobs;
+	int next;
+	pthread_mutex_t lock;
+};
+
+/**
+@brief Worker thread: extract from inputs until none are left.
+@param arg The struct lsh_ex_pool.
+@return NULL.
+*/
+void *lsh_ex_worker(void *arg)
+{
+	struct lsh_ex_pool *pool = arg;
+	struct lsh_ex_job *job;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		job = pool->next < pool->njobs ? &pool->jobs[pool->next++] : NULL;
+		pthread_mutex_unlock(&pool->lock);
+		if (job == NULL) {
+			return NULL;
+		}
+		job->err = lsh_extract_input(pool->x, job->name, &job->out);
+	}
+}
+
+/**
+@brief Run an extraction over its inputs: one at a time straight to the
+output, or several in parallel, collected and written in order.
+@param x The extraction.
+@param names The inputs.
+@return 0 if all succeeded, -1 otherwise.
+*/
+int lsh_extract_run(struct lsh_extract *x, char **names)
+{
+	struct lsh_ex_pool pool;
+	struct lsh_sink direct = { 1, NULL, 0, 0 };
+	pthread_t *threads;
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, started = 0, err = 0;
+
+	for (pool.njobs = 0; names[pool.njobs] != NULL; pool.njobs++) {
+	}
+	if (pool.njobs == 1 || nthreads < 2) {
+		for (i = 0; i < pool.njobs; i++) {
+			err |= lsh_extract_input(x, names[i], &direct);
+		}
+		return err;
+	}
+
+	pool.x = x;
+	pool.next = 0;
+	pool.jobs = calloc(pool.njobs, sizeof(struct lsh_ex_job));
+	threads = malloc(sizeof(pthread_t) * nthreads);
+	if (!pool.jobs || !threads) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < pool.njobs; i++) {
+		pool.jobs[i].name = names[i];
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	// The calling thread works too.
+	for (i = 1; i < nthreads && i < pool.njobs; i++) {
+		if (pthread_create(&threads[started], NULL, lsh_ex_worker, &pool) == 0) {
+			started++;
+		}
+	}
+	lsh_ex_worker(&pool);
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&pool.lock);
+	for (i = 0; i < pool.njobs; i++) {
+		if (err == 0 || !(errno == EPIPE || errno == EINTR)) {
+			err |= lsh_out_write(pool.jobs[i].out.buf, pool.jobs[i].out.len);
+		}
+		err |= pool.jobs[i].err;
+		free(pool.jobs[i].out.buf);
+	}
+	free(pool.jobs);
+	free(threads);
+	return err;
+}
+
+/**
+@brief Parse a jq-style path: ".a.b[2]", "a.b", or "." for the whole value.
+@param x The extraction to fill.
+@param path The path.
+@return 0 on success, -1 if invalid.
+*/
+int lsh_json_path(struct lsh_extract *x, char *path)
+{
+	char *p = path, *end;
+
+	x->nsteps = 0;
+	while (*p != '\0') {
+		if (x->nsteps == LSH_EX_MAXSTEPS) {
+			return -1;
+		}
+		if (*p == '.') {
+			p++;
+			continue;
+		}
+		if (*p == '[') {
+			x->steps[x->nsteps].key = NULL;
+			x->steps[x->nsteps].index = strtol(p + 1, &end, 10);
+			if (end == p + 1 || *end != ']' || x->steps[x->nsteps].index < 0) {
+				return -1;
+			}
+			p = end + 1;
+		}
+		else {
+			x->steps[x->nsteps].key = p;
+			p += strcspn(p, ".[");
+			x->steps[x->nsteps].keylen = p - x->steps[x->nsteps].key;
+		}
+		x->nsteps++;
+	}
+	return 0;
+}
+
+/**
+@brief Bultin command: extract from newline-delimited JSON.
+@param args List of args.  args[0] is "json".  Then "get [-r] path" (one
+value per record, "null" if missing; -r writes strings raw) or "lines"
+(split a document into one compact value per line), then files ("-" or
+none for standard input).
+@return Always returns 1, to continue executing.
+*/
+int lsh_json(char **args)
+{
+	struct lsh_extract x;
+	char *dash[] = { "-", NULL };
+	int i = 2;
+
+	memset(&x, 0, sizeof(x));
+	if (args[1] != NULL && strcmp(args[1], "get") == 0) {
+		x.mode = LSH_EX_GET;
+		if (args[i] != NULL && strcmp(args[i], "-r") == 0) {
+			x.raw = 1;
+			i++;
+		}
+		if (args[i] == NULL || lsh_json_path(&x, args[i]) != 0) {
+			fprintf(stderr, "lsh: json: bad path \"%s\"\n", args[i] ? args[i] : "");
+			lsh_last_status = 2;
+			return 1;
+		}
+		i++;
+	}
+	else if (args[1] != NULL && strcmp(args[1], "lines") == 0) {
+		x.mode = LSH_EX_LINES;
+	}
+	else {
+		fprintf(stderr, "lsh: usage: json get [-r] path [file...] | json lines [file...]\n");
+		lsh_last_status = 2;
+		return 1;
+	}
+	if (lsh_extract_run(&x, args[i] != NULL ? args + i : dash) != 0) {
+		lsh_last_status = 1;
+	}
+	if (lsh_out_flush() != 0 && errno != EPIPE && errno != EINTR) {
+		perror("lsh: json");
+	}
+	return 1;
+}
+
+/**
+@brief Bultin command: select CSV columns.
+@param args List of args.  args[0] is "csv", args[1] is "cols", args[2] a
+comma-separated list of 1-based numbers, ranges ("2-4") or header names,
+then files ("-" or none for standard input).
+@return Always returns 1, to continue executing.
+*/
+int lsh_csv(char **args)
+{
+	struct lsh_extract x;
+	char *dash[] = { "-", NULL };
+	char *spec[256], *list, *tok, *save;
+	char *end;
+
+	memset(&x, 0, sizeof(x));
+	if (args[1] == NULL || strcmp(args[1], "cols") != 0 || args[2] == NULL) {
+		fprintf(stderr, "lsh: usage: csv cols list [file...]\n");
+		lsh_last_status = 2;
+		return 1;
+	}
+	list = strdup(args[2]);
+	if (!list) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	x.mode = LSH_EX_CSV;
+	x.spec = spec;
+	for (tok = strtok_r(list, ",", &save); tok != NULL && x.nspec < 256; tok = strtok_r(NULL, ",", &save)) {
+		spec[x.nspec++] = tok;
+		strtol(tok, &end, 10);
+		if (end == tok || (*end != '\0' && *end != '-')) {
+			x.named = 1;
+		}
+	}
+	if (lsh_extract_run(&x, args[3] != NULL ? args + 3 : dash) != 0) {
+		lsh_last_status = 1;
+	}
+	if (lsh_out_flush() != 0 && errno != EPIPE && errno != EINTR) {
+		perror("lsh: csv");
+	}
+	free(list);
+	return 1;
+}
+
+/*
+Result cache.  A key is the SHA-256 of everything the command's output may
+depend on: its argv, the program it resolves to, the working directory,
+selected environment variables and fingerprints of declared input files.
+Outputs are stored once under their own SHA-256 in objects/, and keys/
+maps a key to "status stdout-hash stderr-hash".
+*/
+struct lsh_cache_key {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+/**
+@brief Append bytes (and a separator) to the material a cache key is
+hashed from.
+@param k The key.
+@param data Bytes to add.
+@param len Number of bytes.
+*/
+void lsh_cache_add(struct lsh_cache_key *k, const void *data, size_t len)
+{
+	if (k->len + len + 1 > k->cap) {
+		k->cap = (k->len + len + 1) * 2;
+		k->data = realloc(k->data, k->cap);
+		if (!k->data) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(k->data + k->len, data, len);
+	k->len += len;
+	k->data[k->len++] = '\0';
+}
+
+/**
+@brief Add a file's fingerprint to a cache key: its contents' digest, or
+its identity, size and modification time.
+@param k The key.
+@param name The file.
+@param content Nonzero to hash the contents.
+@return 0 on success, -1 with errno set if the file cannot be read.
+*/
+int lsh_cache_add_file(struct lsh_cache_key *k, const char *name, int content)
+{
+	unsigned char digest[32];
+	char buf[128];
+	struct stat st;
+	size_t len;
+	void *data;
+	int err;
+
+	lsh_cache_add(k, name, strlen(name));
+	if (content) {
+		data = lsh_map_file(name, &len, &err);
+		if (err != 0) {
+			errno = err;
+			return -1;
+		}
+		lsh_sha256(data ? data : "", len, digest);
+		if (data) {
+			munmap(data, len);
+		}
+		lsh_cache_add(k, digest, sizeof(digest));
+		return 0;
+	}
+	if (stat(name, &st) != 0) {
+		return -1;
+	}
+	snprintf(buf, sizeof(buf), "%llu %llu %lld %lld.%09ld",
+		(unsigned long long) st.st_dev, (unsigned long long) st.st_ino,
+		(long long) st.st_size, (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+	lsh_cache_add(k, buf, strlen(buf));
+	return 0;
+}
+
+/**
+@brief Find (and optionally create) the cache store directory.
+@param buf Buffer for the path.
+@param size Size of buf.
+@param create Nonzero to create the directory and its subdirectories.
+@return 0 on success, -1 with errno set on failure.
+*/
+int lsh_cache_dir(char *buf, size_t size, int create)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *sub[] = { "", "/objects", "/keys" };
+	char path[4096];
+	char *p;
+	int i;
+
+	if (base != NULL && base[0] != '\0') {
+		snprintf(buf, size, "%s/aash", base);
+	}
+	else if ((base = getenv("HOME")) != NULL) {
+		snprintf(buf, size, "%s/.cache/aash", base);
+	}
+	else {
+		errno = ENOENT;
+		return -1;
+	}
+	if (!create) {
+		return 0;
+	}
+	for (p = buf + 1; *p != '\0'; p++) {
+		if (*p == '/') {
+			*p = '\0';
+			mkdir(buf, 0700);
+			*p = '/';
+		}
+	}
+	for (i = 0; i < 3; i++) {
+		snprintf(path, sizeof(path), "%s%s", buf, sub[i]);
+		if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+@brief Copy a file to a file descriptor.
+@param name The file.
+@param out The descriptor.
+@return 0 on success, -1 on failure.
+*/
+int lsh_cat_file(const char *name, int out)
+{
+	char buf[65536];
+	ssize_t n, w, off;
+	int fd;
+
+	if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+		return -1;
+	}
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < n; off += w) {
+			w = write(out, buf + off, n - off);
+			if (w < 0 && errno == EINTR) {
+				w = 0;
+			}
+			else if (w < 0) {
+				close(fd);
+				return -1;
+			}
+		}
+	}
+	close(fd);
+	return n < 0 ? -1 : 0;
+}
+
+/**
+@brief Move a captured output file into the object store under its digest.
+@param dir The store directory.
+@param tmp The captured file; it is renamed or removed.
+@param hex Filled with the object's name.
+@return 0 on success, -1 with errno set on failure.
+*/
+int lsh_cache_store(const char *dir, const char *tmp, char *hex)
+{
+	unsigned char digest[32];
+	char path[4200];
+	size_t len;
+	void *data;
+	int err;
+
+	data = lsh_map_file(tmp, &len, &err);
+	if (err != 0) {
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	lsh_sha256(data ? data : "", len, digest);
+	if (data) {
+		munmap(data, len);
+	}
+	lsh_hex(digest, sizeof(digest), hex);
+	snprintf(path, sizeof(path), "%s/objects/%s", dir, hex);
+	if (rename(tmp, path) != 0) {
+		err = errno;
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+@brief Bultin command: run a command, or replay its stored result.
+@param args List of args.  args[0] is "cache".  Then [--content] [--env
+NAME]... [--inputs file... --] cmd...  The command runs (with its output
+captured) only if no result is stored for the same key; results of commands
+killed by a signal are not stored.
+@return Always returns 1, to continue executing.
+*/
+int lsh_cache(char **args)
+{
+	struct lsh_cache_key key = { NULL, 0, 0 };
+	unsigned char digest[32];
+	char dir[4096], keyhex[65], outhex[65], errhex[65], path[4200], tmp[2][4200], cwd[4096];
+	const char *prog, *value;
+	struct stat st;
+	FILE *f;
+	int i = 1, j, content = 0, status, fds[2], id;
+	pid_t pid;
+
+	while (args[i] != NULL && args[i][0] == '-') {
+		if (strcmp(args[i], "--content") == 0) {
+			content = 1;
+			i++;
+		}
+		else if (strcmp(args[i], "--env") == 0 && args[i + 1] != NULL) {
+			value = getenv(args[i + 1]);
+			lsh_cache_add(&key, "env", 3);
+			lsh_cache_add(&key, args[i + 1], strlen(args[i + 1]));
+			lsh_cache_add(&key, value ? value : "", value ? strlen(value) + 1 : 0);
+			i += 2;
+		}
+		else if (strcmp(args[i], "--inputs") == 0) {
+			for (i++; args[i] != NULL && strcmp(args[i], "--") != 0; i++) {
+				if (lsh_cache_add_file(&key, args[i], content) != 0) {
+					fprintf(stderr, "lsh: cache: %s: %s\n", args[i], strerror(errno));
+					free(key.data);
+					return 1;
+				}
+			}
+			if (args[i] != NULL) {
+				i++;
+			}
+		}
+		else {
+			break;
+		}
+	}
+	if (args[i] == NULL) {
+		fprintf(stderr, "lsh: usage: cache [--content] [--env name]... [--inputs file... --] cmd...\n");
+		free(key.data);
+		return 1;
+	}
+	if (lsh_background) {
+		fprintf(stderr, "lsh: cache: cannot run in the background\n");
+		free(key.data);
+		return 1;
+	}
+	if (lsh_cache_dir(dir, sizeof(dir), 1) != 0) {
+		fprintf(stderr, "lsh: cache: no cache directory: %s\n", strerror(errno));
+		free(key.data);
+		return 1;
+	}
+
+	// The rest of the key: what runs, where, with which arguments.
+	if ((prog = lsh_path_lookup(args[i])) != NULL && stat(prog, &st) == 0) {
+		lsh_cache_add_file(&key, prog, 0);
+	}
+	if (getcwd(cwd, sizeof(cwd)) != NULL) {
+		lsh_cache_add(&key, cwd, strlen(cwd));
+	}
+	for (j = i; args[j] != NULL; j++) {
+		lsh_cache_add(&key, args[j], strlen(args[j]));
+	}
+	lsh_sha256(key.data, key.len, digest);
+	free(key.data);
+	lsh_hex(digest, sizeof(digest), keyhex);
+
+	snprintf(path, sizeof(path), "%s/keys/%s", dir, keyhex);
+	if ((f = fopen(path, "r")) != NULL) {
+		j = fscanf(f, "%d %64s %64s", &status, outhex, errhex);
+		fclose(f);
+		if (j == 3) {
+			lsh_out_flush();
+			snprintf(tmp[0], sizeof(tmp[0]), "%s/objects/%s", dir, outhex);
+			snprintf(tmp[1], sizeof(tmp[1]), "%s/objects/%s", dir, errhex);
+			if (lsh_cat_file(tmp[0], STDOUT_FILENO) == 0 && lsh_cat_file(tmp[1], STDERR_FILENO) == 0) {
+				lsh_last_status = status;
+				return 1;
+			}
+			// An object went missing: run the command again.
+		}
+	}
+
+	for (j = 0; j < 2; j++) {
+		snprintf(tmp[j], sizeof(tmp[j]), "%s/tmp.XXXXXX", dir);
+		if ((fds[j] = mkostemp(tmp[j], O_CLOEXEC)) < 0) {
+			perror("lsh");
+			if (j == 1) {
+				close(fds[0]);
+				unlink(tmp[0]);
+			}
+			return 1;
+		}
+	}
+	pid = lsh_spawn_fds(args + i, -1, fds[0], fds[1]);
+	close(fds[0]);
+	close(fds[1]);
+	if (pid < 0) {
+		perror("lsh");
+		unlink(tmp[0]);
+		unlink(tmp[1]);
+		return 1;
+	}
+	id = lsh_job_add(pid);
+	lsh_job_foreground(id);
+	lsh_job_wait(id);
+	lsh_last_status = status = lsh_job_reap(id);
+
+	lsh_out_flush();
+	lsh_cat_file(tmp[0], STDOUT_FILENO);
+	lsh_cat_file(tmp[1], STDERR_FILENO);
+	if (status >= 128 || lsh_interrupted) {
+		unlink(tmp[0]);
+		unlink(tmp[1]);
+		return 1;
+	}
+	if (lsh_cache_store(dir, tmp[0], outhex) != 0) {
+		unlink(tmp[1]);
+		return 1;
+	}
+	if (lsh_cache_store(dir, tmp[1], errhex) != 0) {
+		return 1;
+	}
+
+	// Publish the key last, atomically, so readers never see a partial entry.
+	snprintf(tmp[0], sizeof(tmp[0]), "%s/tmp.XXXXXX", dir);
+	if ((fds[0] = mkostemp(tmp[0], O_CLOEXEC)) < 0) {
+		return 1;
+	}
+	if ((f = fdopen(fds[0], "w")) == NULL) {
+		close(fds[0]);
+		unlink(tmp[0]);
+		return 1;
+	}
+	fprintf(f, "%d %s %s\n", status, outhex, errhex);
+	if (fclose(f) != 0 || rename(tmp[0], path) != 0) {
+		unlink(tmp[0]);
+	}
+	return 1;
+}
+
+/**
+@brief Compute how many bytes of arguments one exec may carry: ARG_MAX less
+the environment and some headroom, as POSIX xargs does.
+@return The argument byte budget.
+*/
+long lsh_arg_budget(void)
+{
+	extern char **environ;
+	long budget = sysconf(_SC_ARG_MAX);
+	char **e;
+
+	if (budget <= 0) {
+		budget = 131072;
+	}
+	for (e = environ; *e != NULL; e++) {
+		budget -= strlen(*e) + 1 + sizeof(char *);
+	}
+	return budget - 2048;
+}
+
+/*
+State of one xargs run: the argv being built and the running commands.
+*/
+struct lsh_xargs_state {
+	char **argv;
+	int argc;
+	int fixed;
+	int cap;
+	long size;
+	// Ids of the commands running; other stages of the pipeline are
+	// jobs too, and not ours to reap.
+	int *jobs;
+	int running;
+	int maxprocs;
+	int failed;
+};
+
+/**
+@brief Wait for one xargs command and record its status.
+@param st The xargs state.
+*/
+void lsh_xargs_wait(struct lsh_xargs_state *st)
+{
+	int i;
+
+	while (1) {
+		for (i = 0; i < st->running; i++) {
+			if (lsh_jobs[st->jobs[i]].done) {
+				if (lsh_job_reap(st->jobs[i]) != 0) {
+					st->failed = 1;
+				}
+				st->jobs[i] = st->jobs[--st->running];
+				return;
+			}
+		}
+		lsh_event_wait(-1);
+	}
+}
+
+/**
+@brief Run the command built so far, keeping at most maxprocs running.
+@param st The xargs state.
+*/
+void lsh_xargs_flush(struct lsh_xargs_state *st)
+{
+	pid_t pid;
+	int i;
+
+	if (st->argc == st->fixed) {
+		return;
+	}
+	while (st->running >= st->maxprocs) {
+		lsh_xargs_wait(st);
+	}
+	st->argv[st->argc] = NULL;
+	pid = lsh_spawn(st->argv);
+	if (pid > 0) {
+		st->jobs[st->running++] = lsh_job_add(pid);
+	}
+	else {
+		perror("lsh");
+		st->failed = 1;
+	}
+	for (i = st->fixed; i < st->argc; i++) {
+		free(st->argv[i]);
+	}
+	st->argc = st->fixed;
+}
+
+/**
+@brief Append one argument, growing argv as needed.
+@param st The xargs state.
+@param arg The argument (ownership passes to st).
+*/
+void lsh_xargs_push(struct lsh_xargs_state *st, char *arg)
+{
+	if (st->argc + 2 > st->cap) {
+		st->cap = st->cap ? st->cap * 2 : 64;
+		st->argv = realloc(st->argv, st->cap * sizeof(char *));
+		if (!st->argv) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	st->argv[st->argc++] = arg;
+}
+
+/**
+@brief Replace every occurrence of repl in a template argument.
+@param tmpl The template.
+@param repl The replace string.
+@param item The input item.
+@return Newly allocated result.
+*/
+char *lsh_xargs_subst(const char *tmpl, const char *repl, const char *item)
+{
+	size_t rlen = strlen(repl), ilen = strlen(item), n = 0;
+	const char *p;
+	char *out, *o;
+
+	for (p = strstr(tmpl, repl); p != NULL; p = strstr(p + rlen, repl)) {
+		n++;
+	}
+	out = malloc(strlen(tmpl) + n * ilen + 1);
+	if (!out) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (o = out; (p = strstr(tmpl, repl)) != NULL; tmpl = p + rlen) {
+		memcpy(o, tmpl, p - tmpl);
+		o += p - tmpl;
+		memcpy(o, item, ilen);
+		o += ilen;
+	}
+	strcpy(o, tmpl);
+	return out;
+}
+
+/**
+@brief Bultin command: build and run command lines from standard input.
+@param args List of args.  args[0] is "xargs".  Options are -n max-args,
+-P max-procs, -0 and -I replace-str, followed by the command (default echo).
+@return Always returns 1, to continue executing.
+*/
+int lsh_xargs(char **args)
+{
+	static char *echo_args[] = { "echo", NULL };
+	struct lsh_xargs_state st;
+	char **cmd, *rec, *item, *repl = NULL;
+	int i = 1, maxargs = 0, nul = 0;
+	long budget = lsh_arg_budget(), cost;
+	size_t len;
+
+	memset(&st, 0, sizeof(st));
+	st.maxprocs = 1;
+	for (; args[i] != NULL && args[i][0] == '-'; i++) {
+		if (strcmp(args[i], "-0") == 0) {
+			nul = 1;
+		}
+		else if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL) {
+			maxargs = atoi(args[++i]);
+		}
+		else if (strcmp(args[i], "-P") == 0 && args[i + 1] != NULL) {
+			st.maxprocs = atoi(args[++i]);
+		}
+		else if (strncmp(args[i], "-I", 2) == 0 && (args[i][2] != '\0' || args[i + 1] != NULL)) {
+			repl = args[i][2] != '\0' ? args[i] + 2 : args[++i];
+		}
+		else {
+			fprintf(stderr, "lsh: usage: xargs [-n N] [-P P] [-0] [-I repl] [cmd [args...]]\n");
+			return 1;
+		}
+	}
+	if (st.maxprocs < 1) {
+		st.maxprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	st.jobs = malloc(st.maxprocs * sizeof(int));
+	if (!st.jobs) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	cmd = args[i] != NULL ? args + i : echo_args;
+
+	if (repl == NULL) {
+		for (i = 0; cmd[i] != NULL; i++) {
+			lsh_xargs_push(&st, cmd[i]);
+			st.size += strlen(cmd[i]) + 1 + sizeof(char *);
+		}
+		st.fixed = st.argc;
+	}
+
+	while ((rec = lsh_reader_next(&lsh_stdin, nul ? '\0' : '\n', &len)) != NULL) {
+		if (repl != NULL) {
+			// One command per input line, with repl substituted.
+			if (len == 0) {
+				continue;
+			}
+			for (i = 0; cmd[i] != NULL; i++) {
+				lsh_xargs_push(&st, lsh_xargs_subst(cmd[i], repl, rec));
+			}
+			lsh_xargs_flush(&st);
+			continue;
+		}
+
+		for (item = nul ? rec : strtok(rec, LSH_TOK_DELIM); item != NULL;
+			item = nul ? NULL : strtok(NULL, LSH_TOK_DELIM)) {
+			cost = strlen(item) + 1 + sizeof(char *);
+			if (st.size + cost > budget || (maxargs > 0 && st.argc - st.fixed >= maxargs)) {
+				lsh_xargs_flush(&st);
+				st.size = 0;
+				for (i = 0; i < st.fixed; i++) {
+					st.size += strlen(st.argv[i]) + 1 + sizeof(char *);
+				}
+			}
+			if (st.size + cost > budget) {
+				fprintf(stderr, "lsh: xargs: argument line too long\n");
+				continue;
+			}
+			lsh_xargs_push(&st, strdup(item));
+			st.size += cost;
+		}
+		if (lsh_interrupted) {
+			break;
+		}
+	}
+	lsh_xargs_flush(&st);
+	while (st.running > 0) {
+		lsh_xargs_wait(&st);
+	}
+
+	lsh_last_status = st.failed ? 123 : 0;
+	free(st.argv);
+	free(st.jobs);
+	return 1;
+}
+
+/**
+@brief Start a program and wait for it to terminate.
+@param args Null terminated list of arguments (including program).
+@return The program's exit status, or -1 with errno set if it could not be
+started.
+*/
+int lsh_run(char **args)
+{
+	pid_t pid;
+	int id;
+
+	pid = lsh_spawn(args);
+	if (pid < 0) {
+		return -1;
+	}
+	id = lsh_job_add(pid);
+	lsh_job_foreground(id);
+	lsh_job_wait(id);
+	return lsh_job_reap(id);
+}
+
+/**
+@brief Rerun a command whose argument list was too long in batches that fit
+ARG_MAX.  The command name and any leading options (up to and including
+"--") are repeated in every batch; the remaining arguments are split.
+@param args Null terminated list of arguments (including program).
+@return 0 if every batch succeeded, otherwise the status of the first batch
+that failed.
+*/
+int lsh_run_split(char **args)
+{
+	char **batch;
+	long budget = lsh_arg_budget(), fixed_size = 0, size, cost;
+	int fixed = 1, argc, i, n, status, result = 0;
+
+	while (args[fixed] != NULL && args[fixed][0] == '-') {
+		if (strcmp(args[fixed++], "--") == 0) {
+			break;
+		}
+	}
+	for (argc = 0; args[argc] != NULL; argc++) {
+		if (argc < fixed) {
+			fixed_size += strlen(args[argc]) + 1 + sizeof(char *);
+		}
+	}
+
+	batch = malloc((argc + 1) * sizeof(char *));
+	if (!batch) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(batch, args, fixed * sizeof(char *));
+
+	for (i = fixed; i < argc; ) {
+		n = fixed;
+		size = fixed_size;
+		while (i < argc) {
+			cost = strlen(args[i]) + 1 + sizeof(char *);
+			if (n > fixed && size + cost > budget) {
+				break;
+			}
+			batch[n++] = args[i++];
+			size += cost;
+		}
+		batch[n] = NULL;
+
+		status = lsh_run(batch);
+		if (status < 0) {
+			perror("lsh");
+			status = lsh_last_status;
+		}
+		if (status != 0 && result == 0) {
+			result = status;
+		}
+	}
+
+	free(batch);
+	return result;
+}
+
+/**
+@brief Launch a program and wait for it to terminate.
+@param args Null terminated list of arguments (including program).
+@return Always returns 1, to continue execution.
+*/
+int lsh_launch(char **args)
+{
+	int status;
+
+	status = lsh_run(args);
+	if (status < 0 && errno == E2BIG && lsh_options[LSH_OPT_SPLITARGS].value) {
+		status = lsh_run_split(args);
+	}
+	else if (status < 0) {
+		perror("lsh");
+		return 1;
+	}
+	lsh_last_status = status;
+
+	return 1;
+}
+
+/**
+@brief Launch a program in the background.
+@param args Null terminated list of arguments (including program).
+@return Always returns 1, to continue execution.
+*/
+int lsh_launch_bg(char **args)
+{
+	pid_t pid;
+	int id;
+
+	pid = lsh_spawn(args);
+	if (pid < 0) {
+		perror("lsh");
+		return 1;
+	}
+	id = lsh_job_add(pid);
+	lsh_job_background(id, args[0]);
+	lsh_last_status = 0;
+	return 1;
+}
+
+/**
+@brief Check whether a builtin named like a common program implements the
+arguments it was given.  If not, the program from PATH runs instead.
+@param args Null terminated list of arguments.
+@return Nonzero if the builtin handles them.
+*/
+int lsh_builtin_handles(char **args)
+{
+	if (strcmp(args[0], "seq") == 0) {
+		return lsh_seq_handles(args);
+	}
+	if (strcmp(args[0], "cat") == 0) {
+		return lsh_only_files(args, 1);
+	}
+	if (strcmp(args[0], "grep") == 0) {
+		return lsh_grep_handles(args);
+	}
+	if (strcmp(args[0], "wc") == 0) {
+		return lsh_wc_handles(args);
+	}
+	return 1;
+}
+
+/**
+@brief Execute shell built-in or launch program.
+@param args Null terminated list of arguments.
+@return 1 if the shell should continue running, 0 if it should terminate
+*/
+int lsh_execute(char **args)
+{
+	int i, status;
+
+	if (args[0] == NULL) {
+		// An empty command was entered.
+		return 1;
+	}
+
+	for (i = 0; i < lsh_num_builtins(); i++) {
+		if (strcmp(args[0], builtin_str[i]) == 0 && lsh_builtin_handles(args)) {
+			lsh_last_status = 0;
+			status = (*builtin_func[i])(args);
+			lsh_background = 0;
+			return status;
+		}
+	}
+
+	if (lsh_background) {
+		lsh_background = 0;
+		return lsh_launch_bg(args);
+	}
+	return lsh_launch(args);
+}
+
+/**
+@brief Event callback: stdin became readable at the prompt.
+@param fd Standard input.
+@param data Pointer to the flag to set.
+*/
+void lsh_stdin_ready(int fd, void *data)
+{
+	*(int *)data = 1;
+}
+
+/**
+@brief Read a line of input from stdin, running the event loop (job
+notifications, signals, timers) while waiting for it.
+@return The line from stdin.
+*/
+char *lsh_read_line(void)
+{
+	char *line, *buffer;
+	size_t len;
+	int eof = 0, readable = 0, polled;
+
+	fflush(stdout);
+	lsh_at_prompt = 1;
+	// Regular files cannot be polled; they are always readable anyway.
+	polled = lsh_event_add(STDIN_FILENO, lsh_stdin_ready, &readable) == 0;
+	while ((line = lsh_reader_take(&lsh_stdin, '\n', &len, eof)) == NULL) {
+		if (eof) {
+			exit(EXIT_SUCCESS);
+		}
+		while (polled && !readable) {
+			lsh_event_wait(-1);
+		}
+		readable = 0;
+		eof = lsh_reader_fill(&lsh_stdin) <= 0;
+	}
+	if (polled) {
+		lsh_event_del(STDIN_FILENO);
+	}
+	lsh_at_prompt = 0;
+
+	buffer = strdup(line);
+	if (!buffer) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	return buffer;
+}
+
+/*
+Command history, and a model of which command tends to follow which, built
+from it.  With the prefetch option on, the shell guesses the next command
+as soon as a line is entered and pulls its executable and shared libraries
+into the page cache while the current command runs.
+*/
+#define LSH_HIST_SIZE 256
+#define LSH_PREFETCH_MAX 64
+
+struct lsh_hist_next {
+	struct lsh_hist_cmd *cmd;
+	int count;
+};
+
+struct lsh_hist_cmd {
+	char *name;
+	struct lsh_hist_next *next;
+	int nnext;
+	int cap;
+	struct lsh_hist_cmd *chain;
+};
+
+struct lsh_hist_cmd *lsh_hist_cmds[LSH_HIST_SIZE];
+int lsh_hist_pending = 0;	// History file not loaded yet.
+struct lsh_hist_cmd *lsh_hist_prev = NULL;
+const char *lsh_prefetched = NULL;
+int lsh_hist_fd = -1;
+
+/**
+@brief Find or create the model entry for a command name.
+@param name The name.
+@param len Its length.
+@return The entry.
+*/
+struct lsh_hist_cmd *lsh_hist_intern(const char *name, size_t len)
+{
+	struct lsh_hist_cmd *c;
+	unsigned int h = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = h * 31 + (unsigned char)name[i];
+	}
+	h %= LSH_HIST_SIZE;
+	for (c = lsh_hist_cmds[h]; c != NULL; c = c->chain) {
+		if (strncmp(c->name, name, len) == 0 && c->name[len] == '\0') {
+			return c;
+		}
+	}
+	c = calloc(1, sizeof(*c));
+	if (!c || !(c->name = strndup(name, len))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	c->chain = lsh_hist_cmds[h];
+	lsh_hist_cmds[h] = c;
+	return c;
+}
+
+/**
+@brief Feed one history line to the model.
+@param line The line.
+@return The line's command, or NULL for a blank line.
+*/
+struct lsh_hist_cmd *lsh_hist_learn(const char *line)
+{
+	struct lsh_hist_cmd *c;
+	size_t start, len;
+	int i;
+
+	start = strspn(line, LSH_TOK_DELIM);
+	len = strcspn(line + start, LSH_TOK_DELIM);
+	if (len == 0) {
+		return NULL;
+	}
+	c = lsh_hist_intern(line + start, len);
+	if (lsh_hist_prev != NULL) {
+		for (i = 0; i < lsh_hist_prev->nnext && lsh_hist_prev->next[i].cmd != c; i++) {
+		}
+		if (i == lsh_hist_prev->nnext) {
+			if (i == lsh_hist_prev->cap) {
+				lsh_hist_prev->cap = lsh_hist_prev->cap ? lsh_hist_prev->cap * 2 : 4;
+				lsh_hist_prev->next = realloc(lsh_hist_prev->next, lsh_hist_prev->cap * sizeof(struct lsh_hist_next));
+				if (!lsh_hist_prev->next) {
+					fprintf(stderr, "lsh: allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			lsh_hist_prev->next[i].cmd = c;
+			lsh_hist_prev->next[i].count = 0;
+			lsh_hist_prev->nnext++;
+		}
+		lsh_hist_prev->next[i].count++;
+	}
+	lsh_hist_prev = c;
+	return c;
+}
+
+/**
+@brief Load the history file into the model and open it for appending.
+*/
+void lsh_hist_load(void)
+{
+	const char *home = getenv("HOME");
+	char path[4096], *line = NULL;
+	size_t cap = 0;
+	FILE *f;
+
+	if (home == NULL) {
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/.aash_history", home);
+	if ((f = fopen(path, "r")) != NULL) {
+		while (getline(&line, &cap, f) > 0) {
+			lsh_hist_learn(line);
+		}
+		free(line);
+		fclose(f);
+	}
+	lsh_hist_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+/**
+@brief Resolve a shared library name the way the dynamic linker would,
+roughly: DT_RUNPATH, LD_LIBRARY_PATH, then the system directories.
+@param name Library name from DT_NEEDED.
+@param runpath The object's DT_RUNPATH or DT_RPATH, or NULL.
+@param out Buffer for the path.
+@param size Size of out.
+@return 0 if found, -1 otherwise.
+*/
+int lsh_prefetch_find(const char *name, const char *runpath, char *out, size_t size)
+{
+	static const char *sys = "/lib64:/usr/lib64:/lib/x86_64-linux-gnu:/usr/lib/x86_64-linux-gnu:"
+		"/lib/aarch64-linux-gnu:/usr/lib/aarch64-linux-gnu:/lib:/usr/lib:/usr/local/lib";
+	const char *lists[3], *dir, *sep;
+	size_t dirlen;
+	int i;
+
+	if (strchr(name, '/') != NULL) {
+		snprintf(out, size, "%s", name);
+		return access(out, R_OK);
+	}
+	lists[0] = runpath;
+	lists[1] = getenv("LD_LIBRARY_PATH");
+	lists[2] = sys;
+	for (i = 0; i < 3; i++) {
+		for (dir = lists[i]; dir != NULL && *dir != '\0'; dir = sep ? sep + 1 : NULL) {
+			sep = strchr(dir, ':');
+			dirlen = sep ? (size_t)(sep - dir) : strlen(dir);
+			// $ORIGIN and friends are not worth expanding for a hint.
+			if (dirlen == 0 || memchr(dir, '$', dirlen) != NULL) {
+				continue;
+			}
+			snprintf(out, size, "%.*s/%s", (int)dirlen, dir, name);
+			if (access(out, R_OK) == 0) {
+				return 0;
+			}
+		}
+	}
+	return -1;
+}
+
+/**
+@brief Translate a virtual address in an ELF file to a file offset.
+@return The offset, or 0 if no loadable segment contains it.
+*/
+uint64_t lsh_elf_offset(const Elf64_Phdr *ph, int n, uint64_t addr)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (ph[i].p_type == PT_LOAD && addr >= ph[i].p_vaddr && addr - ph[i].p_vaddr < ph[i].p_filesz) {
+			return addr - ph[i].p_vaddr + ph[i].p_offset;
+		}
+	}
+	return 0;
+}
+
+/**
+@brief Start reading a file into the page cache and list the shared objects
+it needs.
+@param path The file.
+@param deps Array to add dependency paths to (allocated).
+@param ndeps Number of entries in deps, updated.
+*/
+void lsh_prefetch_file(const char *path, char **deps, int *ndeps)
+{
+	const unsigned char *map;
+	const Elf64_Ehdr *eh;
+	const Elf64_Phdr *ph;
+	const Elf64_Dyn *dyn = NULL;
+	const char *strtab = NULL, *runpath = NULL;
+	char found[4096];
+	uint64_t off, strsz = 0;
+	size_t ndyn = 0;
+	struct stat st;
+	int fd, i, j;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		return;
+	}
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < (off_t) sizeof(Elf64_Ehdr)) {
+		close(fd);
+		return;
+	}
+	if (readahead(fd, 0, st.st_size) != 0) {
+		posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return;
+	}
+
+	eh = (const Elf64_Ehdr *) map;
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+		eh->e_phoff + (uint64_t) eh->e_phnum * sizeof(Elf64_Phdr) > (uint64_t) st.st_size) {
+		munmap((void *) map, st.st_size);
+		return;
+	}
+	ph = (const Elf64_Phdr *) (map + eh->e_phoff);
+	for (i = 0; i < eh->e_phnum; i++) {
+		if (ph[i].p_offset + ph[i].p_filesz > (uint64_t) st.st_size) {
+			continue;
+		}
+		if (ph[i].p_type == PT_INTERP && ph[i].p_filesz > 1 && *ndeps < LSH_PREFETCH_MAX) {
+			deps[(*ndeps)++] = strndup((const char *) map + ph[i].p_offset, ph[i].p_filesz - 1);
+		}
+		else if (ph[i].p_type == PT_DYNAMIC) {
+			dyn = (const Elf64_Dyn *) (map + ph[i].p_offset);
+			ndyn = ph[i].p_filesz / sizeof(Elf64_Dyn);
+		}
+	}
+	for (j = 0; j < (int) ndyn && dyn[j].d_tag != DT_NULL; j++) {
+		if (dyn[j].d_tag == DT_STRTAB) {
+			off = lsh_elf_offset(ph, eh->e_phnum, dyn[j].d_un.d_ptr);
+			strtab = off ? (const char *) map + off : NULL;
+		}
+		else if (dyn[j].d_tag == DT_STRSZ) {
+			strsz = dyn[j].d_un.d_val;
+		}
+	}
+	if (strtab == NULL || (const unsigned char *) strtab + strsz > map + st.st_size) {
+		munmap((void *) map, st.st_size);
+		return;
+	}
+	for (j = 0; j < (int) ndyn && dyn[j].d_tag != DT_NULL; j++) {
+		if ((dyn[j].d_tag == DT_RUNPATH || dyn[j].d_tag == DT_RPATH) && dyn[j].d_un.d_val < strsz) {
+			runpath = strtab + dyn[j].d_un.d_val;
+		}
+	}
+	for (j = 0; j < (int) ndyn && dyn[j].d_tag != DT_NULL; j++) {
+		if (dyn[j].d_tag != DT_NEEDED || dyn[j].d_un.d_val >= strsz || *ndeps >= LSH_PREFETCH_MAX) {
+			continue;
+		}
+		if (lsh_prefetch_find(strtab + dyn[j].d_un.d_val, runpath, found, sizeof(found)) != 0) {
+			continue;
+		}
+		for (i = 0; i < *ndeps && strcmp(deps[i], found) != 0; i++) {
+		}
+		if (i == *ndeps) {
+			deps[(*ndeps)++] = strdup(found);
+		}
+	}
+	munmap((void *) map, st.st_size);
+}
+
+/**
+@brief Prefetch thread: read an executable and, transitively, the shared
+objects it needs.
+@param arg The executable's path (freed here).
+@return NULL.
+*/
+void *lsh_prefetch_worker(void *arg)
+{
+	char *deps[LSH_PREFETCH_MAX];
+	int ndeps = 1, i;
+
+	deps[0] = arg;
+	for (i = 0; i < ndeps; i++) {
+		if (deps[i] != NULL) {
+			lsh_prefetch_file(deps[i], deps, &ndeps);
+		}
+	}
+	for (i = 0; i < ndeps; i++) {
+		free(deps[i]);
+	}
+	return NULL;
+}
+
+/**
+@brief Record a command line in the history, and if prefetching is on, warm
+the page cache for the command most likely to come next.
+@param line The line, before it is split.
+*/
+void lsh_hist_add(const char *line)
+{
+	struct lsh_hist_cmd *c;
+	const char *path;
+	pthread_attr_t attr;
+	pthread_t thread;
+	struct iovec iov[2];
+	char *copy;
+	int i, best = -1;
+
+	if (lsh_hist_pending) {
+		lsh_hist_pending = 0;
+		lsh_hist_load();
+	}
+	if ((c = lsh_hist_learn(line)) == NULL) {
+		return;
+	}
+	iov[0].iov_base = (char *) line;
+	iov[0].iov_len = strlen(line);
+	iov[1].iov_base = "\n";
+	iov[1].iov_len = 1;
+	// One writev, so lines from concurrent shells do not interleave.
+	if (lsh_hist_fd >= 0 && writev(lsh_hist_fd, iov, 2) < 0) {
+		close(lsh_hist_fd);
+		lsh_hist_fd = -1;
+	}
+	if (!lsh_options[LSH_OPT_PREFETCH].value) {
+		return;
+	}
+
+	for (i = 0; i < c->nnext; i++) {
+		if (best < 0 || c->next[i].count > c->next[best].count) {
+			best = i;
+		}
+	}
+	if (best < 0) {
+		return;
+	}
+	for (i = 0; i < lsh_num_builtins(); i++) {
+		if (strcmp(c->next[best].cmd->name, builtin_str[i]) == 0) {
+			return;
+		}
+	}
+	// The path lookup cache is not thread safe; resolve here.
+	path = lsh_path_lookup(c->next[best].cmd->name);
+	if (path == NULL || path == lsh_prefetched || !(copy = strdup(path))) {
+		return;
+	}
+	lsh_prefetched = path;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, lsh_prefetch_worker, copy) != 0) {
+		free(copy);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+Operators, longest first so that "&&" is not read as two "&".  "2>" and
+"2>>" only count at the start of a word.
+*/
+char *lsh_ops[] = { "2>>", "&&", "||", ">>", "<(", ">(", ">|", "<|", "2>", "|", ";", "&", "(", ")", "<", ">",
+	NULL };
+
+/**
+@brief Check whether a token is an operator, and optionally which.
+@param tok The token (may be NULL).
+@param op The operator to compare with, or NULL for any.
+@return Nonzero if it is.
+*/
+int lsh_is_op(const char *tok, const char *op)
+{
+	int i;
+
+	if (tok == NULL) {
+		return 0;
+	}
+	if (op != NULL) {
+		return strcmp(tok, op) == 0;
+	}
+	for (i = 0; lsh_ops[i] != NULL; i++) {
+		if (strcmp(tok, lsh_ops[i]) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+@brief Match an operator at a position in a line.
+@param p The position.
+@param start Nonzero at the start of a word.
+@return Length of the operator, or 0.
+*/
+size_t lsh_match_op(const char *p, int start)
+{
+	size_t len;
+	int i;
+
+	for (i = 0; lsh_ops[i] != NULL; i++) {
+		len = strlen(lsh_ops[i]);
+		if (strncmp(p, lsh_ops[i], len) == 0 && (start || lsh_ops[i][0] != '2')) {
+			return len;
+		}
+	}
+	return 0;
+}
+
+/**
+@brief Split a line into words and operators.  A "#" at the start of a word
+begins a comment.  The line is not modified.
+@param line The line.
+@return Null-terminated array of tokens, in one allocation with their text.
+*/
+char **lsh_split_line(char *line)
+{
+	size_t len = strlen(line), n, oplen;
+	char **tokens, *out, *p = line;
+	int position = 0;
+
+	// At most one token per character, each needing its own terminator.
+	tokens = malloc((len + 2) * sizeof(char *) + 2 * len + 2);
+	if (!tokens) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	out = (char *)(tokens + len + 2);
+
+	while (*p != '\0') {
+		p += strspn(p, LSH_TOK_DELIM);
+		if (*p == '\0' || *p == '#') {
+			break;
+		}
+		tokens[position++] = out;
+		if ((oplen = lsh_match_op(p, 1)) > 0) {
+			memcpy(out, p, oplen);
+			out += oplen;
+			p += oplen;
+		}
+		else {
+			for (n = 0; p[n] != '\0' && !strchr(LSH_TOK_DELIM, p[n]) && lsh_match_op(p + n, 0) == 0; n++) {
+			}
+			memcpy(out, p, n);
+			out += n;
+			p += n;
+		}
+		*out++ = '\0';
+	}
+	tokens[position] = NULL;
+	return tokens;
+}
+
+/*
+Command lines are parsed into a tree:
+
+	list     := and_or ((";" | "&") and_or)* [";" | "&"]
+	and_or   := pipeline (("&&" | "||") pipeline)*
+	pipeline := command ("|" command)*
+	command  := "(" list ")" redir* | (word | subst | redir)+
+	subst    := ("<(" | ">(") list ")"
+	redir    := ("<" | ">" | ">>" | "2>" | "2>>") (word | subst) | (">|" | "<|") codec word
+
+A "&" puts the and_or before it in the background.  A subst stands for a
+/dev/fd name of a pipe to or from its list.  ">| codec file" is read as
+"> >(codec > file)", and "<| codec file" as "< <(codec -d < file)".
+*/
+char *lsh_codecs[] = { "lz4", NULL };
+
+#define LSH_NODE_CMD 0
+#define LSH_NODE_LIST 1
+#define LSH_NODE_AND 2
+#define LSH_NODE_OR 3
+#define LSH_NODE_GROUP 4
+#define LSH_NODE_PIPE 5
+
+struct lsh_redir {
+	int fd;
+	int flags;
+	char *path;
+	struct lsh_redir *next;
+};
+
+struct lsh_subst {
+	int dir;
+	int arg;
+	struct lsh_redir *redir;
+	struct lsh_node *body;
+	struct lsh_subst *next;
+};
+
+struct lsh_node {
+	int type;
+	int background;
+	char **argv;
+	struct lsh_redir *redirs;
+	struct lsh_subst *substs;
+	struct lsh_node *left;
+	struct lsh_node *right;
+};
+
+struct lsh_parser {
+	char **tok;
+	int pos;
+	const char *error;
+};
+
+struct lsh_node *lsh_parse_list(struct lsh_parser *p);
+
+/**
+@brief Allocate a tree node.
+*/
+struct lsh_node *lsh_node_new(int type, struct lsh_node *left, struct lsh_node *right)
+{
+	struct lsh_node *n = calloc(1, sizeof(struct lsh_node));
+
+	if (!n) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	n->type = type;
+	n->left = left;
+	n->right = right;
+	return n;
+}
+
+/**
+@brief Free a tree (the token text it points into is freed separately).
+*/
+void lsh_node_free(struct lsh_node *n)
+{
+	struct lsh_redir *r, *next;
+	struct lsh_subst *s, *snext;
+
+	if (n == NULL) {
+		return;
+	}
+	for (r = n->redirs; r != NULL; r = next) {
+		next = r->next;
+		free(r);
+	}
+	for (s = n->substs; s != NULL; s = snext) {
+		snext = s->next;
+		lsh_node_free(s->body);
+		free(s);
+	}
+	free(n->argv);
+	lsh_node_free(n->left);
+	lsh_node_free(n->right);
+	free(n);
+}
+
+/**
+@brief Note a syntax error at the current token, unless one is noted.
+*/
+void lsh_parse_error(struct lsh_parser *p)
+{
+	if (p->error == NULL) {
+		p->error = p->tok[p->pos] ? p->tok[p->pos] : "newline";
+	}
+}
+
+/**
+@brief Parse a process substitution onto a node.  The current token is its
+"<(" or ">(".
+@param arg Index of the argument it stands for, or -1.
+@param r The redirection whose file it stands for, or NULL.
+@return 0 on success, -1 on error.
+*/
+int lsh_parse_subst(struct lsh_parser *p, struct lsh_node *n, int arg, struct lsh_redir *r)
+{
+	struct lsh_subst *s, **tail;
+
+	s = calloc(1, sizeof(struct lsh_subst));
+	if (!s) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	s->dir = p->tok[p->pos++][0];
+	s->arg = arg;
+	s->redir = r;
+	s->body = lsh_parse_list(p);
+	for (tail = &n->substs; *tail != NULL; tail = &(*tail)->next) {
+	}
+	*tail = s;
+	if (s->body == NULL || !lsh_is_op(p->tok[p->pos], ")")) {
+		lsh_parse_error(p);
+		return -1;
+	}
+	p->pos++;
+	return 0;
+}
+
+/**
+@brief Parse a redirection through a codec onto a node, as the process
+substitution it stands for.  The current token is its ">|" or "<|".
+@return 1 on success, -1 on error.
+*/
+int lsh_parse_codec(struct lsh_parser *p, struct lsh_node *n)
+{
+	struct lsh_redir *r, *file, **tail;
+	struct lsh_subst *s, **stail;
+	struct lsh_node *body;
+	char *op = p->tok[p->pos++], *codec = p->tok[p->pos];
+	int i;
+
+	for (i = 0; codec != NULL && lsh_codecs[i] != NULL && strcmp(codec, lsh_codecs[i]) != 0; i++) {
+	}
+	if (codec == NULL || lsh_codecs[i] == NULL) {
+		lsh_parse_error(p);
+		return -1;
+	}
+	p->pos++;
+	if (p->tok[p->pos] == NULL || lsh_is_op(p->tok[p->pos], NULL)) {
+		lsh_parse_error(p);
+		return -1;
+	}
+	body = lsh_node_new(LSH_NODE_CMD, NULL, NULL);
+	body->argv = calloc(3, sizeof(char *));
+	r = calloc(1, sizeof(struct lsh_redir));
+	file = calloc(1, sizeof(struct lsh_redir));
+	s = calloc(1, sizeof(struct lsh_subst));
+	if (!body->argv || !r || !file || !s) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	body->argv[0] = codec;
+	body->argv[1] = op[0] == '<' ? "-d" : NULL;
+	file->fd = r->fd = op[0] == '<' ? STDIN_FILENO : STDOUT_FILENO;
+	file->flags = r->flags = op[0] == '<' ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+	file->path = p->tok[p->pos++];
+	body->redirs = file;
+	r->path = op;
+	for (tail = &n->redirs; *tail != NULL; tail = &(*tail)->next) {
+	}
+	*tail = r;
+	s->dir = op[0];
+	s->arg = -1;
+	s->redir = r;
+	s->body = body;
+	for (stail = &n->substs; *stail != NULL; stail = &(*stail)->next) {
+	}
+	*stail = s;
+	return 1;
+}
+
+/**
+@brief Parse a redirection, if one is next, onto a node.
+@return 1 if one was parsed, 0 if not, -1 on error.
+*/
+int lsh_parse_redir(struct lsh_parser *p, struct lsh_node *n)
+{
+	struct lsh_redir *r, **tail;
+	char *op = p->tok[p->pos];
+	int subst;
+
+	if (lsh_is_op(op, ">|") || lsh_is_op(op, "<|")) {
+		return lsh_parse_codec(p, n);
+	}
+	if (!lsh_is_op(op, "<") && !lsh_is_op(op, ">") && !lsh_is_op(op, ">>") &&
+		!lsh_is_op(op, "2>") && !lsh_is_op(op, "2>>")) {
+		return 0;
+	}
+	p->pos++;
+	subst = lsh_is_op(p->tok[p->pos], "<(") || lsh_is_op(p->tok[p->pos], ">(");
+	if (p->tok[p->pos] == NULL || (lsh_is_op(p->tok[p->pos], NULL) && !subst)) {
+		lsh_parse_error(p);
+		return -1;
+	}
+	r = calloc(1, sizeof(struct lsh_redir));
+	if (!r) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	r->fd = op[0] == '<' ? 0 : op[0] == '2' ? 2 : 1;
+	if (op[0] == '<') {
+		r->flags = O_RDONLY;
+	}
+	else {
+		r->flags = O_WRONLY | O_CREAT | (strstr(op, ">>") ? O_APPEND : O_TRUNC);
+	}
+	r->path = p->tok[p->pos];
+	// Keep them in order, so later ones win as in other shells.
+	for (tail = &n->redirs; *tail != NULL; tail = &(*tail)->next) {
+	}
+	*tail = r;
+	if (!subst) {
+		p->pos++;
+	}
+	else if (lsh_parse_subst(p, n, -1, r) != 0) {
+		return -1;
+	}
+	return 1;
+}
+
+/**
+@brief Parse a group or a simple command.
+*/
+struct lsh_node *lsh_parse_command(struct lsh_parser *p)
+{
+	struct lsh_node *n;
+	int argc = 0, r, subst;
+
+	if (lsh_is_op(p->tok[p->pos], "(")) {
+		p->pos++;
+		n = lsh_node_new(LSH_NODE_GROUP, lsh_parse_list(p), NULL);
+		if (n->left == NULL || !lsh_is_op(p->tok[p->pos], ")")) {
+			lsh_parse_error(p);
+			return n;
+		}
+		p->pos++;
+		while ((r = lsh_parse_redir(p, n)) > 0) {
+		}
+		return n;
+	}
+
+	n = lsh_node_new(LSH_NODE_CMD, NULL, NULL);
+	n->argv = calloc(1, sizeof(char *));
+	if (!n->argv) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	while (p->tok[p->pos] != NULL && p->error == NULL) {
+		if ((r = lsh_parse_redir(p, n)) != 0) {
+			continue;
+		}
+		subst = lsh_is_op(p->tok[p->pos], "<(") || lsh_is_op(p->tok[p->pos], ">(");
+		if (lsh_is_op(p->tok[p->pos], NULL) && !subst) {
+			break;
+		}
+		n->argv = realloc(n->argv, (argc + 2) * sizeof(char *));
+		if (!n->argv) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		n->argv[argc++] = p->tok[p->pos];
+		n->argv[argc] = NULL;
+		if (!subst) {
+			p->pos++;
+		}
+		else if (lsh_parse_subst(p, n, argc - 1, NULL) != 0) {
+			break;
+		}
+	}
+	if (argc == 0 && n->redirs == NULL) {
+		lsh_parse_error(p);
+	}
+	return n;
+}
+
+/**
+@brief Parse commands joined by "|".  The stages hang off the left spine, in
+order.
+*/
+struct lsh_node *lsh_parse_pipeline(struct lsh_parser *p)
+{
+	struct lsh_node *n = lsh_parse_command(p);
+
+	while (p->error == NULL && lsh_is_op(p->tok[p->pos], "|")) {
+		p->pos++;
+		n = lsh_node_new(LSH_NODE_PIPE, n, lsh_parse_command(p));
+	}
+	return n;
+}
+
+/**
+@brief Parse pipelines joined by "&&" and "||".
+*/
+struct lsh_node *lsh_parse_and_or(struct lsh_parser *p)
+{
+	struct lsh_node *n = lsh_parse_pipeline(p);
+	int type;
+
+	while (p->error == NULL && (lsh_is_op(p->tok[p->pos], "&&") || lsh_is_op(p->tok[p->pos], "||"))) {
+		type = lsh_is_op(p->tok[p->pos++], "&&") ? LSH_NODE_AND : LSH_NODE_OR;
+		n = lsh_node_new(type, n, lsh_parse_pipeline(p));
+	}
+	return n;
+}
+
+/**
+@brief Parse a list of and_ors separated by ";" or "&".
+@return The tree, or NULL if the list is empty.
+*/
+struct lsh_node *lsh_parse_list(struct lsh_parser *p)
+{
+	struct lsh_node *n = NULL, *item;
+
+	while (p->tok[p->pos] != NULL && !lsh_is_op(p->tok[p->pos], ")") && p->error == NULL) {
+		item = lsh_parse_and_or(p);
+		if (lsh_is_op(p->tok[p->pos], "&")) {
+			item->background = 1;
+			p->pos++;
+		}
+		else if (lsh_is_op(p->tok[p->pos], ";")) {
+			p->pos++;
+		}
+		else if (p->tok[p->pos] != NULL && !lsh_is_op(p->tok[p->pos], ")")) {
+			lsh_parse_error(p);
+		}
+		n = n ? lsh_node_new(LSH_NODE_LIST, n, item) : item;
+	}
+	return n;
+}
+
+/*
+Redirections are applied to the shell's own fds for the duration of a
+command, saving the originals above fd 10; children inherit them, and
+builtins write to them directly.  Redirected stdin gets a fresh reader so
+input buffered from the terminal is not mixed in.
+*/
+struct lsh_overlay {
+	int saved[3];
+	struct lsh_reader in;
+};
+
+/**
+@brief Restore the fds an overlay replaced.
+@param ov The overlay.
+*/
+void lsh_overlay_restore(struct lsh_overlay *ov)
+{
+	int fd;
+
+	lsh_out_flush();
+	fflush(stdout);
+	fflush(stderr);
+	for (fd = 0; fd < 3; fd++) {
+		if (ov->saved[fd] < 0) {
+			continue;
+		}
+		dup2(ov->saved[fd], fd);
+		close(ov->saved[fd]);
+		ov->saved[fd] = -1;
+		if (fd == STDIN_FILENO) {
+			free(lsh_stdin.buf);
+			lsh_stdin = ov->in;
+		}
+	}
+}
+
+/**
+@brief Apply a node's redirections.
+@param r The redirections.
+@param ov Filled with what to restore.
+@return 0 on success, -1 if a file could not be opened (nothing is left
+applied).
+*/
+int lsh_overlay_apply(struct lsh_redir *r, struct lsh_overlay *ov)
+{
+	int fd;
+
+	ov->saved[0] = ov->saved[1] = ov->saved[2] = -1;
+	if (r == NULL) {
+		return 0;
+	}
+	lsh_out_flush();
+	fflush(stdout);
+	fflush(stderr);
+	for (; r != NULL; r = r->next) {
+		if ((fd = open(r->path, r->flags | O_CLOEXEC, 0666)) < 0) {
+			fprintf(stderr, "lsh: %s: %s\n", r->path, strerror(errno));
+			lsh_overlay_restore(ov);
+			return -1;
+		}
+		if (ov->saved[r->fd] < 0) {
+			ov->saved[r->fd] = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+			if (r->fd == STDIN_FILENO) {
+				ov->in = lsh_stdin;
+				memset(&lsh_stdin, 0, sizeof(lsh_stdin));
+				lsh_stdin.fd = STDIN_FILENO;
+			}
+		}
+		else if (r->fd == STDIN_FILENO) {
+			lsh_stdin.pos = lsh_stdin.len = 0;
+		}
+		dup2(fd, r->fd);
+		close(fd);
+	}
+	return 0;
+}
+
+/*
+Subshell scopes.  A "( ... )" group runs in the shell process itself when
+everything in it can be undone afterwards: the working directory is kept
+as a dirfd, option values are copied, exported variables are logged as
+they change (so only what the group touches is copied), and redirections
+are an overlay.  Groups that start background work, use builtins with
+lasting effects or set options whose hooks have them are forked instead.
+*/
+struct lsh_undo {
+	char *name;
+	char *old;
+};
+
+struct lsh_scope {
+	int cwd;
+	int *options;
+	int undo;
+};
+
+struct lsh_undo *lsh_undo_log = NULL;
+int lsh_undo_n = 0;
+int lsh_undo_cap = 0;
+int lsh_scope_depth = 0;
+int lsh_exiting = 0;
+
+char *lsh_uncontained[] = { "supervise", "on-change", "limit", NULL };
+
+/**
+@brief Remember a variable's value before it changes, if a scope is open.
+@param name The variable.
+*/
+void lsh_scope_save_var(const char *name)
+{
+	const char *old;
+
+	if (lsh_scope_depth == 0) {
+		return;
+	}
+	if (lsh_undo_n == lsh_undo_cap) {
+		lsh_undo_cap = lsh_undo_cap ? lsh_undo_cap * 2 : 16;
+		lsh_undo_log = realloc(lsh_undo_log, lsh_undo_cap * sizeof(struct lsh_undo));
+		if (!lsh_undo_log) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	old = getenv(name);
+	lsh_undo_log[lsh_undo_n].name = strdup(name);
+	lsh_undo_log[lsh_undo_n].old = old ? strdup(old) : NULL;
+	if (!lsh_undo_log[lsh_undo_n].name || (old && !lsh_undo_log[lsh_undo_n].old)) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	lsh_undo_n++;
+}
+
+/**
+@brief Open a scope.
+@param sc The scope.
+@return 0 on success, -1 if the state cannot be saved.
+*/
+int lsh_scope_enter(struct lsh_scope *sc)
+{
+	int i;
+
+	sc->cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (sc->cwd < 0) {
+		return -1;
+	}
+	sc->options = malloc(lsh_num_options() * sizeof(int));
+	if (!sc->options) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < lsh_num_options(); i++) {
+		sc->options[i] = lsh_options[i].value;
+	}
+	sc->undo = lsh_undo_n;
+	lsh_scope_depth++;
+	return 0;
+}
+
+/**
+@brief Close a scope, putting back everything it saved.
+@param sc The scope.
+*/
+void lsh_scope_leave(struct lsh_scope *sc)
+{
+	struct lsh_undo *u;
+	int i;
+
+	if (fchdir(sc->cwd) != 0) {
+		perror("lsh");
+	}
+	close(sc->cwd);
+	for (i = 0; i < lsh_num_options(); i++) {
+		if (lsh_options[i].value != sc->options[i]) {
+			lsh_options[i].value = sc->options[i];
+			if (lsh_options[i].changed != NULL) {
+				lsh_options[i].changed(lsh_options[i].value);
+			}
+		}
+	}
+	free(sc->options);
+	while (lsh_undo_n > sc->undo) {
+		u = &lsh_undo_log[--lsh_undo_n];
+		if (u->old != NULL) {
+			setenv(u->name, u->old, 1);
+		}
+		else {
+			unsetenv(u->name);
+		}
+		if (strcmp(u->name, "PATH") == 0) {
+			lsh_path_forget();
+		}
+		free(u->name);
+		free(u->old);
+	}
+	lsh_scope_depth--;
+}
+
+/**
+@brief Check whether a command changes an option whose hook has effects
+outside the option's value (the jobserver creates a pool and exports it),
+which restoring the value cannot undo.
+@param argv The command.
+@return Nonzero if it does.
+*/
+int lsh_sets_hooked_option(char **argv)
+{
+	size_t len;
+	int i;
+
+	if (argv[0] == NULL || strcmp(argv[0], "set") != 0 || argv[1] == NULL || argv[2] == NULL) {
+		return 0;
+	}
+	len = strcspn(argv[2], "=");
+	for (i = 0; i < lsh_num_options(); i++) {
+		if (strncmp(lsh_options[i].name, argv[2], len) == 0 && lsh_options[i].name[len] == '\0') {
+			return lsh_options[i].changed != NULL;
+		}
+	}
+	return 0;
+}
+
+/**
+@brief Check whether running a tree in-process can be undone.
+@param n The tree.
+@return Nonzero if it can.
+*/
+int lsh_node_contained(struct lsh_node *n)
+{
+	int i;
+
+	if (n == NULL) {
+		return 1;
+	}
+	if (n->background) {
+		return 0;
+	}
+	switch (n->type) {
+	case LSH_NODE_CMD:
+		for (i = 0; n->argv[0] != NULL && lsh_uncontained[i] != NULL; i++) {
+			if (strcmp(n->argv[0], lsh_uncontained[i]) == 0) {
+				return 0;
+			}
+		}
+		return !lsh_sets_hooked_option(n->argv);
+	case LSH_NODE_GROUP:
+		// A nested group decides for itself.
+		return 1;
+	default:
+		return lsh_node_contained(n->left) && lsh_node_contained(n->right);
+	}
+}
+
+int lsh_exec_node(struct lsh_node *n);
+
+/**
+@brief Run a tree in a forked subshell.
+@param n The tree.
+@param body What the child runs: the group's list, or n itself.
+*/
+void lsh_exec_forked(struct lsh_node *n, struct lsh_node *body)
+{
+	struct lsh_overlay ov;
+	pid_t pid;
+	int id;
+
+	lsh_out_flush();
+	fflush(stdout);
+	fflush(stderr);
+	pid = fork();
+	if (pid == 0) {
+		lsh_event_after_fork();
+		lsh_job_forget_all();
+		lsh_hist_pending = 0;
+		lsh_background = 0;
+		// This process is the background job; run the body in it.
+		n->background = 0;
+		if (body != n) {
+			if (lsh_overlay_apply(n->redirs, &ov) != 0) {
+				_exit(1);
+			}
+		}
+		lsh_exec_node(body);
+		lsh_out_flush();
+		fflush(stdout);
+		// Skip atexit handlers: they belong to the parent shell.  A pool
+		// the subshell made is its own.
+		lsh_js_cleanup();
+		_exit(lsh_last_status);
+	}
+	if (pid < 0) {
+		perror("lsh");
+		lsh_last_status = 1;
+		return;
+	}
+	id = lsh_job_add(pid);
+	if (n->background) {
+		lsh_job_background(id, n->type == LSH_NODE_GROUP ? "( ... )" :
+			n->type == LSH_NODE_PIPE ? "pipeline" : n->type == LSH_NODE_CMD && n->argv[0] ? n->argv[0] : "list");
+		lsh_last_status = 0;
+		return;
+	}
+	lsh_job_foreground(id);
+	lsh_job_wait(id);
+	lsh_last_status = lsh_job_reap(id);
+}
+
+/*
+Pipelines.  Builtins that only read their input and write their output
+run as threads of the shell rather than forked copies of it; two such
+stages next to each other are joined by a ring instead of a pipe.  Another
+builtin as the last stage runs in the shell itself (so "... | read x" sets
+x), and other builtins and groups are forked as usual.  Record operators
+after "ls" join its stage, so records never turn into text in between.
+*/
+#define LSH_STAGE_THREAD 0
+#define LSH_STAGE_MAIN 1
+#define LSH_STAGE_FORK 2
+#define LSH_STAGE_SPAWN 3
+#define LSH_STAGE_FAILED 4
+
+char *lsh_threaded[] = { "echo", "pwd", "ls", "help", "seq", "yes", "cat", "grep", "wc",
+	"where", "sort-by", "select", "group-by", "sum", "json", "csv", "tee", "lz4", "grep-count", "topk", "take", NULL };
+
+struct lsh_stage {
+	struct lsh_node *n;
+	struct lsh_node **more;
+	int nmore;
+	int kind;
+	int fd[3];
+	struct lsh_ring *rin;
+	struct lsh_ring *rout;
+	int job;
+	int started;
+	pthread_t thread;
+	int status;
+};
+
+/**
+@brief Choose how a pipeline stage runs.
+@param n The stage.
+@param last Nonzero for the last stage.
+@return One of LSH_STAGE_THREAD, LSH_STAGE_MAIN, LSH_STAGE_FORK, LSH_STAGE_SPAWN.
+*/
+int lsh_stage_kind(struct lsh_node *n, int last)
+{
+	struct lsh_redir *r;
+	int i;
+
+	if (n->type != LSH_NODE_CMD || n->argv[0] == NULL) {
+		return LSH_STAGE_FORK;
+	}
+	if (!lsh_builtin_handles(n->argv)) {
+		return LSH_STAGE_SPAWN;
+	}
+	for (i = 0; lsh_threaded[i] != NULL; i++) {
+		if (strcmp(n->argv[0], lsh_threaded[i]) == 0) {
+			// Threads share the shell's stderr, so they cannot redirect it.
+			for (r = n->redirs; r != NULL && r->fd != STDERR_FILENO; r = r->next) {
+			}
+			return r == NULL ? LSH_STAGE_THREAD : LSH_STAGE_FORK;
+		}
+	}
+	for (i = 0; i < lsh_num_builtins(); i++) {
+		if (strcmp(n->argv[0], builtin_str[i]) == 0) {
+			return last ? LSH_STAGE_MAIN : LSH_STAGE_FORK;
+		}
+	}
+	return LSH_STAGE_SPAWN;
+}
+
+/**
+@brief Check whether a stage can be part of a run of record stages.
+@param n The stage.
+@return As lsh_record_role(), and 0 for anything with redirections.
+*/
+int lsh_stage_records(struct lsh_node *n)
+{
+	if (n->type != LSH_NODE_CMD || n->redirs != NULL || n->substs != NULL) {
+		return 0;
+	}
+	return lsh_record_role(n->argv);
+}
+
+/**
+@brief Close whatever a stage still holds of its connections.
+@param st The stage.
+*/
+void lsh_stage_close(struct lsh_stage *st)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (st->fd[i] >= 0) {
+			close(st->fd[i]);
+			st->fd[i] = -1;
+		}
+	}
+	if (st->rin != NULL) {
+		lsh_ring_close(st->rin, LSH_RING_RCLOSED);
+	}
+	if (st->rout != NULL) {
+		lsh_ring_close(st->rout, LSH_RING_WCLOSED);
+	}
+}
+
+/**
+@brief Open a thread or program stage's redirections in place of its pipes.
+@param st The stage.
+@return 0 on success, -1 if a file could not be opened.
+*/
+int lsh_stage_redirect(struct lsh_stage *st)
+{
+	struct lsh_redir *r;
+	int fd;
+
+	for (r = st->n->redirs; r != NULL; r = r->next) {
+		if ((fd = open(r->path, r->flags | O_CLOEXEC, 0666)) < 0) {
+			fprintf(stderr, "lsh: %s: %s\n", r->path, strerror(errno));
+			return -1;
+		}
+		if (st->fd[r->fd] >= 0) {
+			close(st->fd[r->fd]);
+		}
+		st->fd[r->fd] = fd;
+		// A redirected end no longer uses the ring on that side.
+		if (r->fd == STDIN_FILENO && st->rin != NULL) {
+			lsh_ring_close(st->rin, LSH_RING_RCLOSED);
+			st->rin = NULL;
+		}
+		else if (r->fd == STDOUT_FILENO && st->rout != NULL) {
+			lsh_ring_close(st->rout, LSH_RING_WCLOSED);
+			st->rout = NULL;
+		}
+	}
+	return 0;
+}
+
+/**
+@brief Thread body for a builtin stage.
+@param arg The stage.
+@return NULL.
+*/
+void *lsh_stage_thread(void *arg)
+{
+	struct lsh_stage *st = arg;
+	char ***stages;
+	int i;
+
+	lsh_stdin.fd = st->fd[0];
+	lsh_stdin.ring = st->rin;
+	lsh_out_fd = st->fd[1] >= 0 ? st->fd[1] : STDOUT_FILENO;
+	lsh_out_ring = st->rout;
+	if (st->nmore > 0) {
+		stages = malloc((st->nmore + 1) * sizeof(char **));
+		if (!stages) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		stages[0] = st->n->argv;
+		for (i = 0; i < st->nmore; i++) {
+			stages[i + 1] = st->more[i]->argv;
+		}
+		lsh_records_run(stages, st->nmore + 1);
+		free(stages);
+	}
+	else {
+		lsh_execute(st->n->argv);
+	}
+	lsh_out_flush();
+	st->status = lsh_last_status;
+	free(lsh_stdin.buf);
+	lsh_stage_close(st);
+	return NULL;
+}
+
+/**
+@brief Fork a stage that needs a process of its own but is not a program:
+a group, or a builtin that must not run on a thread.
+@param st The stage.
+@param stages Every stage, whose fds the child closes.
+@param count Number of stages.
+@return The child's pid, or -1 if fork failed.
+*/
+pid_t lsh_stage_fork(struct lsh_stage *st, struct lsh_stage *stages, int count)
+{
+	struct lsh_overlay ov;
+	pid_t pid;
+	int i, fd;
+
+	pid = fork();
+	if (pid != 0) {
+		return pid;
+	}
+	lsh_event_after_fork();
+	lsh_job_forget_all();
+	lsh_hist_pending = 0;
+	lsh_background = 0;
+	for (fd = 0; fd < 3; fd++) {
+		if (st->fd[fd] >= 0 && st->fd[fd] != fd) {
+			dup2(st->fd[fd], fd);
+		}
+	}
+	if (st->fd[0] >= 0) {
+		// Input buffered from the shell's stdin is not ours.
+		lsh_stdin.pos = lsh_stdin.len = 0;
+	}
+	for (i = 0; i < count; i++) {
+		for (fd = 0; fd < 3; fd++) {
+			if (stages[i].fd[fd] > STDERR_FILENO) {
+				close(stages[i].fd[fd]);
+			}
+		}
+	}
+	if (st->n->type == LSH_NODE_GROUP && st->n->substs == NULL) {
+		if (lsh_overlay_apply(st->n->redirs, &ov) != 0) {
+			_exit(1);
+		}
+		lsh_exec_node(st->n->left);
+	}
+	else {
+		lsh_exec_node(st->n);
+	}
+	lsh_out_flush();
+	fflush(stdout);
+	_exit(lsh_last_status);
+}
+
+/**
+@brief Run the last stage in the shell itself, reading from its pipe.
+@param st The stage.
+*/
+void lsh_stage_main(struct lsh_stage *st)
+{
+	struct lsh_reader saved = lsh_stdin;
+	struct lsh_overlay ov;
+
+	memset(&lsh_stdin, 0, sizeof(lsh_stdin));
+	lsh_stdin.fd = st->fd[0] >= 0 ? st->fd[0] : STDIN_FILENO;
+	if (lsh_overlay_apply(st->n->redirs, &ov) != 0) {
+		st->status = 1;
+	}
+	else {
+		if (lsh_execute(st->n->argv) == 0) {
+			lsh_exiting = 1;
+		}
+		lsh_overlay_restore(&ov);
+		st->status = lsh_last_status;
+	}
+	free(lsh_stdin.buf);
+	lsh_stdin = saved;
+	lsh_stage_close(st);
+}
+
+/*
+Process substitution.  Each "<(list)" or ">(list)" of a command gets a
+pipe; the command sees the name /dev/fd/N of its end, and the list runs
+with the other end as its stdout or stdin.  A list that is a builtin safe
+on a thread runs as one, so with a builtin consumer, which opens the name
+itself, nothing is forked at all.  Other lists are spawned or forked as
+pipeline stages are.  The consumer's ends are close-on-exec until the
+consumer is started, so no other child keeps a pipe open.
+*/
+struct lsh_subst_run {
+	struct lsh_node *n;
+	struct lsh_stage *st;
+	int *end;
+	char (*path)[24];
+	char **text;
+	int count;
+};
+
+/**
+@brief Fork a process substitution's list.
+@param run The node's substitutions.
+@param i Which one.
+@return The child's pid, or -1 if fork failed.
+*/
+pid_t lsh_subst_fork(struct lsh_subst_run *run, int i)
+{
+	struct lsh_stage *st = &run->st[i];
+	pid_t pid;
+	int j, fd;
+
+	pid = fork();
+	if (pid != 0) {
+		return pid;
+	}
+	lsh_event_after_fork();
+	lsh_job_forget_all();
+	lsh_hist_pending = 0;
+	lsh_background = 0;
+	for (fd = 0; fd < 2; fd++) {
+		if (st->fd[fd] >= 0) {
+			dup2(st->fd[fd], fd);
+		}
+	}
+	if (st->fd[0] >= 0) {
+		lsh_stdin.pos = lsh_stdin.len = 0;
+	}
+	// The consumer's ends too: a list that reads or writes its own pipe
+	// would never see it close.
+	for (j = 0; j < run->count; j++) {
+		for (fd = 0; fd < 2; fd++) {
+			if (run->st[j].fd[fd] > STDERR_FILENO) {
+				close(run->st[j].fd[fd]);
+			}
+		}
+		close(run->end[j]);
+	}
+	lsh_exec_node(st->n);
+	lsh_out_flush();
+	fflush(stdout);
+	_exit(lsh_last_status);
+}
+
+/**
+@brief Set up a node's process substitutions: make the pipes, put their
+names in place of the substitutions, and start the lists that need a
+process.  Threads are left for lsh_subst_start().
+@param n The node.
+@param run Filled with the state.
+@return 0 on success, -1 if the pipes could not be made (nothing is left
+set up).
+*/
+int lsh_subst_open(struct lsh_node *n, struct lsh_subst_run *run)
+{
+	struct lsh_subst *s;
+	struct lsh_stage *st;
+	int i, fds[2];
+	pid_t pid;
+
+	run->n = n;
+	run->count = 0;
+	for (s = n->substs; s != NULL; s = s->next) {
+		run->count++;
+	}
+	run->st = calloc(run->count, sizeof(struct lsh_stage));
+	run->end = malloc(run->count * sizeof(int));
+	run->path = malloc(run->count * sizeof(*run->path));
+	run->text = malloc(run->count * sizeof(char *));
+	if (!run->st || !run->end || !run->path || !run->text) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0, s = n->substs; s != NULL; i++, s = s->next) {
+		if (pipe2(fds, O_CLOEXEC) != 0) {
+			perror("lsh: pipe");
+			while (i-- > 0) {
+				lsh_stage_close(&run->st[i]);
+				close(run->end[i]);
+			}
+			free(run->st);
+			free(run->end);
+			free(run->path);
+			free(run->text);
+			return -1;
+		}
+		st = &run->st[i];
+		st->n = s->body;
+		st->fd[0] = st->fd[1] = st->fd[2] = -1;
+		st->job = -1;
+		st->fd[s->dir == '<' ? 1 : 0] = fds[s->dir == '<' ? 1 : 0];
+		run->end[i] = fds[s->dir == '<' ? 0 : 1];
+		snprintf(run->path[i], sizeof(run->path[i]), "/dev/fd/%d", run->end[i]);
+		if (s->redir != NULL) {
+			run->text[i] = s->redir->path;
+			s->redir->path = run->path[i];
+		}
+		else {
+			run->text[i] = n->argv[s->arg];
+			n->argv[s->arg] = run->path[i];
+		}
+	}
+
+	lsh_out_flush();
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < run->count; i++) {
+		st = &run->st[i];
+		st->kind = st->n->type == LSH_NODE_CMD && st->n->substs == NULL ? lsh_stage_kind(st->n, 0) :
+			LSH_STAGE_FORK;
+		if (st->kind == LSH_STAGE_THREAD && st->fd[0] < 0) {
+			st->fd[0] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+		}
+		if ((st->kind == LSH_STAGE_THREAD || st->kind == LSH_STAGE_SPAWN) && lsh_stage_redirect(st) != 0) {
+			st->kind = LSH_STAGE_FAILED;
+		}
+		pid = 0;
+		if (st->kind == LSH_STAGE_FORK) {
+			pid = lsh_subst_fork(run, i);
+		}
+		else if (st->kind == LSH_STAGE_SPAWN) {
+			pid = lsh_spawn_fds(st->n->argv, st->fd[0], st->fd[1], st->fd[2]);
+		}
+		if (pid < 0) {
+			fprintf(stderr, "lsh: %s: %s\n", st->kind == LSH_STAGE_SPAWN ? st->n->argv[0] : "fork",
+				strerror(errno));
+		}
+		else if (pid > 0) {
+			st->job = lsh_job_add(pid);
+		}
+		if (st->kind != LSH_STAGE_THREAD) {
+			lsh_stage_close(st);
+		}
+	}
+	return 0;
+}
+
+/**
+@brief Start the process substitutions that run on threads.
+@param run The state from lsh_subst_open().
+*/
+void lsh_subst_start(struct lsh_subst_run *run)
+{
+	struct lsh_stage *st;
+	int i;
+
+	for (i = 0; i < run->count; i++) {
+		st = &run->st[i];
+		if (st->kind != LSH_STAGE_THREAD) {
+			continue;
+		}
+		if (pthread_create(&st->thread, NULL, lsh_stage_thread, st) == 0) {
+			st->started = 1;
+		}
+		else {
+			fprintf(stderr, "lsh: %s: cannot start thread\n", st->n->argv[0]);
+			lsh_stage_close(st);
+		}
+	}
+}
+
+/**
+@brief Let the next child inherit the consumer's ends.
+@param run The state from lsh_subst_open().
+*/
+void lsh_subst_share(struct lsh_subst_run *run)
+{
+	int i;
+
+	for (i = 0; i < run->count; i++) {
+		fcntl(run->end[i], F_SETFD, 0);
+	}
+}
+
+/**
+@brief Close the consumer's ends in the shell.
+@param run The state from lsh_subst_open().
+*/
+void lsh_subst_release(struct lsh_subst_run *run)
+{
+	int i;
+
+	for (i = 0; i < run->count; i++) {
+		if (run->end[i] >= 0) {
+			close(run->end[i]);
+			run->end[i] = -1;
+		}
+	}
+}
+
+/**
+@brief Finish after the consumer: close its ends, so the lists see end of
+file or a closed pipe, wait for them, and put the substitutions back.
+Their statuses are not kept, as in other shells.
+@param run The state from lsh_subst_open().
+*/
+void lsh_subst_finish(struct lsh_subst_run *run)
+{
+	struct lsh_subst *s;
+	int i;
+
+	lsh_subst_release(run);
+	for (i = 0; i < run->count; i++) {
+		if (run->st[i].job >= 0) {
+			lsh_job_wait(run->st[i].job);
+			lsh_job_reap(run->st[i].job);
+		}
+		if (run->st[i].started) {
+			pthread_join(run->st[i].thread, NULL);
+		}
+	}
+	for (i = 0, s = run->n->substs; s != NULL; i++, s = s->next) {
+		if (s->redir != NULL) {
+			s->redir->path = run->text[i];
+		}
+		else {
+			run->n->argv[s->arg] = run->text[i];
+		}
+	}
+	free(run->st);
+	free(run->end);
+	free(run->path);
+	free(run->text);
+}
+
+/**
+@brief Run a node that has process substitutions.
+@param n The node.
+*/
+void lsh_exec_subst(struct lsh_node *n)
+{
+	struct lsh_subst_run run;
+	struct lsh_subst *substs = n->substs;
+	int status;
+
+	if (lsh_subst_open(n, &run) != 0) {
+		lsh_last_status = 1;
+		return;
+	}
+	lsh_subst_start(&run);
+	lsh_subst_share(&run);
+	n->substs = NULL;
+	status = lsh_exec_node(n);
+	n->substs = substs;
+	lsh_subst_finish(&run);
+	lsh_last_status = status;
+}
+
+/**
+@brief Run a pipeline.  Processes are started first, while the shell has a
+single thread; then the builtin threads; then the last stage if it runs
+here.  The status is the last stage's.
+@param n The pipeline.
+*/
+void lsh_exec_pipe(struct lsh_node *n)
+{
+	struct lsh_node **nodes, *m;
+	struct lsh_stage *st;
+	struct lsh_ring **rings;
+	struct lsh_subst_run *runs;
+	int nnodes = 1, count = 0, nrings = 0, i, fds[2];
+	pid_t pid;
+
+	for (m = n; m->type == LSH_NODE_PIPE; m = m->left) {
+		nnodes++;
+	}
+	nodes = malloc(nnodes * sizeof(struct lsh_node *));
+	st = calloc(nnodes, sizeof(struct lsh_stage));
+	rings = calloc(nnodes, sizeof(struct lsh_ring *));
+	runs = calloc(nnodes, sizeof(struct lsh_subst_run));
+	if (!nodes || !st || !rings || !runs) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = nnodes - 1, m = n; i >= 0; i--, m = m->left) {
+		nodes[i] = m->type == LSH_NODE_PIPE ? m->right : m;
+	}
+	for (i = 0; i < nnodes; i++) {
+		if (count > 0 && lsh_stage_records(nodes[i]) == 2 && lsh_stage_records(st[count - 1].n) != 0 &&
+			(st[count - 1].nmore == 0 || st[count - 1].more[st[count - 1].nmore - 1] == nodes[i - 1])) {
+			st[count - 1].nmore++;
+			continue;
+		}
+		st[count].n = nodes[i];
+		st[count++].more = nodes + i + 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		st[i].kind = st[i].nmore > 0 ? LSH_STAGE_THREAD : lsh_stage_kind(st[i].n, i == count - 1);
+		st[i].fd[0] = st[i].fd[1] = st[i].fd[2] = -1;
+		st[i].job = -1;
+		st[i].status = 1;
+		// A forked stage sets up its own substitutions.
+		if (st[i].n->substs != NULL && st[i].kind != LSH_STAGE_FORK && lsh_subst_open(st[i].n, &runs[i]) != 0) {
+			runs[i].n = NULL;
+			st[i].kind = LSH_STAGE_FAILED;
+		}
+	}
+	for (i = 0; i + 1 < count; i++) {
+		if (st[i].kind == LSH_STAGE_THREAD && st[i + 1].kind == LSH_STAGE_THREAD) {
+			rings[nrings] = lsh_ring_new();
+			st[i].rout = st[i + 1].rin = rings[nrings++];
+		}
+		else if (pipe2(fds, O_CLOEXEC) == 0) {
+			st[i].fd[1] = fds[1];
+			st[i + 1].fd[0] = fds[0];
+		}
+		else {
+			perror("lsh: pipe");
+			st[i].kind = st[i + 1].kind = LSH_STAGE_FAILED;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (st[i].kind == LSH_STAGE_THREAD && st[i].fd[0] < 0 && st[i].rin == NULL) {
+			// The last stage may move the shell's own stdin around.
+			st[i].fd[0] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+		}
+		if ((st[i].kind == LSH_STAGE_THREAD || st[i].kind == LSH_STAGE_SPAWN) &&
+			lsh_stage_redirect(&st[i]) != 0) {
+			st[i].kind = LSH_STAGE_FAILED;
+		}
+	}
+
+	lsh_out_flush();
+	fflush(stdout);
+	fflush(stderr);
+	lsh_place_group_begin();
+	for (i = 0; i < count; i++) {
+		pid = 0;
+		if (st[i].kind == LSH_STAGE_FORK) {
+			pid = lsh_stage_fork(&st[i], st, count);
+		}
+		else if (st[i].kind == LSH_STAGE_SPAWN) {
+			lsh_last_status = 1;
+			if (runs[i].n != NULL) {
+				lsh_subst_share(&runs[i]);
+			}
+			pid = lsh_spawn_fds(st[i].n->argv, st[i].fd[0], st[i].fd[1], st[i].fd[2]);
+			if (runs[i].n != NULL) {
+				lsh_subst_release(&runs[i]);
+			}
+		}
+		if (pid < 0) {
+			fprintf(stderr, "lsh: %s: %s\n", st[i].n->argv && st[i].n->argv[0] ? st[i].n->argv[0] : "fork",
+				strerror(errno));
+			st[i].status = lsh_last_status;
+		}
+		else if (pid > 0) {
+			st[i].job = lsh_job_add(pid);
+			lsh_job_foreground(st[i].job);
+		}
+		if (st[i].kind == LSH_STAGE_FORK || st[i].kind == LSH_STAGE_SPAWN || st[i].kind == LSH_STAGE_FAILED) {
+			lsh_stage_close(&st[i]);
+		}
+	}
+	lsh_place_group_end();
+
+	for (i = 0; i < count; i++) {
+		if (runs[i].n != NULL) {
+			lsh_subst_start(&runs[i]);
+		}
+		if (st[i].kind != LSH_STAGE_THREAD) {
+			continue;
+		}
+		if (pthread_create(&st[i].thread, NULL, lsh_stage_thread, &st[i]) == 0) {
+			st[i].started = 1;
+		}
+		else {
+			fprintf(stderr, "lsh: %s: cannot start thread\n", st[i].n->argv[0]);
+			lsh_stage_close(&st[i]);
+		}
+	}
+	if (st[count - 1].kind == LSH_STAGE_MAIN) {
+		lsh_stage_main(&st[count - 1]);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (st[i].job >= 0) {
+			lsh_job_wait(st[i].job);
+			st[i].status = lsh_job_reap(st[i].job);
+		}
+		if (st[i].started) {
+			pthread_join(st[i].thread, NULL);
+		}
+		if (runs[i].n != NULL) {
+			lsh_subst_finish(&runs[i]);
+		}
+	}
+	for (i = 0; i < nrings; i++) {
+		lsh_ring_free(rings[i]);
+	}
+	lsh_last_status = st[count - 1].status;
+	free(runs);
+	free(rings);
+	free(st);
+	free(nodes);
+}
+
+/**
+@brief Run a parsed command line.
+@param n The tree.
+@return The exit status of what ran last.
+*/
+int lsh_exec_node(struct lsh_node *n)
+{
+	struct lsh_overlay ov;
+	struct lsh_scope sc;
+
+	if (n == NULL || lsh_exiting) {
+		return lsh_last_status;
+	}
+	if (n->substs != NULL) {
+		// In the background, the lists belong to the job.
+		if (n->background) {
+			lsh_exec_forked(n, n);
+		}
+		else {
+			lsh_exec_subst(n);
+		}
+		return lsh_last_status;
+	}
+	switch (n->type) {
+	case LSH_NODE_CMD:
+		if (lsh_overlay_apply(n->redirs, &ov) != 0) {
+			lsh_last_status = 1;
+			break;
+		}
+		lsh_background = n->background;
+		if (lsh_execute(n->argv) == 0) {
+			lsh_exiting = 1;
+		}
+		lsh_background = 0;
+		lsh_overlay_restore(&ov);
+		break;
+	case LSH_NODE_LIST:
+		lsh_exec_node(n->left);
+		if (!lsh_interrupted) {
+			lsh_exec_node(n->right);
+		}
+		break;
+	case LSH_NODE_PIPE:
+		if (n->background) {
+			lsh_exec_forked(n, n);
+			break;
+		}
+		lsh_exec_pipe(n);
+		break;
+	case LSH_NODE_AND:
+	case LSH_NODE_OR:
+		if (n->background) {
+			lsh_exec_forked(n, n);
+			break;
+		}
+		lsh_exec_node(n->left);
+		if (!lsh_interrupted && (lsh_last_status == 0) == (n->type == LSH_NODE_AND)) {
+			lsh_exec_node(n->right);
+		}
+		break;
+	case LSH_NODE_GROUP:
+		if (!lsh_node_contained(n) || !lsh_node_contained(n->left) || lsh_scope_enter(&sc) != 0) {
+			lsh_exec_forked(n, n->left);
+			break;
+		}
+		if (lsh_overlay_apply(n->redirs, &ov) == 0) {
+			lsh_exec_node(n->left);
+			lsh_overlay_restore(&ov);
+		}
+		else {
+			lsh_last_status = 1;
+		}
+		lsh_scope_leave(&sc);
+		// "exit" ends only the subshell.
+		lsh_exiting = 0;
+		break;
+	}
+	return lsh_last_status;
+}
+
+/*
+Pipeline optimizer.  With "set -o optimize", each command line is rewritten
+between parsing and execution, fusing well-known idioms into builtins that
+do the same work in one pass:
+
+	cat f | cmd                        cmd < f
+	seq ... | head -n N                seq stopping at its Nth number
+	builtin | head -n N                builtin | take N
+	sort | uniq -c | sort -rn          topk
+	sort | uniq -c | sort -rn | head   topk N
+	grep ... | wc -l                   grep-count ...
+
+"lsh --explain" prints each line's rewritten plan instead of running it.
+*/
+int lsh_explain = 0;
+
+struct lsh_opt_entry {
+	uint64_t hash;
+	char *line;
+	long long count;
+};
+
+/**
+@brief Order fused "sort | uniq -c | sort -rn" output: higher counts first,
+and equal counts by line, as sort's last-resort comparison reversed.
+@return Negative if a comes first.
+*/
+int lsh_topk_cmp(const void *a, const void *b)
+{
+	const struct lsh_opt_entry *x = a, *y = b;
+
+	if (x->count != y->count) {
+		return x->count > y->count ? -1 : 1;
+	}
+	return -strcmp(x->line, y->line);
+}
+
+/**
+@brief Restore the heap order below a slot of a heap whose root is the entry
+that comes last.
+*/
+void lsh_topk_sift(struct lsh_opt_entry *heap, size_t n, size_t i)
+{
+	struct lsh_opt_entry tmp;
+	size_t c;
+
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && lsh_topk_cmp(&heap[c + 1], &heap[c]) > 0) {
+			c++;
+		}
+		if (lsh_topk_cmp(&heap[c], &heap[i]) <= 0) {
+			break;
+		}
+		tmp = heap[i];
+		heap[i] = heap[c];
+		heap[c] = tmp;
+		i = c;
+	}
+}
+
+/**
+@brief Bultin command: count distinct lines and print the most frequent, as
+"sort | uniq -c | sort -rn | head -n N" would, with a hash table and a heap
+instead of two sorts.
+@param args List of args.  args[0] is "topk".  Then the number of lines to
+print (all if none).
+@return Always returns 1, to continue executing.
+*/
+int lsh_topk(char **args)
+{
+	struct lsh_table text;
+	struct lsh_opt_entry *slots, *old, *heap;
+	size_t cap = 1024, used = 0, n = 0, i, j, len;
+	long long limit = -1;
+	uint64_t h;
+	char *line, num[32];
+	int err = 0;
+
+	if (args[1] != NULL && (lsh_parse_ll(args[1], &limit) != 0 || limit < 0 || args[2] != NULL)) {
+		fprintf(stderr, "lsh: usage: topk [count]\n");
+		lsh_last_status = 2;
+		return 1;
+	}
+	memset(&text, 0, sizeof(text));
+	slots = calloc(cap, sizeof(struct lsh_opt_entry));
+	if (!slots) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	while ((line = lsh_reader_next(&lsh_stdin, '\n', &len)) != NULL) {
+		len = strlen(line);
+		h = lsh_xxh64(line, len, 0);
+		for (i = h & (cap - 1); slots[i].line != NULL; i = (i + 1) & (cap - 1)) {
+			if (slots[i].hash == h && strcmp(slots[i].line, line) == 0) {
+				break;
+			}
+		}
+		if (slots[i].line != NULL) {
+			slots[i].count++;
+			continue;
+		}
+		slots[i].hash = h;
+		slots[i].line = lsh_table_strdup(&text, line);
+		slots[i].count = 1;
+		if (++used * 2 > cap) {
+			old = slots;
+			slots = calloc(cap * 2, sizeof(struct lsh_opt_entry));
+			if (!slots) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+			for (j = 0; j < cap; j++) {
+				if (old[j].line != NULL) {
+					for (i = old[j].hash & (cap * 2 - 1); slots[i].line != NULL; i = (i + 1) & (cap * 2 - 1)) {
+					}
+					slots[i] = old[j];
+				}
+			}
+			free(old);
+			cap *= 2;
+		}
+	}
+
+	// Keep the first limit entries in a heap whose root comes last, then
+	// sort what is left.
+	heap = slots;
+	for (j = 0; j < cap; j++) {
+		if (slots[j].line == NULL) {
+			continue;
+		}
+		if (limit < 0 || n < (unsigned long long)limit) {
+			heap[n++] = slots[j];
+			if (limit >= 0 && n == (unsigned long long)limit) {
+				for (i = n / 2; i-- > 0;) {
+					lsh_topk_sift(heap, n, i);
+				}
+			}
+		}
+		else if (n > 0 && lsh_topk_cmp(&slots[j], &heap[0]) < 0) {
+			heap[0] = slots[j];
+			lsh_topk_sift(heap, n, 0);
+		}
+	}
+	qsort(heap, n, sizeof(struct lsh_opt_entry), lsh_topk_cmp);
+	for (i = 0; i < n && err == 0; i++) {
+		len = snprintf(num, sizeof(num), "%7lld ", heap[i].count);
+		err = lsh_out_write(num, len) || lsh_out_write(heap[i].line, strlen(heap[i].line)) ||
+			lsh_out_write("\n", 1);
+	}
+	if (err == 0) {
+		err = lsh_out_flush();
+	}
+	if (err != 0 && errno != EPIPE && errno != EINTR) {
+		perror("lsh: topk");
+	}
+	free(slots);
+	lsh_table_free(&text);
+	return 1;
+}
+
+/**
+@brief Bultin command: copy the first lines of standard input, then stop
+reading so the writer gets EPIPE, as "head -n N" would.
+@param args List of args.  args[0] is "take".  Then the number of lines.
+@return Always returns 1, to continue executing.
+*/
+int lsh_take(char **args)
+{
+	struct lsh_reader *r = &lsh_stdin;
+	long long left, lines;
+	char *p, *end;
+	int err = 0;
+
+	if (args[1] == NULL || args[2] != NULL || lsh_parse_ll(args[1], &left) != 0 || left < 0) {
+		fprintf(stderr, "lsh: usage: take count\n");
+		lsh_last_status = 2;
+		return 1;
+	}
+	while (left > 0 && err == 0 && (r->pos < r->len || lsh_reader_fill(r) > 0)) {
+		p = r->buf + r->pos;
+		end = r->buf + r->len;
+		// Short lines make a memchr per line slow; count the whole
+		// buffer first, in a loop the compiler can vectorize.
+		for (lines = 0; p < end; p++) {
+			lines += *p == '\n';
+		}
+		if (lines < left) {
+			left -= lines;
+		}
+		else {
+			for (p = r->buf + r->pos; left > 0; p++) {
+				p = memchr(p, '\n', end - p);
+				left--;
+			}
+		}
+		err = lsh_out_write(r->buf + r->pos, p - (r->buf + r->pos));
+		r->pos = p - r->buf;
+	}
+	if (err == 0) {
+		err = lsh_out_flush();
+	}
+	if (err != 0 && errno != EPIPE && errno != EINTR) {
+		perror("lsh: take");
+	}
+	return 1;
+}
+
+struct lsh_opt {
+	struct lsh_table text;
+	struct lsh_sink log;
+};
+
+void lsh_plan_node(struct lsh_sink *out, struct lsh_node *n);
+
+/**
+@brief Find the substitution that stands for an argument or redirection.
+@param n The command.
+@param arg The argument's index, or -1.
+@param r The redirection, or NULL.
+@return The substitution, or NULL.
+*/
+struct lsh_subst *lsh_plan_subst(struct lsh_node *n, int arg, struct lsh_redir *r)
+{
+	struct lsh_subst *s;
+
+	for (s = n->substs; s != NULL; s = s->next) {
+		if (r != NULL ? s->redir == r : s->redir == NULL && s->arg == arg) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+/**
+@brief Write a word of a plan, or the substitution standing for it.
+*/
+void lsh_plan_word(struct lsh_sink *out, struct lsh_subst *s, const char *word)
+{
+	if (s == NULL) {
+		lsh_sink_write(out, word, strlen(word));
+		return;
+	}
+	lsh_sink_write(out, s->dir == '<' ? "<(" : ">(", 2);
+	lsh_plan_node(out, s->body);
+	lsh_sink_write(out, ")", 1);
+}
+
+/**
+@brief Write a node's redirections.
+*/
+void lsh_plan_redirs(struct lsh_sink *out, struct lsh_node *n)
+{
+	struct lsh_redir *r;
+	const char *op;
+
+	for (r = n->redirs; r != NULL; r = r->next) {
+		if (r->fd == STDIN_FILENO) {
+			op = " < ";
+		}
+		else if (r->fd == STDOUT_FILENO) {
+			op = r->flags & O_APPEND ? " >> " : " > ";
+		}
+		else {
+			op = r->flags & O_APPEND ? " 2>> " : " 2> ";
+		}
+		lsh_sink_write(out, op, strlen(op));
+		lsh_plan_word(out, lsh_plan_subst(n, -1, r), r->path);
+	}
+}
+
+/**
+@brief Write a tree out as a command line.
+@param out Where to write it.
+@param n The tree.
+*/
+void lsh_plan_node(struct lsh_sink *out, struct lsh_node *n)
+{
+	static const char *joins[] = { NULL, "; ", " && ", " || ", NULL, " | " };
+	int i;
+
+	switch (n->type) {
+	case LSH_NODE_CMD:
+		for (i = 0; n->argv[i] != NULL; i++) {
+			if (i > 0) {
+				lsh_sink_write(out, " ", 1);
+			}
+			lsh_plan_word(out, lsh_plan_subst(n, i, NULL), n->argv[i]);
+		}
+		lsh_plan_redirs(out, n);
+		break;
+	case LSH_NODE_GROUP:
+		lsh_sink_write(out, "( ", 2);
+		lsh_plan_node(out, n->left);
+		lsh_sink_write(out, " )", 2);
+		lsh_plan_redirs(out, n);
+		break;
+	default:
+		lsh_plan_node(out, n->left);
+		// "&" already separates a background command from the next.
+		if (n->type == LSH_NODE_LIST && n->left->background) {
+			lsh_sink_write(out, " ", 1);
+		}
+		else {
+			lsh_sink_write(out, joins[n->type], strlen(joins[n->type]));
+		}
+		lsh_plan_node(out, n->right);
+		break;
+	}
+	if (n->background) {
+		lsh_sink_write(out, " &", 2);
+	}
+}
+
+/**
+@brief Write pipeline stages joined by "|".
+*/
+void lsh_plan_stages(struct lsh_sink *out, struct lsh_node **st, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (i > 0) {
+			lsh_sink_write(out, " | ", 3);
+		}
+		lsh_plan_node(out, st[i]);
+	}
+}
+
+/**
+@brief Check whether a stage runs a given command.
+@param n The stage.
+@param name The command.
+@param argc Number of arguments after the name, or -1 for any.
+@return Nonzero if it does.
+*/
+int lsh_opt_is(struct lsh_node *n, const char *name, int argc)
+{
+	int i;
+
+	if (n->type != LSH_NODE_CMD || n->substs != NULL || n->argv[0] == NULL || strcmp(n->argv[0], name) != 0) {
+		return 0;
+	}
+	for (i = 0; n->argv[i + 1] != NULL; i++) {
+	}
+	return argc < 0 || i == argc;
+}
+
+/**
+@brief Check which fds a stage redirects.
+@return Bit 1 << fd set for each of them.
+*/
+int lsh_opt_redirected(struct lsh_node *n)
+{
+	struct lsh_redir *r;
+	int fds = 0;
+
+	for (r = n->redirs; r != NULL; r = r->next) {
+		fds |= 1 << r->fd;
+	}
+	return fds;
+}
+
+/**
+@brief Read the count of "head", "head -n N", "head -nN" or "head -N" on
+standard input.
+@param n The stage.
+@return The count, or -1 if the stage is not such a head.
+*/
+long long lsh_opt_head(struct lsh_node *n)
+{
+	long long count = 10;
+	char **a = n->argv;
+	const char *num;
+
+	if (!lsh_opt_is(n, "head", -1) || (lsh_opt_redirected(n) & 1 << STDIN_FILENO)) {
+		return -1;
+	}
+	if (a[1] == NULL) {
+		return count;
+	}
+	if (strcmp(a[1], "-n") == 0 && a[2] != NULL && a[3] == NULL) {
+		num = a[2];
+	}
+	else if (a[1][0] == '-' && a[2] == NULL) {
+		num = a[1] + (a[1][1] == 'n' ? 2 : 1);
+	}
+	else {
+		return -1;
+	}
+	if (num[0] < '0' || num[0] > '9' || lsh_parse_ll(num, &count) != 0) {
+		return -1;
+	}
+	return count;
+}
+
+/**
+@brief Check for "sort -rn" and its spellings.
+*/
+int lsh_opt_sort_rn(struct lsh_node *n)
+{
+	char **a = n->argv;
+
+	if (lsh_opt_is(n, "sort", 1)) {
+		return strcmp(a[1], "-rn") == 0 || strcmp(a[1], "-nr") == 0;
+	}
+	if (lsh_opt_is(n, "sort", 2)) {
+		return (strcmp(a[1], "-r") == 0 && strcmp(a[2], "-n") == 0) ||
+			(strcmp(a[1], "-n") == 0 && strcmp(a[2], "-r") == 0);
+	}
+	return 0;
+}
+
+/**
+@brief Check that grep's options leave it printing matching lines.
+*/
+int lsh_opt_grep_lines(struct lsh_node *n)
+{
+	int i;
+
+	for (i = 1; n->argv[i] != NULL && n->argv[i][0] == '-' && n->argv[i][1] != '\0'; i++) {
+		if (strcmp(n->argv[i], "--") == 0) {
+			return 1;
+		}
+		if (strchr(n->argv[i], 'c') != NULL) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+@brief Move a stage's redirections after another's.
+*/
+void lsh_opt_move_redirs(struct lsh_node *to, struct lsh_node *from)
+{
+	struct lsh_redir **tail;
+
+	for (tail = &to->redirs; *tail != NULL; tail = &(*tail)->next) {
+	}
+	*tail = from->redirs;
+	from->redirs = NULL;
+}
+
+/**
+@brief Give a stage a new command line.
+@param o The optimizer state.
+@param n The stage.
+@param name The command.
+@param count A number argument, or -1 for none.
+*/
+void lsh_opt_command(struct lsh_opt *o, struct lsh_node *n, char *name, long long count)
+{
+	char buf[24];
+
+	n->argv = realloc(n->argv, 3 * sizeof(char *));
+	if (!n->argv) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	n->argv[0] = name;
+	n->argv[1] = NULL;
+	n->argv[2] = NULL;
+	if (count >= 0) {
+		buf[lsh_fmt_ll(count, buf)] = '\0';
+		n->argv[1] = lsh_table_strdup(&o->text, buf);
+	}
+}
+
+/**
+@brief Replace stages i to i + k - 1 by stage i, freeing the others.
+*/
+void lsh_opt_remove(struct lsh_node **st, int *count, int i, int k)
+{
+	int j;
+
+	for (j = i + 1; j < i + k; j++) {
+		lsh_node_free(st[j]);
+	}
+	memmove(st + i + 1, st + i + k, (*count - i - k) * sizeof(struct lsh_node *));
+	*count -= k - 1;
+}
+
+/**
+@brief Make "seq [first [inc]] last" stop at its count-th number.
+@param o The optimizer state.
+@param n The seq stage.
+@param count How many numbers are wanted, at least 1.
+@return Nonzero if it was rewritten.
+*/
+int lsh_opt_seq(struct lsh_opt *o, struct lsh_node *n, long long count)
+{
+	long long first = 1, inc = 1, last, stop;
+	char buf[24];
+	int argc;
+
+	for (argc = 0; n->argv[argc + 1] != NULL; argc++) {
+	}
+	if (argc < 1 || argc > 3 || lsh_parse_ll(n->argv[argc], &last) != 0 ||
+		(argc >= 2 && lsh_parse_ll(n->argv[1], &first) != 0) ||
+		(argc == 3 && lsh_parse_ll(n->argv[2], &inc) != 0) || inc == 0) {
+		return 0;
+	}
+	if (__builtin_mul_overflow(count - 1, inc, &stop) || __builtin_add_overflow(first, stop, &stop) ||
+		(inc > 0 ? stop >= last : stop <= last)) {
+		return 0;
+	}
+	buf[lsh_fmt_ll(stop, buf)] = '\0';
+	n->argv[argc] = lsh_table_strdup(&o->text, buf);
+	return 1;
+}
+
+/**
+@brief Try the rewrites on the stages starting at one.
+@param o The optimizer state.
+@param st The pipeline's stages.
+@param count Number of stages, updated.
+@param i The first stage to look at.
+@return Number of stages the rewrite left at i, or 0 if none applied.
+*/
+int lsh_opt_rewrite(struct lsh_opt *o, struct lsh_node **st, int *count, int i)
+{
+	struct lsh_node *tmp;
+	long long n;
+	int k, more = *count - i - 1;
+
+	if (more < 1) {
+		return 0;
+	}
+	// A generator stops early, or its reader does.
+	if ((n = lsh_opt_head(st[i + 1])) >= 0 && !(lsh_opt_redirected(st[i]) & 1 << STDOUT_FILENO)) {
+		if (n > 0 && lsh_opt_is(st[i], "seq", -1) && lsh_opt_seq(o, st[i], n)) {
+			lsh_opt_move_redirs(st[i], st[i + 1]);
+			lsh_opt_remove(st, count, i, 2);
+			return 1;
+		}
+		if (lsh_stage_kind(st[i], 0) == LSH_STAGE_THREAD) {
+			lsh_opt_command(o, st[i + 1], "take", n);
+			return 2;
+		}
+		return 0;
+	}
+	// A file cat reads becomes the next stage's input.
+	if (lsh_opt_is(st[i], "cat", 1) && st[i]->redirs == NULL && st[i]->argv[1][0] != '-' &&
+		!(lsh_opt_redirected(st[i + 1]) & 1 << STDIN_FILENO) &&
+		(st[i + 1]->type == LSH_NODE_GROUP || st[i + 1]->argv[0] != NULL)) {
+		st[i]->redirs = calloc(1, sizeof(struct lsh_redir));
+		if (!st[i]->redirs) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		st[i]->redirs->fd = STDIN_FILENO;
+		st[i]->redirs->flags = O_RDONLY;
+		st[i]->redirs->path = st[i]->argv[1];
+		st[i]->redirs->next = st[i + 1]->redirs;
+		st[i + 1]->redirs = st[i]->redirs;
+		st[i]->redirs = NULL;
+		tmp = st[i];
+		st[i] = st[i + 1];
+		st[i + 1] = tmp;
+		lsh_opt_remove(st, count, i, 2);
+		return 1;
+	}
+	// Counting duplicate lines by sorting twice.
+	if (more >= 2 && lsh_opt_is(st[i], "sort", 0) && !(lsh_opt_redirected(st[i]) & ~(1 << STDIN_FILENO)) &&
+		lsh_opt_is(st[i + 1], "uniq", 1) && strcmp(st[i + 1]->argv[1], "-c") == 0 &&
+		st[i + 1]->redirs == NULL && lsh_opt_sort_rn(st[i + 2])) {
+		k = 3;
+		n = -1;
+		if (more >= 3 && st[i + 2]->redirs == NULL && (n = lsh_opt_head(st[i + 3])) >= 0) {
+			k = 4;
+		}
+		if (lsh_opt_redirected(st[i + k - 1]) & 1 << STDIN_FILENO) {
+			return 0;
+		}
+		lsh_opt_command(o, st[i], "topk", n);
+		lsh_opt_move_redirs(st[i], st[i + k - 1]);
+		lsh_opt_remove(st, count, i, k);
+		return 1;
+	}
+	// Counting matching lines.
+	if (lsh_opt_is(st[i], "grep", -1) && lsh_builtin_handles(st[i]->argv) && lsh_opt_grep_lines(st[i]) &&
+		!(lsh_opt_redirected(st[i]) & 1 << STDOUT_FILENO) && lsh_opt_is(st[i + 1], "wc", 1) &&
+		strcmp(st[i + 1]->argv[1], "-l") == 0 && !(lsh_opt_redirected(st[i + 1]) & 1 << STDIN_FILENO)) {
+		st[i]->argv[0] = "grep-count";
+		lsh_opt_move_redirs(st[i], st[i + 1]);
+		lsh_opt_remove(st, count, i, 2);
+		return 1;
+	}
+	return 0;
+}
+
+struct lsh_node *lsh_opt_node(struct lsh_opt *o, struct lsh_node *n);
+
+/**
+@brief Rewrite a pipeline.
+@param o The optimizer state.
+@param n The pipeline's top node.
+@return The rewritten pipeline.
+*/
+struct lsh_node *lsh_opt_pipe(struct lsh_opt *o, struct lsh_node *n)
+{
+	struct lsh_sink before = { 0, NULL, 0, 0 };
+	struct lsh_node **st, *m, *next;
+	int count = 1, i, k, background = n->background;
+
+	for (m = n; m->type == LSH_NODE_PIPE; m = m->left) {
+		count++;
+	}
+	st = malloc(count * sizeof(struct lsh_node *));
+	if (!st) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	// Take the stages out of the spine and free its nodes.
+	for (i = count - 1, m = n; m->type == LSH_NODE_PIPE; m = next, i--) {
+		st[i] = lsh_opt_node(o, m->right);
+		next = m->left;
+		m->left = m->right = NULL;
+		lsh_node_free(m);
+	}
+	st[0] = lsh_opt_node(o, m);
+	st[0]->background = 0;
+
+	for (i = 0; i < count; i++) {
+		before.len = 0;
+		lsh_plan_stages(&before, st + i, count - i);
+		if ((k = lsh_opt_rewrite(o, st, &count, i)) == 0) {
+			continue;
+		}
+		lsh_sink_write(&o->log, "  ", 2);
+		lsh_sink_write(&o->log, before.buf, before.len);
+		lsh_sink_write(&o->log, "\n    => ", 8);
+		lsh_plan_stages(&o->log, st + i, count - i);
+		lsh_sink_write(&o->log, "\n", 1);
+		// The result may fuse further.
+		i--;
+	}
+	free(before.buf);
+
+	n = st[0];
+	for (i = 1; i < count; i++) {
+		n = lsh_node_new(LSH_NODE_PIPE, n, st[i]);
+	}
+	n->background = background;
+	free(st);
+	return n;
+}
+
+/**
+@brief Rewrite the pipelines in a tree.
+@param o The optimizer state.
+@param n The tree.
+@return The rewritten tree.
+*/
+struct lsh_node *lsh_opt_node(struct lsh_opt *o, struct lsh_node *n)
+{
+	struct lsh_subst *s;
+
+	if (n == NULL) {
+		return NULL;
+	}
+	for (s = n->substs; s != NULL; s = s->next) {
+		s->body = lsh_opt_node(o, s->body);
+	}
+	if (n->type == LSH_NODE_PIPE) {
+		return lsh_opt_pipe(o, n);
+	}
+	if (n->type != LSH_NODE_CMD) {
+		n->left = lsh_opt_node(o, n->left);
+		n->right = lsh_opt_node(o, n->right);
+	}
+	return n;
+}
+
+/**
+@brief Parse and run one command line.
+@param line The line.
+@return 1 if the shell should continue running, 0 if it should terminate.
+*/
+int lsh_run_line(char *line)
+{
+	struct lsh_sink plan = { 0, NULL, 0, 0 };
+	struct lsh_parser p;
+	struct lsh_opt o;
+	struct lsh_node *n;
+
+	p.tok = lsh_split_line(line);
+	p.pos = 0;
+	p.error = NULL;
+	n = lsh_parse_list(&p);
+	if (p.error == NULL && p.tok[p.pos] != NULL) {
+		lsh_parse_error(&p);
+	}
+	if (p.error != NULL) {
+		fprintf(stderr, "lsh: syntax error near \"%s\"\n", p.error);
+		lsh_last_status = 2;
+		lsh_node_free(n);
+		free(p.tok);
+		return 1;
+	}
+	memset(&o, 0, sizeof(o));
+	if (lsh_explain || lsh_options[LSH_OPT_OPTIMIZE].value) {
+		n = lsh_opt_node(&o, n);
+	}
+	if (lsh_explain) {
+		if (n != NULL) {
+			lsh_out_write("plan: ", 6);
+			lsh_plan_node(&plan, n);
+			lsh_out_write(plan.buf, plan.len);
+			lsh_out_write("\n", 1);
+			lsh_out_write(o.log.buf, o.log.len);
+			lsh_out_flush();
+		}
+	}
+	else {
+		lsh_interrupt_clear();
+		lsh_exec_node(n);
+	}
+	lsh_node_free(n);
+	free(p.tok);
+	free(plan.buf);
+	free(o.log.buf);
+	lsh_table_free(&o.text);
+	if (lsh_exiting) {
+		lsh_exiting = 0;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+@brief Loop getting input and executing it.
+*/
+void lsh_loop(void)
+{
+	char *line;
+	int status;
+
+	do {
+		lsh_job_notify();
+		lsh_prompt();
+		line = lsh_read_line();
+		lsh_hist_add(line);
+		status = lsh_run_line(line);
+
+		free(line);
+	} while (status);
+}
+
+/**
+@brief Run a script: each line is a command, as if typed at the prompt.
+@param script The script text.
+@return 1 if the shell should continue running, 0 if a command exited it.
+*/
+int lsh_run_script(const char *script)
+{
+	char *copy, *line, *next;
+	int status = 1;
+
+	copy = strdup(script);
+	if (!copy) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (line = copy; line != NULL && status; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL) {
+			*next++ = '\0';
+		}
+		status = lsh_run_line(line);
+	}
+	free(copy);
+	lsh_out_flush();
+	fflush(stdout);
+	return status;
+}
+
 /*
-Builtin function implementations.
+Server mode.  One warm shell (config loaded, PATH cache and history model
+filled) listens on a Unix socket and forks a session for every request.  A
+request is a 32-bit length and "cwd\0script", sent with the client's stdin,
+stdout and stderr attached as SCM_RIGHTS; the reply is the script's 32-bit
+exit status.
+*/
+#define LSH_SERVER_MAX (1 << 20)
+
+int lsh_server_fd = -1;
+const char *lsh_server_path = NULL;
+
+/**
+@brief Read exactly len bytes from a socket.
+@return 0 on success, -1 on error or early end of file.
+*/
+int lsh_recv_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+@brief Write exactly len bytes to a socket.
+@return 0 on success, -1 on error.
 */
+int lsh_send_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
 
 /**
-@brief Bultin command: echo argument.
-@param args List of args.  args[0] is "echo".  args[1] is the string for echoing.
-@return Always returns 1, to continue executing.
+@brief Serve one request, in the forked session process.
+@param conn The connection.
 */
-int lsh_echo(char **args)
+void lsh_server_session(int conn)
 {
-	int i = 1;
-	while (args[i] != NULL) {
-		printf("%s ", args[i]);
-		i++;
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t len;
+	int32_t status;
+	int fds[3], i, nfds = 0;
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	char *payload;
+
+	// This process serves only this request.  The epoll set is still the
+	// server's until it is replaced, so replace it before removing anything.
+	lsh_event_after_fork();
+	lsh_event_del(lsh_server_fd);
+	close(lsh_server_fd);
+	lsh_job_forget_all();
+
+	// The socket's mode keeps other users out; check anyway.
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0 || cred.uid != getuid()) {
+		_exit(EXIT_FAILURE);
 	}
-	printf("\n");
-	return 1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(conn, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(len)) {
+		_exit(EXIT_FAILURE);
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), (nfds > 3 ? 3 : nfds) * sizeof(int));
+		}
+	}
+	// The payload is "cwd\0script"; without the separator there is no script.
+	if (nfds != 3 || len == 0 || len > LSH_SERVER_MAX || (payload = malloc(len + 1)) == NULL ||
+		lsh_recv_all(conn, payload, len) != 0 || memchr(payload, '\0', len) == NULL) {
+		_exit(EXIT_FAILURE);
+	}
+	payload[len] = '\0';
+
+	for (i = 0; i < 3; i++) {
+		dup2(fds[i], i);
+		close(fds[i]);
+	}
+	if (chdir(payload) != 0) {
+		perror("lsh");
+	}
+	lsh_last_status = 0;
+	lsh_run_script(payload + strlen(payload) + 1);
+
+	status = lsh_last_status;
+	lsh_send_all(conn, &status, sizeof(status));
+	// Skip atexit handlers: they belong to the server.
+	_exit(EXIT_SUCCESS);
 }
 
 /**
-@brief Bultin command: print current directory.
-@param args List of args.  args[0] is "cd".  args[1] is the directory.
-@return Always returns 1, to continue executing.
+@brief Job callback: a session exited.
+@param id The job id.
+@param data Unused.
 */
-int lsh_pwd(char **args)
+void lsh_server_done(int id, void *data)
 {
-	char cwd[1024];
-	getcwd(cwd, sizeof(cwd));
-	printf("Current working dir: %s\n", cwd);
-	return 1;
+	lsh_job_reap(id);
 }
 
 /**
-@brief Bultin command: change directory.
-@param args List of args.  args[0] is "cd".  args[1] is the directory.
-@return Always returns 1, to continue executing.
+@brief Event callback: accept clients and fork a session for each.
+@param fd The listening socket.
+@param data Unused.
 */
-int lsh_cd(char **args)
+void lsh_server_accept(int fd, void *data)
 {
-	if (args[1] == NULL) {
-		fprintf(stderr, "lsh: expected argument to \"cd\"\n");
-	}
-	else {
-		if (chdir(args[1]) != 0) {
+	pid_t pid;
+	int conn, id;
+
+	while ((conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		pid = fork();
+		if (pid == 0) {
+			lsh_server_session(conn);
+		}
+		close(conn);
+		if (pid < 0) {
 			perror("lsh");
+			continue;
+		}
+		id = lsh_job_add(pid);
+		lsh_jobs[id].fn = lsh_server_done;
+		if (lsh_jobs[id].done) {
+			lsh_job_reap(id);
 		}
 	}
-	return 1;
 }
 
 /**
-@brief Bultin command: list current directory.
-@param args List of args.  args[0] is "ls".
-@return Always returns 1, to continue executing.
+@brief Remove the server socket on exit.
 */
-int lsh_ls(char **args)
+void lsh_server_cleanup(void)
 {
-	DIR *dp;
-	struct dirent *ep;
-
-	dp = opendir("./");
-	if (dp != NULL) {
-		while (ep = readdir(dp)) {
-			printf("%s\n", ep->d_name);
-		}
-		closedir(dp);
-	}
-	else {
-		perror("Couldn't open the directory");
+	if (lsh_server_path != NULL) {
+		unlink(lsh_server_path);
 	}
-	return 1;
 }
 
 /**
-@brief Bultin command: make directory.
-@param args List of args.  args[0] is "mkdir".  args[1] is the directory.
-@return Always returns 1, to continue executing.
+@brief Run as a server until interrupted.
+@param path Socket path.
+@return Exit status.
 */
-int lsh_mkdir(char **args)
+int lsh_server(const char *path)
 {
-	if (args[1] == NULL) {
-		fprintf(stderr, "lsh: expected argument to \"mkdir\"\n");
+	struct sockaddr_un addr;
+	mode_t mask;
+	int bound;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "lsh: server: socket path too long\n");
+		return EXIT_FAILURE;
 	}
-	else {
-		if (mkdir(args[1], 0755) != 0) {
-			perror("lsh");
-		}
+	strcpy(addr.sun_path, path);
+	lsh_server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	unlink(path);
+	// Whoever can connect can run scripts as us: the socket is ours alone.
+	mask = umask(0177);
+	bound = lsh_server_fd >= 0 && bind(lsh_server_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+	umask(mask);
+	if (!bound || listen(lsh_server_fd, SOMAXCONN) != 0 ||
+		lsh_event_add(lsh_server_fd, lsh_server_accept, NULL) != 0) {
+		perror("lsh: server");
+		return EXIT_FAILURE;
 	}
-	return 1;
-}
+	lsh_server_path = path;
+	atexit(lsh_server_cleanup);
 
+	while (!lsh_interrupted) {
+		lsh_event_wait(-1);
+	}
+	return EXIT_SUCCESS;
+}
 
 /**
-@brief Builtin command: print help.
-@param args List of args.  Not examined.
-@return Always returns 1, to continue executing.
+@brief Send a script to a server, with this process's stdio, and wait for
+its exit status.
+@param path Socket path.
+@param script The script.
+@return The script's exit status.
 */
-int lsh_help(char **args)
+int lsh_client(const char *path, const char *script)
 {
-	int i;
-	printf("Stephen Brennan's LSH\n");
-	printf("Type program names and arguments, and hit enter.\n");
-	printf("The following are built in:\n");
+	char control[CMSG_SPACE(3 * sizeof(int))], cwd[4096];
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t len;
+	int32_t status;
+	int fd, fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	char *buf;
+	ssize_t n, total;
 
-	for (i = 0; i < lsh_num_builtins(); i++) {
-		printf("  %s\n", builtin_str[i]);
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		strcpy(cwd, "/");
+	}
+	len = strlen(cwd) + 1 + strlen(script);
+	if (len > LSH_SERVER_MAX) {
+		fprintf(stderr, "lsh: client: script too long\n");
+		return EXIT_FAILURE;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		perror("lsh: client");
+		return EXIT_FAILURE;
 	}
 
-	printf("Use the man command for information on other programs.\n");
-	return 1;
+	total = sizeof(len) + len;
+	buf = malloc(total);
+	if (!buf) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(buf, &len, sizeof(len));
+	memcpy(buf + sizeof(len), cwd, strlen(cwd) + 1);
+	memcpy(buf + sizeof(len) + strlen(cwd) + 1, script, strlen(script));
+	iov.iov_base = buf;
+	iov.iov_len = total;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	// The fds travel with the first byte; a long script may need more writes.
+	n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	if (n < 0 || (n < total && lsh_send_all(fd, buf + n, total - n) != 0)) {
+		perror("lsh: client");
+		return EXIT_FAILURE;
+	}
+	free(buf);
+	if (lsh_recv_all(fd, &status, sizeof(status)) != 0) {
+		fprintf(stderr, "lsh: client: server closed the connection\n");
+		return 255;
+	}
+	close(fd);
+	return status;
 }
 
+/*
+Startup config.  The rc file (~/.aashrc, or $AASHRC) is a script run at
+startup.  If it only changes shell state (set, export, hash), that state is
+saved to a snapshot image, and later shells map the image instead of
+running the rc file, as long as the rc file is unchanged.  The image holds
+a header, fixed size records, and the strings they point to by offset:
+
+	header | options (name, value) | env (string) | hash (name, path) | strings
+*/
+#define LSH_SNAP_MAGIC "AASHSNP1"
+
+struct lsh_snap_header {
+	char magic[8];
+	uint32_t size;
+	uint32_t path_off;
+	int64_t rc_sec;
+	int64_t rc_nsec;
+	uint64_t rc_size;
+	uint64_t rc_ino;
+	uint32_t nopts;
+	uint32_t nenv;
+	uint32_t nhash;
+	uint32_t pad;
+};
+
+struct lsh_snap_opt {
+	uint32_t name;
+	int32_t value;
+};
+
+struct lsh_snap_hash {
+	uint32_t name;
+	uint32_t path;
+};
+
+struct lsh_snap_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
 /**
-@brief Builtin command: exit.
-@param args List of args.  Not examined.
-@return Always returns 0, to terminate execution.
+@brief Append bytes to the image being built.
+@return The offset they were written at.
 */
-int lsh_exit(char **args)
+uint32_t lsh_snap_put(struct lsh_snap_buf *b, const void *data, size_t len)
 {
-	return 0;
+	size_t off = b->len;
+
+	if (b->len + len > b->cap) {
+		b->cap = (b->len + len) * 2;
+		b->data = realloc(b->data, b->cap);
+		if (!b->data) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(b->data + off, data, len);
+	b->len += len;
+	return off;
 }
 
 /**
-@brief Launch a program and wait for it to terminate.
-@param args Null terminated list of arguments (including program).
-@return Always returns 1, to continue execution.
+@brief Locate the snapshot image for an rc file.  Each rc file has its own,
+named by a hash of its resolved path.
+@param buf Buffer for the path.
+@param size Size of buf.
+@param rc The rc file.
+@param create Nonzero to create the cache directory.
+@return 0 on success, -1 if there is no cache directory.
 */
-int lsh_launch(char **args)
+int lsh_snap_path(char *buf, size_t size, const char *rc, int create)
 {
-	pid_t pid;
-	int status;
+	char dir[4096], real[PATH_MAX];
 
-	pid = fork();
-	if (pid == 0) {
-		// Child process
-		if (execvp(args[0], args) == -1) {
-			perror("lsh");
-		}
-		exit(EXIT_FAILURE);
-	}
-	else if (pid < 0) {
-		// Error forking
-		perror("lsh");
+	if (lsh_cache_dir(dir, sizeof(dir), create) != 0) {
+		return -1;
 	}
-	else {
-		// Parent process
-		do {
-			waitpid(pid, &status, WUNTRACED);
-		} while (!WIFEXITED(status) && !WIFSIGNALED(status));
+	if (realpath(rc, real) != NULL) {
+		rc = real;
 	}
-
-	return 1;
+	snprintf(buf, size, "%s/rc-%016llx.snap", dir, (unsigned long long) lsh_xxh64(rc, strlen(rc), 0));
+	return 0;
 }
 
 /**
-@brief Execute shell built-in or launch program.
-@param args Null terminated list of arguments.
-@return 1 if the shell should continue running, 0 if it should terminate
+@brief Map a snapshot and apply it, if it matches the rc file.
+@param file The rc file.
+@param rc The rc file's stat.
+@return 0 if the snapshot was applied, -1 otherwise.
 */
-int lsh_execute(char **args)
+int lsh_snap_load(const char *file, const struct stat *rc)
 {
-	int i;
+	const struct lsh_snap_header *h;
+	const struct lsh_snap_opt *opt;
+	const struct lsh_snap_hash *hash;
+	const uint32_t *env;
+	const char *path = getenv("PATH");
+	char name[4200], *map, *copy;
+	struct stat st;
+	size_t records;
+	uint32_t i;
+	int fd, j;
 
-	if (args[0] == NULL) {
-		// An empty command was entered.
-		return 1;
+	if (lsh_snap_path(name, sizeof(name), file, 0) != 0 || (fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(*h) || st.st_size > UINT32_MAX) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
 	}
 
-	for (i = 0; i < lsh_num_builtins(); i++) {
-		if (strcmp(args[0], builtin_str[i]) == 0) {
-			return (*builtin_func[i])(args);
+	h = (const struct lsh_snap_header *) map;
+	records = sizeof(*h) + h->nopts * sizeof(*opt) + h->nenv * sizeof(*env) + h->nhash * sizeof(*hash);
+	// Every offset is checked against the size, and the image ends in a
+	// NUL, so every string is terminated inside the mapping.
+	if (memcmp(h->magic, LSH_SNAP_MAGIC, 8) != 0 || h->size != st.st_size || map[st.st_size - 1] != '\0' ||
+		h->nopts > 1024 || h->nenv > 65536 || h->nhash > 65536 || records > h->size ||
+		h->rc_sec != rc->st_mtim.tv_sec || h->rc_nsec != rc->st_mtim.tv_nsec ||
+		h->rc_size != (uint64_t) rc->st_size || h->rc_ino != (uint64_t) rc->st_ino ||
+		h->path_off >= h->size || strcmp(map + h->path_off, path ? path : "") != 0) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+	opt = (const struct lsh_snap_opt *) (h + 1);
+	env = (const uint32_t *) (opt + h->nopts);
+	hash = (const struct lsh_snap_hash *) (env + h->nenv);
+	for (i = 0; i < h->nopts + h->nenv + h->nhash; i++) {
+		if ((i < h->nopts && opt[i].name >= h->size) ||
+			(i >= h->nopts && i < h->nopts + h->nenv && env[i - h->nopts] >= h->size) ||
+			(i >= h->nopts + h->nenv && (hash[i - h->nopts - h->nenv].name >= h->size ||
+			hash[i - h->nopts - h->nenv].path >= h->size))) {
+			munmap(map, st.st_size);
+			return -1;
 		}
 	}
 
-	return lsh_launch(args);
+	// The environment strings are used in place, so the image stays mapped.
+	for (i = 0; i < h->nenv; i++) {
+		putenv(map + env[i]);
+	}
+	for (i = 0; i < h->nopts; i++) {
+		for (j = 0; j < lsh_num_options(); j++) {
+			if (strcmp(lsh_options[j].name, map + opt[i].name) == 0 && lsh_options[j].value != opt[i].value) {
+				lsh_options[j].value = opt[i].value;
+				if (lsh_options[j].changed != NULL) {
+					lsh_options[j].changed(lsh_options[j].value);
+				}
+			}
+		}
+	}
+	for (i = 0; i < h->nhash; i++) {
+		if ((copy = strdup(map + hash[i].path)) == NULL) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		lsh_path_insert(map + hash[i].name, copy);
+	}
+	return 0;
 }
 
-#define LSH_RL_BUFSIZE 1024
 /**
-@brief Read a line of input from stdin.
-@return The line from stdin.
+@brief Save the shell state the rc file set up as a snapshot image.
+@param file The rc file.
+@param rc The rc file's stat.
+@param path PATH before the rc file ran.
+@param before The environment before the rc file ran.
+@param nbefore Number of entries in before.
 */
-char *lsh_read_line(void)
+void lsh_snap_save(const char *file, const struct stat *rc, const char *path, char **before, int nbefore)
 {
-	int bufsize = LSH_RL_BUFSIZE;
-	int position = 0;
-	char *buffer = malloc(sizeof(char) * bufsize);
-	int c;
+	extern char **environ;
+	struct lsh_snap_header h;
+	struct lsh_snap_opt *opts;
+	struct lsh_snap_hash *hash;
+	struct lsh_snap_buf b = { NULL, 0, 0 }, strs = { NULL, 0, 0 };
+	struct lsh_path_entry *e;
+	uint32_t *env, base;
+	char name[4200], tmp[4300];
+	int i, j, nenv = 0, nhash = 0, fd;
 
-	if (!buffer) {
+	for (i = 0; environ[i] != NULL; i++) {
+	}
+	env = calloc(i + 1, sizeof(uint32_t));
+	opts = calloc(lsh_num_options(), sizeof(*opts));
+	for (i = 0; i < LSH_PATH_CACHE_SIZE; i++) {
+		for (e = lsh_path_cache[i]; e != NULL; e = e->next) {
+			nhash++;
+		}
+	}
+	hash = calloc(nhash + 1, sizeof(*hash));
+	if (!env || !opts || !hash) {
 		fprintf(stderr, "lsh: allocation error\n");
 		exit(EXIT_FAILURE);
 	}
 
-	while (1) {
-		// Read a character
-		c = getchar();
-
-		if (c == EOF) {
-			exit(EXIT_SUCCESS);
+	// String offsets are relative to the string area until it is placed.
+	memset(&h, 0, sizeof(h));
+	h.path_off = lsh_snap_put(&strs, path ? path : "", path ? strlen(path) + 1 : 1);
+	for (i = 0; i < lsh_num_options(); i++) {
+		opts[i].name = lsh_snap_put(&strs, lsh_options[i].name, strlen(lsh_options[i].name) + 1);
+		opts[i].value = lsh_options[i].value;
+	}
+	for (i = 0; environ[i] != NULL; i++) {
+		for (j = 0; j < nbefore && before[j] != environ[i]; j++) {
 		}
-		else if (c == '\n') {
-			buffer[position] = '\0';
-			return buffer;
+		if (j == nbefore) {
+			env[nenv++] = lsh_snap_put(&strs, environ[i], strlen(environ[i]) + 1);
 		}
-		else {
-			buffer[position] = c;
+	}
+	nhash = 0;
+	for (i = 0; i < LSH_PATH_CACHE_SIZE; i++) {
+		for (e = lsh_path_cache[i]; e != NULL; e = e->next) {
+			hash[nhash].name = lsh_snap_put(&strs, e->name, strlen(e->name) + 1);
+			hash[nhash++].path = lsh_snap_put(&strs, e->path, strlen(e->path) + 1);
 		}
-		position++;
+	}
 
-		// If we have exceeded the buffer, reallocate.
-		if (position >= bufsize) {
-			bufsize += LSH_RL_BUFSIZE;
-			buffer = realloc(buffer, bufsize);
-			if (!buffer) {
-				fprintf(stderr, "lsh: allocation error\n");
-				exit(EXIT_FAILURE);
+	base = sizeof(h) + lsh_num_options() * sizeof(*opts) + nenv * sizeof(*env) + nhash * sizeof(*hash);
+	memcpy(h.magic, LSH_SNAP_MAGIC, 8);
+	h.size = base + strs.len;
+	h.path_off += base;
+	h.rc_sec = rc->st_mtim.tv_sec;
+	h.rc_nsec = rc->st_mtim.tv_nsec;
+	h.rc_size = rc->st_size;
+	h.rc_ino = rc->st_ino;
+	h.nopts = lsh_num_options();
+	h.nenv = nenv;
+	h.nhash = nhash;
+	for (i = 0; i < lsh_num_options(); i++) {
+		opts[i].name += base;
+	}
+	for (i = 0; i < nenv; i++) {
+		env[i] += base;
+	}
+	for (i = 0; i < nhash; i++) {
+		hash[i].name += base;
+		hash[i].path += base;
+	}
+	lsh_snap_put(&b, &h, sizeof(h));
+	lsh_snap_put(&b, opts, lsh_num_options() * sizeof(*opts));
+	lsh_snap_put(&b, env, nenv * sizeof(*env));
+	lsh_snap_put(&b, hash, nhash * sizeof(*hash));
+	lsh_snap_put(&b, strs.data, strs.len);
+
+	if (lsh_snap_path(name, sizeof(name), file, 1) == 0) {
+		snprintf(tmp, sizeof(tmp), "%s.XXXXXX", name);
+		if ((fd = mkostemp(tmp, O_CLOEXEC)) >= 0) {
+			if (lsh_send_all(fd, b.data, b.len) != 0 || close(fd) != 0 || rename(tmp, name) != 0) {
+				unlink(tmp);
 			}
 		}
 	}
+	free(env);
+	free(opts);
+	free(hash);
+	free(b.data);
+	free(strs.data);
 }
 
-#define LSH_TOK_BUFSIZE 64
-#define LSH_TOK_DELIM " \t\r\n\a"
 /**
-@brief Split a line into tokens (very naively).
-@param line The line.
-@return Null-terminated array of tokens.
+@brief Load the rc file, from its snapshot if that is current.
 */
-char **lsh_split_line(char *line)
+void lsh_rc_load(void)
 {
-	int bufsize = LSH_TOK_BUFSIZE, position = 0;
-	char **tokens = malloc(bufsize * sizeof(char*));
-	char *token, **tokens_backup;
+	extern char **environ;
+	const char *rc = getenv("AASHRC"), *home = getenv("HOME");
+	char name[4096], snap[4200], **before, **args, *text, *line, *next, *path;
+	struct stat st;
+	size_t len;
+	void *data;
+	int i, n, err, pure = 1, status = 1;
 
-	if (!tokens) {
+	if (rc == NULL) {
+		if (home == NULL) {
+			return;
+		}
+		snprintf(name, sizeof(name), "%s/.aashrc", home);
+		rc = name;
+	}
+	if (stat(rc, &st) != 0) {
+		return;
+	}
+	if (lsh_snap_load(rc, &st) == 0) {
+		return;
+	}
+
+	data = lsh_map_file(rc, &len, &err);
+	if (err != 0) {
+		fprintf(stderr, "lsh: %s: %s\n", rc, strerror(err));
+		return;
+	}
+	text = malloc(len + 1);
+	for (n = 0; environ[n] != NULL; n++) {
+	}
+	before = malloc((n + 1) * sizeof(char *));
+	path = getenv("PATH") ? strdup(getenv("PATH")) : NULL;
+	if (!text || !before) {
 		fprintf(stderr, "lsh: allocation error\n");
 		exit(EXIT_FAILURE);
 	}
+	memcpy(text, data ? data : "", len);
+	text[len] = '\0';
+	if (data) {
+		munmap(data, len);
+	}
+	memcpy(before, environ, (n + 1) * sizeof(char *));
 
-	token = strtok(line, LSH_TOK_DELIM);
-	while (token != NULL) {
-		tokens[position] = token;
-		position++;
-
-		if (position >= bufsize) {
-			bufsize += LSH_TOK_BUFSIZE;
-			tokens_backup = tokens;
-			tokens = realloc(tokens, bufsize * sizeof(char*));
-			if (!tokens) {
-				free(tokens_backup);
-				fprintf(stderr, "lsh: allocation error\n");
-				exit(EXIT_FAILURE);
-			}
+	for (line = text; line != NULL && status; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL) {
+			*next++ = '\0';
 		}
+		args = lsh_split_line(line);
+		for (i = 0; args[i] != NULL && !lsh_is_op(args[i], NULL); i++) {
+		}
+		if (args[0] != NULL && (args[i] != NULL || (strcmp(args[0], "set") != 0 &&
+			strcmp(args[0], "export") != 0 && strcmp(args[0], "hash") != 0))) {
+			pure = 0;
+		}
+		free(args);
+		status = lsh_run_line(line);
+	}
+	lsh_out_flush();
+	fflush(stdout);
 
-		token = strtok(NULL, LSH_TOK_DELIM);
+	// Anything else (cd, starting jobs) has effects an image cannot replay.
+	if (pure) {
+		lsh_snap_save(rc, &st, path, before, n);
 	}
-	tokens[position] = NULL;
-	return tokens;
+	else if (lsh_snap_path(snap, sizeof(snap), rc, 0) == 0) {
+		unlink(snap);
+	}
+	free(before);
+	free(path);
+	free(text);
+}
+
+/*
+Startup profile.  The constructor runs right after the dynamic linker and
+libc are done; the CPU time the process has used by then is what linking
+and relocation cost.  Wall-clock time since exec cannot be read that
+precisely, so every phase is measured in process CPU time, and the phases
+add up to the total.
+*/
+#define LSH_PROFILE_MAX 8
+
+struct lsh_profile_mark {
+	const char *phase;
+	struct timespec at;
+};
+
+struct lsh_profile_mark lsh_profile[LSH_PROFILE_MAX];
+int lsh_profile_n = 0;
+
+__attribute__((constructor)) void lsh_profile_start(void)
+{
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &lsh_profile[0].at);
+	lsh_profile[0].phase = "link";
+	lsh_profile_n = 1;
 }
 
 /**
-@brief Loop getting input and executing it.
+@brief Record the end of a startup phase.
+@param phase Name of the phase that just finished.
 */
-void lsh_loop(void)
+void lsh_profile_mark(const char *phase)
 {
-	char *line;
-	char **args;
-	int status;
+	if (lsh_profile_n < LSH_PROFILE_MAX) {
+		lsh_profile[lsh_profile_n].phase = phase;
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &lsh_profile[lsh_profile_n++].at);
+	}
+}
 
-	do {
-		printf("> ");
-		line = lsh_read_line();
-		args = lsh_split_line(line);
-		status = lsh_execute(args);
+/**
+@brief Milliseconds between two times.
+*/
+double lsh_ms_between(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
 
-		free(line);
-		free(args);
-	} while (status);
+/**
+@brief Print the startup profile to stderr.
+*/
+void lsh_profile_report(void)
+{
+	struct timespec zero = { 0, 0 };
+	int i;
+
+	for (i = 0; i < lsh_profile_n; i++) {
+		fprintf(stderr, "%-10s %8.3f ms\n", lsh_profile[i].phase,
+			lsh_ms_between(i > 0 ? &lsh_profile[i - 1].at : &zero, &lsh_profile[i].at));
+	}
+	fprintf(stderr, "%-10s %8.3f ms\n", "total", lsh_ms_between(&zero, &lsh_profile[lsh_profile_n - 1].at));
+	fprintf(stderr, "history, PATH cache and CPU topology load on first use\n");
+}
+
+/**
+@brief Measure how many times per second this shell can start and run
+"-c true".
+@param count Number of runs.
+@return Exit status.
+*/
+int lsh_bench_startup(long count)
+{
+	char *args[] = { "/proc/self/exe", "-c", "true", NULL };
+	struct timespec start, end;
+	double ms;
+	long i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		if (lsh_run(args) != 0) {
+			fprintf(stderr, "lsh: bench: run %ld failed\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ms = lsh_ms_between(&start, &end);
+	printf("%ld runs in %.1f ms: %.3f ms each, %.0f per second\n", count, ms, ms / count, count * 1000 / ms);
+	return EXIT_SUCCESS;
 }
 
 /**
@@ -348,12 +12209,72 @@ void lsh_loop(void)
 */
 int main(int argc, char **argv)
 {
+	const char *script = NULL, *server = NULL, *client = NULL;
+	long bench = 0;
+	int i, profile = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			script = argv[++i];
+		}
+		else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+			server = argv[++i];
+		}
+		else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+			client = argv[++i];
+		}
+		else if (strcmp(argv[i], "--startup-profile") == 0) {
+			profile = 1;
+		}
+		else if (strcmp(argv[i], "--bench-startup") == 0 && i + 1 < argc) {
+			bench = atol(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--explain") == 0) {
+			lsh_explain = 1;
+		}
+		else {
+			fprintf(stderr, "usage: %s [-c script] [--server sock] [--client sock -c script]\n"
+				"\t[--startup-profile] [--bench-startup count] [--explain]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (client != NULL) {
+		// Clients stay lightweight: no event loop, no config.
+		if (script == NULL) {
+			fprintf(stderr, "lsh: client: -c script is required\n");
+			return EXIT_FAILURE;
+		}
+		return lsh_client(client, script);
+	}
+
+	lsh_profile_mark("args");
+	lsh_event_init();
+	lsh_profile_mark("events");
+
 	// Load config files, if any.
+	lsh_rc_load();
+	lsh_profile_mark("rc");
+	// History is read when the first line is entered, not before the prompt.
+	lsh_hist_pending = isatty(STDIN_FILENO) && script == NULL && server == NULL;
+
+	if (profile) {
+		lsh_profile_report();
+	}
+	if (bench > 0) {
+		return lsh_bench_startup(bench);
+	}
+	if (server != NULL) {
+		return lsh_server(server);
+	}
+	if (script != NULL) {
+		lsh_run_script(script);
+		return lsh_last_status;
+	}
 
 	// Run command loop.
 	lsh_loop();
 
 	// Perform any shutdown/cleanup.
 
-	return EXIT_SUCCESS;
+	return lsh_last_status;
 }